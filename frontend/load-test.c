@@ -0,0 +1,326 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Controller handshake load test.
+
+Simulates many stubs connecting at once, without the cost of starting processes. Each simulated
+stub sends a handshake (protocol version 2), answers ENV, STDIO, STDOUT and STDERR commands and
+waits for EXIT. Measures handshakes per second and latency from connect to EXIT. Run it against
+the sample controller in benchmark mode, once with the TypeScript handshake parser and once with
+the native front end:
+
+    gcc -O3 -o frontend/frontend frontend/main.c
+    gcc -O2 -pthread -o frontend/load-test frontend/load-test.c
+    npx ts-node src/test.ts --bench &
+    frontend/load-test -n 20000 -c 256
+    npx ts-node src/test.ts --bench --frontend frontend/frontend &
+    frontend/load-test -n 20000 -c 256
+
+Options:
+    -n count        total number of simulated invocations (default 10000)
+    -c count        number of concurrently connected stubs (default 64)
+    -u count        number of different environments (default 4)
+    -e bytes        environment size (default 8192)
+    -a count        number of arguments (default 16)
+    -i id           connection id (default 0)
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CONNECTION_PREFIX "RemJobs75oKmnN7rWX"
+#define PROTOCOL_MAGIC 0x7F4A9400
+#define PROTOCOL_VERSION 2
+#define HASH_ALGORITHM_MD5 1
+#define ENV_VAR_SIZE 64
+
+typedef struct
+{
+    int sock;
+    uint8_t data[65536];
+    size_t begin;
+    size_t end;
+} connection;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+} message;
+
+static int total;
+static int next;
+static uint64_t *times;
+static message *handshakes;
+static message *environments;
+static int unique_envs = 4;
+static struct sockaddr_un server_addr;
+static socklen_t server_addr_size;
+
+static void fail(const char *message)
+{
+    perror(message);
+    exit(1);
+}
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void put_u32(message *msg, uint32_t value)
+{
+    memcpy(msg->data + msg->size, &value, 4);
+    msg->size += 4;
+}
+
+static void put_str(message *msg, const char *str)
+{
+    size_t len = strlen(str);
+    put_u32(msg, len);
+    memcpy(msg->data + msg->size, str, len);
+    msg->size += len;
+}
+
+static void build_messages(int env_size, int arg_count)
+{
+    char text[ENV_VAR_SIZE + 1];
+    int var_count = env_size / ENV_VAR_SIZE + 1;
+    int e, i;
+    handshakes = calloc(unique_envs, sizeof(message));
+    environments = calloc(unique_envs, sizeof(message));
+    for (e = 0; e < unique_envs; e++)
+    {
+        handshakes[e].data = malloc(64 + arg_count * (4 + 64) + 4096);
+        put_u32(&handshakes[e], PROTOCOL_MAGIC | PROTOCOL_VERSION);
+        put_u32(&handshakes[e], arg_count);
+        for (i = 0; i < arg_count; i++)
+        {
+            snprintf(text, sizeof(text), i == 0 ? "cc" : "-Isome/include/directory/number/%d", i);
+            put_str(&handshakes[e], text);
+        }
+        put_str(&handshakes[e], "/home/user/project/build");
+        put_u32(&handshakes[e], 17);
+        handshakes[e].data[handshakes[e].size] = HASH_ALGORITHM_MD5;
+        memset(&handshakes[e].data[handshakes[e].size + 1], 0, 16);
+        memcpy(&handshakes[e].data[handshakes[e].size + 1], &e, sizeof(e));
+        handshakes[e].size += 17;
+
+        environments[e].data = malloc(4 + var_count * (4 + ENV_VAR_SIZE));
+        put_u32(&environments[e], var_count);
+        for (i = 0; i < var_count; i++)
+        {
+            snprintf(text, sizeof(text), "LOAD_TEST_VAR_%05d_%05d=", e, i);
+            memset(text + strlen(text), 'a' + i % 26, ENV_VAR_SIZE - strlen(text));
+            text[ENV_VAR_SIZE] = 0;
+            put_str(&environments[e], text);
+        }
+    }
+}
+
+static void send_all(int sock, const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = send(sock, data, size, MSG_NOSIGNAL);
+        if (n <= 0)
+            fail("send");
+        data += n;
+        size -= n;
+    }
+}
+
+static void recv_all(connection *conn, void *data, size_t size)
+{
+    uint8_t *ptr = data;
+    while (size > 0)
+    {
+        size_t n;
+        if (conn->begin == conn->end)
+        {
+            ssize_t r = recv(conn->sock, conn->data, sizeof(conn->data), 0);
+            if (r <= 0)
+            {
+                fprintf(stderr, "Controller closed connection.\n");
+                exit(1);
+            }
+            conn->begin = 0;
+            conn->end = r;
+        }
+        n = conn->end - conn->begin < size ? conn->end - conn->begin : size;
+        if (ptr != NULL)
+        {
+            memcpy(ptr, conn->data + conn->begin, n);
+            ptr += n;
+        }
+        conn->begin += n;
+        size -= n;
+    }
+}
+
+static uint32_t recv_u32(connection *conn)
+{
+    uint32_t value;
+    recv_all(conn, &value, 4);
+    return value;
+}
+
+static void invoke(connection *conn, int index)
+{
+    int env = index % unique_envs;
+    uint32_t reply[2] = {0, 0};
+    conn->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    conn->begin = 0;
+    conn->end = 0;
+    if (conn->sock < 0)
+        fail("socket");
+    if (connect(conn->sock, (struct sockaddr *)&server_addr, server_addr_size) < 0)
+        fail("connect");
+    send_all(conn->sock, handshakes[env].data, handshakes[env].size);
+    while (true)
+    {
+        uint32_t cmd = recv_u32(conn);
+        switch (cmd)
+        {
+        case 0:
+            recv_u32(conn);
+            close(conn->sock);
+            return;
+        case 1:
+        case 2:
+            recv_all(conn, NULL, recv_u32(conn));
+            break;
+        case 3:
+            send_all(conn->sock, environments[env].data, environments[env].size);
+            break;
+        case 4:
+            // Process id and no attached descriptors.
+            send_all(conn->sock, (uint8_t *)reply, sizeof(reply));
+            break;
+        default:
+            fprintf(stderr, "Unexpected command %u.\n", cmd);
+            exit(1);
+        }
+    }
+}
+
+static void *worker(void *arg)
+{
+    connection *conn = malloc(sizeof(connection));
+    int i;
+    (void)arg;
+    while ((i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < total)
+    {
+        uint64_t start = now();
+        invoke(conn, i);
+        times[i] = now() - start;
+    }
+    free(conn);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    int concurrency = 64;
+    int env_size = 8192;
+    int arg_count = 16;
+    const char *id = "0";
+    pthread_t *threads;
+    uint64_t start;
+    double elapsed;
+    int opt;
+    int rc;
+    int i;
+
+    total = 10000;
+    while ((opt = getopt(argc, argv, "n:c:u:e:a:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            total = atoi(optarg);
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 'u':
+            unique_envs = atoi(optarg);
+            break;
+        case 'e':
+            env_size = atoi(optarg);
+            break;
+        case 'a':
+            arg_count = atoi(optarg);
+            break;
+        case 'i':
+            id = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n count] [-c count] [-u count] [-e bytes] [-a count] [-i id]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (total < 1 || concurrency < 1 || unique_envs < 1 || arg_count < 1)
+    {
+        fprintf(stderr, "Invalid arguments.\n");
+        return 1;
+    }
+
+    // Same address as the first one tried by the stub on Linux.
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    rc = snprintf(&server_addr.sun_path[1], sizeof(server_addr.sun_path) - 1, "%s/%sS", CONNECTION_PREFIX, id);
+    server_addr_size = offsetof(struct sockaddr_un, sun_path) + 1 + rc;
+
+    signal(SIGPIPE, SIG_IGN);
+    build_messages(env_size, arg_count);
+    times = malloc(total * sizeof(uint64_t));
+    threads = malloc(concurrency * sizeof(pthread_t));
+    start = now();
+    for (i = 0; i < concurrency; i++)
+    {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+            fail("pthread_create");
+    }
+    for (i = 0; i < concurrency; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = (double)(now() - start) / 1e9;
+
+    qsort(times, total, sizeof(uint64_t), compare_u64);
+    printf("%d handshakes, %d concurrent: %.0f handshakes/s, p50 %.1f us, p99 %.1f us\n", total, concurrency,
+           total / elapsed, times[total / 2] / 1e3, times[(total * 99) / 100] / 1e3);
+    return 0;
+}
@@ -0,0 +1,759 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Native controller front end (Linux only).
+
+Accepts stub-tool connections on behalf of the controller, so the scripting layer does not
+parse handshakes field by field. It listens on the same addresses as the controller would,
+parses complete handshakes in place, fetches the environment only for environment hashes
+it did not see before and passes job records to the controller in batches. After the
+handshake, all data is relayed unchanged in both directions.
+
+The controller starts the front end as a child process and talks to it over stdin and stdout
+using frames described at the end of this file. Build:
+
+    gcc -O3 -o frontend/frontend frontend/main.c
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define CONNECTION_PREFIX "RemJobs75oKmnN7rWX"
+#define PROTOCOL_MAGIC 0x7F4A9400
+#define PROTOCOL_MAGIC_MASK 0xFFFFFF00
+
+#define FRAME_JOB 1
+#define FRAME_DATA 2
+#define FRAME_CLOSED 3
+#define FRAME_FORGET 4
+#define FRAME_HEADER_SIZE 12
+
+#define ENV_NOT_INCLUDED 0xFFFFFFFF
+
+// Handshakes and environments larger than this are treated as malformed.
+#define MAX_MESSAGE_SIZE (64 * 1024 * 1024)
+#define READ_SIZE 65536
+#define MAX_EVENTS 256
+#define MAX_HASH_SIZE 64
+#define ENV_CACHE_SIZE 4096
+#define ENV_CACHE_REMOVED 0xFF
+
+// Tags of non-connection descriptors in epoll_event.data.u64, connections use slot numbers.
+#define TAG_STDIN 0xFFFFFFFF00000000ULL
+#define TAG_LISTEN 0xFFFFFFFE00000000ULL
+
+#define STATE_FREE 0      // slot is unused
+#define STATE_HANDSHAKE 1 // receiving handshake
+#define STATE_ENV 2       // ENV command sent, receiving environment
+#define STATE_ACTIVE 3    // job record sent, relaying data
+#define STATE_CLOSED 4    // stub disconnected, waiting for FRAME_CLOSED from the controller
+#define STATE_DRAINING 5  // controller closed, sending the rest of the output to the stub
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} byte_buffer;
+
+typedef struct
+{
+    int fd;
+    int state;
+    bool writing;         // EPOLLOUT is enabled
+    size_t handshake_size; // handshake bytes at the beginning of input
+    byte_buffer input;     // handshake and environment until the job record is sent
+    byte_buffer output;    // data waiting for the stub to receive it
+} connection;
+
+typedef struct
+{
+    uint8_t size;
+    uint8_t hash[MAX_HASH_SIZE];
+} env_cache_entry;
+
+static int epoll_fd;
+static int listen_socks[2];
+static int listen_count;
+static connection *connections;
+static uint32_t connections_capacity;
+static uint32_t *free_slots;
+static uint32_t free_count;
+static byte_buffer batch;    // frames for the controller collected during one loop iteration
+static byte_buffer incoming; // frames from the controller
+static env_cache_entry env_cache[ENV_CACHE_SIZE];
+static uint32_t env_cache_count;
+
+static void fail(const char *message)
+{
+    perror(message);
+    exit(1);
+}
+
+static uint32_t read_u32(const uint8_t *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static void write_u32(uint8_t *ptr, uint32_t value)
+{
+    memcpy(ptr, &value, sizeof(value));
+}
+
+static uint8_t *buffer_reserve(byte_buffer *buf, size_t size)
+{
+    if (buf->capacity - buf->size < size)
+    {
+        size_t capacity = buf->capacity > 0 ? buf->capacity : 4096;
+        while (capacity - buf->size < size)
+        {
+            capacity *= 2;
+        }
+        buf->data = realloc(buf->data, capacity);
+        if (buf->data == NULL)
+            fail("realloc");
+        buf->capacity = capacity;
+    }
+    return buf->data + buf->size;
+}
+
+static void buffer_append(byte_buffer *buf, const void *data, size_t size)
+{
+    memcpy(buffer_reserve(buf, size), data, size);
+    buf->size += size;
+}
+
+static void buffer_consume(byte_buffer *buf, size_t size)
+{
+    memmove(buf->data, buf->data + size, buf->size - size);
+    buf->size -= size;
+}
+
+static void buffer_free(byte_buffer *buf)
+{
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+static uint8_t *frame_begin(uint32_t type, uint32_t id, size_t size)
+{
+    uint8_t *ptr = buffer_reserve(&batch, FRAME_HEADER_SIZE + size);
+    write_u32(ptr, type);
+    write_u32(ptr + 4, id);
+    write_u32(ptr + 8, size);
+    return ptr + FRAME_HEADER_SIZE;
+}
+
+static void frame_end(size_t size)
+{
+    write_u32(batch.data + batch.size + 8, size);
+    batch.size += FRAME_HEADER_SIZE + size;
+}
+
+// Writes all collected frames with a single system call (unless the pipe is full).
+static void flush_batch()
+{
+    size_t offset = 0;
+    while (offset < batch.size)
+    {
+        ssize_t n = write(1, batch.data + offset, batch.size - offset);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            struct pollfd fd = {1, POLLOUT, 0};
+            poll(&fd, 1, -1);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            fail("Writing to controller");
+        offset += n;
+    }
+    batch.size = 0;
+}
+
+static uint32_t hash_bytes(const uint8_t *data, size_t size)
+{
+    uint32_t hash = 2166136261U;
+    size_t i;
+    for (i = 0; i < size; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619U;
+    }
+    return hash;
+}
+
+// Finds the environment hash in the cache, optionally adding it. The cache is cleared when
+// it is half full (removed entries included), so the environment is fetched again at worst.
+static bool env_cache_lookup(const uint8_t *hash, size_t size, bool add)
+{
+    uint32_t index;
+    if (size == 0 || size > MAX_HASH_SIZE)
+    {
+        return false;
+    }
+    if (add && env_cache_count >= ENV_CACHE_SIZE / 2)
+    {
+        memset(env_cache, 0, sizeof(env_cache));
+        env_cache_count = 0;
+    }
+    for (index = hash_bytes(hash, size) % ENV_CACHE_SIZE; env_cache[index].size != 0;
+         index = (index + 1) % ENV_CACHE_SIZE)
+    {
+        if (env_cache[index].size == size && memcmp(env_cache[index].hash, hash, size) == 0)
+        {
+            return true;
+        }
+    }
+    if (add)
+    {
+        env_cache[index].size = size;
+        memcpy(env_cache[index].hash, hash, size);
+        env_cache_count++;
+    }
+    return false;
+}
+
+// Removes the hash, so the next job record with it will contain the environment.
+static void env_cache_remove(const uint8_t *hash, size_t size)
+{
+    uint32_t index;
+    if (size == 0 || size > MAX_HASH_SIZE)
+    {
+        return;
+    }
+    for (index = hash_bytes(hash, size) % ENV_CACHE_SIZE; env_cache[index].size != 0;
+         index = (index + 1) % ENV_CACHE_SIZE)
+    {
+        if (env_cache[index].size == size && memcmp(env_cache[index].hash, hash, size) == 0)
+        {
+            // Entry stays occupied, so probing for other hashes does not stop here.
+            env_cache[index].size = ENV_CACHE_REMOVED;
+            return;
+        }
+    }
+}
+
+// Skips a length-prefixed string. Returns false if it is not complete yet.
+static bool skip_string(const byte_buffer *buf, size_t *offset)
+{
+    uint32_t length;
+    if (buf->size - *offset < 4)
+    {
+        return false;
+    }
+    length = read_u32(buf->data + *offset);
+    if (buf->size - *offset - 4 < length)
+    {
+        return false;
+    }
+    *offset += 4 + length;
+    return true;
+}
+
+// Checks if the handshake is complete. Returns its size, 0 if more data is needed or -1 if it is malformed.
+static ssize_t parse_handshake(const byte_buffer *buf)
+{
+    size_t offset = 8;
+    uint32_t argc;
+    uint32_t i;
+    if (buf->size < 8)
+    {
+        return 0;
+    }
+    if ((read_u32(buf->data) & PROTOCOL_MAGIC_MASK) != PROTOCOL_MAGIC)
+    {
+        return -1;
+    }
+    argc = read_u32(buf->data + 4);
+    if (argc > MAX_MESSAGE_SIZE / 4)
+    {
+        return -1;
+    }
+    // Arguments, cwd and environment hash.
+    for (i = 0; i < argc + 2; i++)
+    {
+        if (!skip_string(buf, &offset))
+        {
+            return buf->size > MAX_MESSAGE_SIZE ? -1 : 0;
+        }
+    }
+    return offset;
+}
+
+// Checks if the ENV reply following the handshake is complete, same return values as parse_handshake().
+static ssize_t parse_env(const byte_buffer *buf, size_t start)
+{
+    size_t offset = start + 4;
+    uint32_t count;
+    uint32_t i;
+    if (buf->size - start < 4)
+    {
+        return 0;
+    }
+    count = read_u32(buf->data + start);
+    for (i = 0; i < count; i++)
+    {
+        if (!skip_string(buf, &offset))
+        {
+            return buf->size > MAX_MESSAGE_SIZE ? -1 : 0;
+        }
+    }
+    return offset - start;
+}
+
+static void epoll_update(uint32_t slot)
+{
+    connection *conn = &connections[slot];
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | (conn->output.size > 0 ? EPOLLOUT : 0);
+    event.data.u64 = slot;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0)
+        fail("epoll_ctl");
+    conn->writing = conn->output.size > 0;
+}
+
+// Closes the socket. The slot is released when the controller also closed the connection.
+static void close_connection(uint32_t slot, bool notify)
+{
+    connection *conn = &connections[slot];
+    if (conn->fd >= 0)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    buffer_free(&conn->input);
+    buffer_free(&conn->output);
+    if (notify)
+    {
+        // Before the job record is sent, the controller does not know the connection.
+        if (conn->state == STATE_ACTIVE)
+        {
+            frame_begin(FRAME_CLOSED, slot, 0);
+            frame_end(0);
+            conn->state = STATE_CLOSED;
+            return;
+        }
+    }
+    conn->state = STATE_FREE;
+    free_slots[free_count++] = slot;
+}
+
+static void send_to_stub(uint32_t slot, const uint8_t *data, size_t size)
+{
+    connection *conn = &connections[slot];
+    if (conn->output.size == 0)
+    {
+        ssize_t n = send(conn->fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            close_connection(slot, true);
+            return;
+        }
+        if (n > 0)
+        {
+            data += n;
+            size -= n;
+        }
+    }
+    if (size > 0)
+    {
+        buffer_append(&conn->output, data, size);
+        if (!conn->writing)
+        {
+            epoll_update(slot);
+        }
+    }
+}
+
+static void send_job(uint32_t slot, size_t env_size)
+{
+    connection *conn = &connections[slot];
+    size_t record_size = conn->handshake_size + (env_size > 0 ? env_size : 4);
+    uint8_t *ptr = frame_begin(FRAME_JOB, slot, record_size);
+    // Job record is the handshake followed by the ENV reply, so it is copied as is.
+    memcpy(ptr, conn->input.data, conn->handshake_size + env_size);
+    if (env_size == 0)
+    {
+        write_u32(ptr + conn->handshake_size, ENV_NOT_INCLUDED);
+    }
+    frame_end(record_size);
+    buffer_consume(&conn->input, conn->handshake_size + env_size);
+    conn->state = STATE_ACTIVE;
+    // Stub does not send anything unrequested during the handshake, but relay it anyway.
+    if (conn->input.size > 0)
+    {
+        memcpy(frame_begin(FRAME_DATA, slot, conn->input.size), conn->input.data, conn->input.size);
+        frame_end(conn->input.size);
+    }
+    buffer_free(&conn->input);
+}
+
+// Returns the environment hash, the last field of a complete handshake.
+static const uint8_t *get_env_hash(const connection *conn, uint32_t *size)
+{
+    size_t offset = 8;
+    uint32_t argc = read_u32(conn->input.data + 4);
+    uint32_t i;
+    for (i = 0; i < argc + 1; i++)
+    {
+        offset += 4 + read_u32(conn->input.data + offset);
+    }
+    *size = read_u32(conn->input.data + offset);
+    return conn->input.data + offset + 4;
+}
+
+static void handle_handshake_data(uint32_t slot)
+{
+    connection *conn = &connections[slot];
+    const uint8_t *hash;
+    uint32_t hash_size;
+    uint8_t env_command[4];
+    ssize_t size;
+
+    if (conn->state == STATE_HANDSHAKE)
+    {
+        size = parse_handshake(&conn->input);
+        if (size <= 0)
+        {
+            if (size < 0)
+                close_connection(slot, false);
+            return;
+        }
+        conn->handshake_size = size;
+        hash = get_env_hash(conn, &hash_size);
+        if (env_cache_lookup(hash, hash_size, false))
+        {
+            send_job(slot, 0);
+            return;
+        }
+        write_u32(env_command, 3);
+        conn->state = STATE_ENV;
+        send_to_stub(slot, env_command, sizeof(env_command));
+        return;
+    }
+
+    size = parse_env(&conn->input, conn->handshake_size);
+    if (size <= 0)
+    {
+        if (size < 0)
+            close_connection(slot, false);
+        return;
+    }
+    hash = get_env_hash(conn, &hash_size);
+    env_cache_lookup(hash, hash_size, true);
+    send_job(slot, size);
+}
+
+static void handle_readable(uint32_t slot)
+{
+    static uint8_t discarded[READ_SIZE];
+    connection *conn = &connections[slot];
+    ssize_t n;
+    if (conn->state == STATE_DRAINING)
+    {
+        // Controller does not accept data for a closed connection.
+        n = recv(conn->fd, discarded, sizeof(discarded), MSG_DONTWAIT);
+    }
+    else if (conn->state == STATE_ACTIVE)
+    {
+        // Receive directly into the batch, so relayed data is copied only by the kernel.
+        uint8_t *ptr = frame_begin(FRAME_DATA, slot, READ_SIZE);
+        n = recv(conn->fd, ptr, READ_SIZE, MSG_DONTWAIT);
+        if (n > 0)
+        {
+            frame_end(n);
+        }
+    }
+    else
+    {
+        n = recv(conn->fd, buffer_reserve(&conn->input, READ_SIZE), READ_SIZE, MSG_DONTWAIT);
+        if (n > 0)
+        {
+            conn->input.size += n;
+            handle_handshake_data(slot);
+        }
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        close_connection(slot, true);
+    }
+}
+
+static void handle_writable(uint32_t slot)
+{
+    connection *conn = &connections[slot];
+    ssize_t n = send(conn->fd, conn->output.data, conn->output.size, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        close_connection(slot, true);
+        return;
+    }
+    if (n > 0)
+    {
+        buffer_consume(&conn->output, n);
+    }
+    if (conn->output.size == 0 && conn->state == STATE_DRAINING)
+    {
+        close_connection(slot, false);
+    }
+    else if (conn->output.size == 0)
+    {
+        epoll_update(slot);
+    }
+}
+
+static uint32_t alloc_slot()
+{
+    uint32_t i;
+    if (free_count == 0)
+    {
+        uint32_t capacity = connections_capacity > 0 ? connections_capacity * 2 : 256;
+        connections = realloc(connections, capacity * sizeof(connection));
+        free_slots = realloc(free_slots, capacity * sizeof(uint32_t));
+        if (connections == NULL || free_slots == NULL)
+            fail("realloc");
+        memset(&connections[connections_capacity], 0, (capacity - connections_capacity) * sizeof(connection));
+        // Lower slots are used first.
+        for (i = capacity; i > connections_capacity; i--)
+        {
+            free_slots[free_count++] = i - 1;
+        }
+        connections_capacity = capacity;
+    }
+    return free_slots[--free_count];
+}
+
+static void handle_accept(int listen_sock)
+{
+    struct epoll_event event;
+    while (true)
+    {
+        int fd = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        uint32_t slot;
+        if (fd < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+                return;
+            fail("accept4");
+        }
+        slot = alloc_slot();
+        memset(&connections[slot], 0, sizeof(connection));
+        connections[slot].fd = fd;
+        connections[slot].state = STATE_HANDSHAKE;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = slot;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+            fail("epoll_ctl");
+    }
+}
+
+// Processes complete frames received from the controller.
+static void handle_controller()
+{
+    size_t offset = 0;
+    ssize_t n = read(0, buffer_reserve(&incoming, READ_SIZE), READ_SIZE);
+    if (n == 0)
+    {
+        // Controller exited.
+        exit(0);
+    }
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        fail("Reading from controller");
+    }
+    incoming.size += n;
+    while (incoming.size - offset >= FRAME_HEADER_SIZE)
+    {
+        uint32_t type = read_u32(incoming.data + offset);
+        uint32_t slot = read_u32(incoming.data + offset + 4);
+        uint32_t size = read_u32(incoming.data + offset + 8);
+        if (incoming.size - offset - FRAME_HEADER_SIZE < size)
+        {
+            break;
+        }
+        if (slot >= connections_capacity && type != FRAME_FORGET)
+        {
+            fprintf(stderr, "Invalid connection id from controller.\n");
+            exit(1);
+        }
+        offset += FRAME_HEADER_SIZE;
+        if (type == FRAME_FORGET)
+        {
+            env_cache_remove(incoming.data + offset, size);
+        }
+        else if (type == FRAME_DATA && connections[slot].state == STATE_ACTIVE)
+        {
+            send_to_stub(slot, incoming.data + offset, size);
+        }
+        else if (type == FRAME_CLOSED && connections[slot].state == STATE_ACTIVE)
+        {
+            // Output still waiting for a slow stub (e.g. the EXIT command) must not be lost.
+            if (connections[slot].output.size > 0)
+            {
+                connections[slot].state = STATE_DRAINING;
+            }
+            else
+            {
+                close_connection(slot, false);
+            }
+        }
+        else if (type == FRAME_CLOSED && connections[slot].state == STATE_CLOSED)
+        {
+            connections[slot].state = STATE_FREE;
+            free_slots[free_count++] = slot;
+        }
+        offset += size;
+    }
+    buffer_consume(&incoming, offset);
+}
+
+static void listen_on(const struct sockaddr_un *addr, socklen_t addr_size)
+{
+    struct epoll_event event;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        fail("socket");
+    if (bind(sock, (const struct sockaddr *)addr, addr_size) < 0 || listen(sock, SOMAXCONN) < 0)
+        fail("bind");
+    event.events = EPOLLIN;
+    event.data.u64 = TAG_LISTEN | listen_count;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0)
+        fail("epoll_ctl");
+    listen_socks[listen_count++] = sock;
+}
+
+int main(int argc, char *argv[])
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event event;
+    struct sockaddr_un addr;
+    const char *id = argc > 1 ? argv[1] : "0";
+    int rc;
+    int i;
+
+    signal(SIGPIPE, SIG_IGN);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        fail("epoll_create1");
+
+    // Stubs try the abstract name first, the path is for stubs running in other network namespaces.
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    rc = snprintf(&addr.sun_path[1], sizeof(addr.sun_path) - 1, "%s/%sS", CONNECTION_PREFIX, id);
+    if (rc <= 0 || (size_t)rc >= sizeof(addr.sun_path) - 1)
+    {
+        fprintf(stderr, "Connection id too long.\n");
+        return 1;
+    }
+    listen_on(&addr, offsetof(struct sockaddr_un, sun_path) + 1 + rc);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/%s", CONNECTION_PREFIX);
+    mkdir(addr.sun_path, 0777);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/%s/%sS", CONNECTION_PREFIX, id);
+    unlink(addr.sun_path);
+    listen_on(&addr, sizeof(addr));
+
+    fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
+    event.events = EPOLLIN;
+    event.data.u64 = TAG_STDIN;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, 0, &event) < 0)
+        fail("epoll_ctl");
+
+    while (true)
+    {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            fail("epoll_wait");
+        for (i = 0; i < count; i++)
+        {
+            uint64_t tag = events[i].data.u64;
+            uint32_t slot = (uint32_t)tag;
+            if (tag == TAG_STDIN)
+            {
+                handle_controller();
+            }
+            else if ((tag & ~0xFFFFFFFFULL) == TAG_LISTEN)
+            {
+                handle_accept(listen_socks[slot]);
+            }
+            else if (connections[slot].fd >= 0 && connections[slot].state != STATE_FREE)
+            {
+                if ((events[i].events & EPOLLOUT) && connections[slot].output.size > 0)
+                {
+                    handle_writable(slot);
+                }
+                // EPOLLRDHUP and errors are detected by recv().
+                if (connections[slot].fd >= 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                {
+                    handle_readable(slot);
+                }
+            }
+        }
+        // One write per loop iteration passes all job records and data collected in it.
+        flush_batch();
+    }
+}
+
+/*
+Controller interface:
+
+All frames have the same header. Numbers are little-endian.
+
+Bytes  Name     Description
+------------------------------------------------------------------------------------------------------
+   4   type     frame type
+   4   id       connection id
+   4   size     number of bytes that follow
+   N   data     frame data
+
+Frame "JOB" (type=1, front end to controller):
+A new stub connected and its handshake was received. Data is a job record: the handshake exactly
+as described in stub-tool/main.c (magic, argc, arguments, cwd, env_hash) followed by:
+   4   count    number of environment variables, 0xFFFFFFFF if the front end already saw this
+                environment hash, the controller should use its cache then (or ask the stub itself)
+Repeat for each variable:
+   4   env_len[]
+   N   env[]
+
+Frame "DATA" (type=2, both directions):
+Data received from the stub or data to send to the stub. Since the job record, the controller
+talks to the stub as if it was connected directly.
+
+Frame "CLOSED" (type=3, both directions):
+From the front end: the stub disconnected. From the controller: close the connection or confirm
+that it was closed. The id may be reused only after both sides sent this frame.
+
+Frame "FORGET" (type=4, controller to front end):
+The controller removed the environment from its cache. Data is the environment hash (binary,
+as in the handshake), id is ignored. Next job record with this hash will contain the environment.
+*/
@@ -0,0 +1,328 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Local result cache shared with the stubs, see "Local cache" in stub-tool/main.c for the format.
+The controller is the only writer: it stores records of finished jobs and removes the least
+recently used ones when the cache grows over its size limit. Stubs started with REMOTE_JOBS_CACHE
+set to the same directory read it before connecting and skip the controller on a hit.
+*/
+
+import * as fs from 'fs';
+import * as path from 'path';
+import * as crypto from 'crypto';
+
+const CACHE_INDEX_MAGIC = 0x7F4A9501;
+const CACHE_RECORD_MAGIC = 0x7F4A9601;
+const CACHE_HEADER_SIZE = 64;
+const CACHE_ENTRY_SIZE = 64;
+const CACHE_PROBE_LENGTH = 8;
+const CACHE_DEFAULT_SLOTS = 65536;
+// Eviction removes entries until the cache is below this part of the size limit.
+const CACHE_EVICTION_TARGET = 0.9;
+// Unreferenced blobs younger than this may belong to a record that is being stored.
+const CACHE_BLOB_GRACE_TIME = 60000;
+
+export interface CacheRecord {
+    status: number;
+    envSelectors: string[];
+    envHash: Uint8Array;                            // from StubTool.selectedEnvHash(envSelectors)
+    inputs: { path: string, hash: Uint8Array }[];   // hashes from StubTool.hashFiles()
+    outputs: { path: string, mode: number }[];      // relative paths are relative to the stub's cwd
+    stdout: Uint8Array;
+    stderr: Uint8Array;
+}
+
+interface CacheEntry {
+    slot: number;
+    key: Buffer;
+    record: Buffer;
+    size: number;
+    used: bigint;
+}
+
+function md5(...data: Uint8Array[]) {
+    let hash = crypto.createHash('md5');
+    for (let item of data) {
+        hash.update(item);
+    }
+    return hash.digest();
+}
+
+function encodeUint32(value: number) {
+    let result = Buffer.alloc(4);
+    result.writeUInt32LE(value, 0);
+    return result;
+}
+
+function encodeBytes(data: Uint8Array) {
+    return Buffer.concat([encodeUint32(data.length), data]);
+}
+
+function encodeString(str: string) {
+    return encodeBytes(Buffer.from(str));
+}
+
+/**
+ * Index key of a job, the same as the stub calculates from its arguments and cwd.
+ */
+export function cacheKey(args: string[], cwd: string) {
+    let encoding: BufferEncoding = process.platform === 'win32' ? 'utf16le' : 'utf8';
+    return md5(...args.map(arg => Buffer.from(arg + '\0', encoding)), Buffer.from(cwd + '\0', encoding));
+}
+
+/**
+ * Returns ids of output blobs referenced by a record.
+ */
+function recordOutputs(data: Buffer) {
+    let offset = 8;
+    let readUint32 = () => {
+        offset += 4;
+        return data.readUInt32LE(offset - 4);
+    };
+    let skipBytes = () => {
+        offset += readUint32();
+    };
+    skipBytes();
+    for (let i = readUint32(); i > 0; i--) {
+        skipBytes();
+    }
+    for (let i = readUint32(); i > 0; i--) {
+        skipBytes();
+        skipBytes();
+    }
+    let result: string[] = [];
+    for (let i = readUint32(); i > 0; i--) {
+        skipBytes();
+        readUint32();
+        result.push(data.toString('hex', offset, offset + 16));
+        offset += 16;
+    }
+    return result;
+}
+
+export class StubCache {
+
+    private indexFd: number;
+    private slots: number;
+    private evicting = false;
+    private tempCounter = 0;
+
+    /**
+     * Opens the cache in a directory, creating it if needed. Only one controller may use it.
+     */
+    public constructor(public readonly dir: string, public maxSize: number, slots: number = CACHE_DEFAULT_SLOTS) {
+        let indexPath = path.join(dir, 'index');
+        fs.mkdirSync(path.join(dir, 'blobs'), { recursive: true });
+        if (!fs.existsSync(indexPath)) {
+            let header = Buffer.alloc(CACHE_HEADER_SIZE);
+            header.writeUInt32LE(CACHE_INDEX_MAGIC, 0);
+            header.writeUInt32LE(slots, 4);
+            let tempPath = `${indexPath}.${process.pid}`;
+            fs.writeFileSync(tempPath, header);
+            fs.truncateSync(tempPath, CACHE_HEADER_SIZE + slots * CACHE_ENTRY_SIZE);
+            fs.renameSync(tempPath, indexPath);
+        }
+        this.indexFd = fs.openSync(indexPath, 'r+');
+        let header = Buffer.alloc(CACHE_HEADER_SIZE);
+        fs.readSync(this.indexFd, header, 0, CACHE_HEADER_SIZE, 0);
+        this.slots = header.readUInt32LE(4);
+        if (header.readUInt32LE(0) !== CACHE_INDEX_MAGIC || this.slots === 0) {
+            throw new Error(`Invalid cache index in "${dir}".`);
+        }
+    }
+
+    /**
+     * Stores a record of a finished job. Output files are copied to the cache now, so they
+     * must not change until this function returns.
+     */
+    public async store(args: string[], cwd: string, record: CacheRecord) {
+        let size = 0;
+        let parts: Buffer[] = [
+            encodeUint32(CACHE_RECORD_MAGIC),
+            encodeUint32(record.status),
+            encodeBytes(record.envHash),
+            encodeUint32(record.envSelectors.length),
+            ...record.envSelectors.map(encodeString),
+            encodeUint32(record.inputs.length),
+        ];
+        for (let input of record.inputs) {
+            parts.push(encodeString(input.path), encodeBytes(input.hash));
+        }
+        parts.push(encodeUint32(record.outputs.length));
+        for (let output of record.outputs) {
+            let data = await fs.promises.readFile(path.resolve(cwd, output.path));
+            parts.push(encodeString(output.path), encodeUint32(output.mode), await this.writeBlob(data));
+            size += data.length;
+        }
+        parts.push(encodeBytes(record.stdout), encodeBytes(record.stderr));
+        let recordData = Buffer.concat(parts);
+        let recordId = await this.writeBlob(recordData);
+        size += recordData.length;
+        this.writeEntry(cacheKey(args, cwd), recordId, size);
+        await this.evict();
+    }
+
+    /**
+     * Removes the least recently used entries if the total size is over the limit, then removes
+     * blobs that are no longer referenced.
+     */
+    public async evict() {
+        if (this.evicting) {
+            return;
+        }
+        this.evicting = true;
+        try {
+            let entries = this.readEntries();
+            let total = entries.reduce((sum, entry) => sum + entry.size, 0);
+            if (total <= this.maxSize) {
+                return;
+            }
+            entries.sort((a, b) => a.used < b.used ? -1 : a.used > b.used ? 1 : 0);
+            let removed = 0;
+            while (removed < entries.length && total > this.maxSize * CACHE_EVICTION_TARGET) {
+                this.clearEntry(entries[removed]);
+                total -= entries[removed].size;
+                removed++;
+            }
+            await this.removeUnreferencedBlobs(entries.slice(removed));
+        } finally {
+            this.evicting = false;
+        }
+    }
+
+    private blobPath(id: Buffer) {
+        return path.join(this.dir, 'blobs', id.toString('hex'));
+    }
+
+    private async writeBlob(data: Uint8Array) {
+        let id = md5(data);
+        let blobPath = this.blobPath(id);
+        try {
+            // Existing blob has the same content, a new time keeps it from being removed as unreferenced.
+            let now = new Date();
+            await fs.promises.utimes(blobPath, now, now);
+        } catch {
+            // Stubs see only complete blobs.
+            let tempPath = `${blobPath}.${process.pid}.${this.tempCounter++}`;
+            await fs.promises.writeFile(tempPath, data);
+            await fs.promises.rename(tempPath, blobPath);
+        }
+        return id;
+    }
+
+    private parseEntry(slot: number, data: Buffer): CacheEntry | null {
+        let key = data.subarray(0, 16);
+        if (key.every(byte => byte === 0) || !md5(data.subarray(0, 40)).subarray(0, 8).equals(data.subarray(40, 48))) {
+            return null;
+        }
+        return {
+            slot,
+            key: Buffer.from(key),
+            record: Buffer.from(data.subarray(16, 32)),
+            size: Number(data.readBigUInt64LE(32)),
+            used: data.readBigUInt64LE(48),
+        };
+    }
+
+    private readEntries() {
+        let data = Buffer.alloc(this.slots * CACHE_ENTRY_SIZE);
+        fs.readSync(this.indexFd, data, 0, data.length, CACHE_HEADER_SIZE);
+        let entries: CacheEntry[] = [];
+        for (let slot = 0; slot < this.slots; slot++) {
+            let entry = this.parseEntry(slot, data.subarray(slot * CACHE_ENTRY_SIZE, (slot + 1) * CACHE_ENTRY_SIZE));
+            if (entry !== null) {
+                entries.push(entry);
+            }
+        }
+        return entries;
+    }
+
+    private readEntry(slot: number) {
+        let data = Buffer.alloc(CACHE_ENTRY_SIZE);
+        fs.readSync(this.indexFd, data, 0, CACHE_ENTRY_SIZE, CACHE_HEADER_SIZE + slot * CACHE_ENTRY_SIZE);
+        return this.parseEntry(slot, data);
+    }
+
+    /**
+     * Increments the clock shared with the stubs. Concurrent increments by stubs may be lost,
+     * entries then have the same time, which is good enough for the eviction.
+     */
+    private tick() {
+        let data = Buffer.alloc(8);
+        fs.readSync(this.indexFd, data, 0, 8, 8);
+        let clock = data.readBigUInt64LE(0) + BigInt(1);
+        data.writeBigUInt64LE(clock, 0);
+        fs.writeSync(this.indexFd, data, 0, 8, 8);
+        return clock;
+    }
+
+    /**
+     * Writes an entry in a single write. It replaces an entry with the same key, an empty slot
+     * or the least recently used entry in the probed slots.
+     */
+    private writeEntry(key: Buffer, record: Buffer, size: number) {
+        let slot = -1;
+        let oldestUsed: bigint | null = null;
+        for (let i = 0; i < CACHE_PROBE_LENGTH; i++) {
+            let candidate = (key.readUInt32LE(0) % this.slots + i) % this.slots;
+            let entry = this.readEntry(candidate);
+            if (entry === null || entry.key.equals(key)) {
+                slot = candidate;
+                break;
+            } else if (oldestUsed === null || entry.used < oldestUsed) {
+                slot = candidate;
+                oldestUsed = entry.used;
+            }
+        }
+        let data = Buffer.alloc(CACHE_ENTRY_SIZE);
+        key.copy(data, 0);
+        record.copy(data, 16);
+        data.writeBigUInt64LE(BigInt(size), 32);
+        md5(data.subarray(0, 40)).copy(data, 40, 0, 8);
+        data.writeBigUInt64LE(this.tick(), 48);
+        fs.writeSync(this.indexFd, data, 0, CACHE_ENTRY_SIZE, CACHE_HEADER_SIZE + slot * CACHE_ENTRY_SIZE);
+    }
+
+    private clearEntry(entry: CacheEntry) {
+        // The slot may have been reused since the entries were read.
+        let current = this.readEntry(entry.slot);
+        if (current !== null && current.key.equals(entry.key) && current.record.equals(entry.record)) {
+            fs.writeSync(this.indexFd, Buffer.alloc(CACHE_ENTRY_SIZE), 0, CACHE_ENTRY_SIZE,
+                CACHE_HEADER_SIZE + entry.slot * CACHE_ENTRY_SIZE);
+        }
+    }
+
+    private async removeUnreferencedBlobs(entries: CacheEntry[]) {
+        let referenced = new Set<string>();
+        for (let entry of entries) {
+            referenced.add(entry.record.toString('hex'));
+            try {
+                recordOutputs(await fs.promises.readFile(this.blobPath(entry.record))).forEach(id => referenced.add(id));
+            } catch {
+                // Missing or damaged record, stubs do not use it either.
+            }
+        }
+        let blobsDir = path.join(this.dir, 'blobs');
+        let now = Date.now();
+        for (let name of await fs.promises.readdir(blobsDir)) {
+            if (referenced.has(name)) {
+                continue;
+            }
+            try {
+                let blobPath = path.join(blobsDir, name);
+                if (now - (await fs.promises.stat(blobPath)).mtimeMs > CACHE_BLOB_GRACE_TIME) {
+                    await fs.promises.unlink(blobPath);
+                }
+            } catch {
+                // Removed concurrently.
+            }
+        }
+    }
+}
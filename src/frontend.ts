@@ -0,0 +1,167 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Client of the native controller front end (frontend/main.c). The front end accepts stub
+connections and parses handshakes, this side receives complete job records in batches and
+exposes each connection as a stream.
+*/
+
+import * as child_process from 'child_process';
+import { Duplex } from 'stream';
+import { TextDecoder } from 'util';
+
+const FRAME_JOB = 1;
+const FRAME_DATA = 2;
+const FRAME_CLOSED = 3;
+const FRAME_FORGET = 4;
+const FRAME_HEADER_SIZE = 12;
+
+const ENV_NOT_INCLUDED = 0xFFFFFFFF;
+
+export interface StubJob {
+    version: number;
+    args: string[];
+    cwd: string;
+    hash: string;
+    env: string[] | null;   // null if the front end already passed this environment hash
+}
+
+class FrontendConnection extends Duplex {
+
+    public constructor(private frontend: StubFrontend, private id: number) {
+        super();
+    }
+
+    public _read() {
+    }
+
+    public _write(chunk: Buffer, encoding: BufferEncoding, callback: (error?: Error | null) => void) {
+        this.frontend.sendFrame(FRAME_DATA, this.id, chunk, callback);
+    }
+
+    public _destroy(error: Error | null, callback: (error: Error | null) => void) {
+        this.frontend.closeConnection(this.id);
+        callback(error);
+    }
+}
+
+export class StubFrontend {
+
+    private process: child_process.ChildProcess;
+    private connections = new Map<number, FrontendConnection>();
+    private pending: Buffer = Buffer.alloc(0);
+    private dec: TextDecoder = new TextDecoder();
+    private corked: boolean = false;
+
+    /**
+     * Starts the front end listening for stubs with the connection id. Each connected stub
+     * is passed to onJob with a stream that can be used in place of its socket.
+     */
+    public constructor(executable: string, id: string, private onJob: (stream: Duplex, job: StubJob) => void) {
+        this.process = child_process.spawn(executable, [id], { stdio: ['pipe', 'pipe', 'inherit'] });
+        this.process.stdout!.on('data', data => this.received(data));
+    }
+
+    public sendFrame(type: number, id: number, data: Uint8Array | null, callback?: (error?: Error | null) => void) {
+        let header = Buffer.alloc(FRAME_HEADER_SIZE);
+        header.writeUInt32LE(type, 0);
+        header.writeUInt32LE(id, 4);
+        header.writeUInt32LE(data !== null ? data.length : 0, 8);
+        if (!this.corked) {
+            // Frames written in the same tick are passed to the front end with a single write.
+            this.corked = true;
+            this.process.stdin!.cork();
+            process.nextTick(() => {
+                this.corked = false;
+                this.process.stdin!.uncork();
+            });
+        }
+        this.process.stdin!.write(data !== null ? Buffer.concat([header, data]) : header, callback);
+    }
+
+    public closeConnection(id: number) {
+        if (this.connections.delete(id)) {
+            this.sendFrame(FRAME_CLOSED, id, null);
+        }
+    }
+
+    /**
+     * Tells the front end that the environment is not cached anymore, so it will be included
+     * in the next job record with this hash.
+     */
+    public forgetEnvironment(hash: string) {
+        this.sendFrame(FRAME_FORGET, 0, Buffer.from(hash, 'hex'));
+    }
+
+    public close() {
+        this.process.kill();
+    }
+
+    private received(data: Buffer) {
+        let buffer = this.pending.length > 0 ? Buffer.concat([this.pending, data]) : data;
+        let offset = 0;
+        while (buffer.length - offset >= FRAME_HEADER_SIZE) {
+            let type = buffer.readUInt32LE(offset);
+            let id = buffer.readUInt32LE(offset + 4);
+            let size = buffer.readUInt32LE(offset + 8);
+            if (buffer.length - offset - FRAME_HEADER_SIZE < size) {
+                break;
+            }
+            let frame = buffer.subarray(offset + FRAME_HEADER_SIZE, offset + FRAME_HEADER_SIZE + size);
+            offset += FRAME_HEADER_SIZE + size;
+            if (type === FRAME_JOB) {
+                let connection = new FrontendConnection(this, id);
+                this.connections.set(id, connection);
+                this.onJob(connection, this.parseJob(frame));
+            } else if (type === FRAME_DATA) {
+                this.connections.get(id)?.push(frame);
+            } else if (type === FRAME_CLOSED) {
+                // If the connection was already closed on this side, the front end released the id
+                // when it received our CLOSED frame.
+                let connection = this.connections.get(id);
+                if (connection !== undefined) {
+                    connection.on('end', () => connection!.destroy());
+                    connection.push(null);
+                }
+            }
+        }
+        // Frames reference the buffer, so the rest has to be copied.
+        this.pending = Buffer.from(buffer.subarray(offset));
+    }
+
+    private parseJob(record: Buffer): StubJob {
+        let offset = 0;
+        let readUint32 = () => {
+            offset += 4;
+            return record.readUInt32LE(offset - 4);
+        };
+        let readBytes = () => {
+            let length = readUint32();
+            offset += length;
+            return record.subarray(offset - length, offset);
+        };
+        let version = readUint32() & 0xFF;
+        let args: string[] = new Array(readUint32());
+        for (let i = 0; i < args.length; i++) {
+            args[i] = this.dec.decode(readBytes());
+        }
+        let cwd = this.dec.decode(readBytes());
+        let hash = readBytes().toString('hex');
+        let envCount = readUint32();
+        let env: string[] | null = null;
+        if (envCount !== ENV_NOT_INCLUDED) {
+            env = new Array(envCount);
+            for (let i = 0; i < envCount; i++) {
+                env[i] = this.dec.decode(readBytes());
+            }
+        }
+        return { version, args, cwd, hash, env };
+    }
+}
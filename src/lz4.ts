@@ -0,0 +1,193 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+LZ4 block format compressor and decompressor, port of stub-tool/lz4.h.
+*/
+
+export const LZ4_MAX_BLOCK_SIZE = 65536;
+
+const MIN_MATCH = 4;
+const LAST_LITERALS = 5;
+const MATCH_FIND_LIMIT = 12;
+const HASH_BITS = 12;
+const SKIP_TRIGGER = 6;
+
+const table = new Uint16Array(1 << HASH_BITS);
+
+function read32(data: Uint8Array, pos: number) {
+    return data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16) | (data[pos + 3] << 24);
+}
+
+function hash(sequence: number) {
+    return Math.imul(sequence, 2654435761) >>> (32 - HASH_BITS);
+}
+
+function writeLength(dst: Uint8Array, op: number, length: number) {
+    while (length >= 255) {
+        dst[op++] = 255;
+        length -= 255;
+    }
+    dst[op++] = length;
+    return op;
+}
+
+/**
+ * Compresses up to LZ4_MAX_BLOCK_SIZE bytes. Returns null if the compressed block would be
+ * larger than `maxSize` bytes.
+ */
+export function lz4Compress(src: Uint8Array, maxSize: number = src.length - 1): Uint8Array | null {
+    let end = src.length;
+    let dst = new Uint8Array(Math.max(maxSize, 0));
+    let ip = 0;
+    let anchor = 0;
+    let op = 0;
+    let literals: number;
+
+    if (end > LZ4_MAX_BLOCK_SIZE) {
+        throw new Error('LZ4 block too large.');
+    }
+
+    if (end > MATCH_FIND_LIMIT) {
+        let matchLimit = end - MATCH_FIND_LIMIT;
+        let extendLimit = end - LAST_LITERALS;
+        table.fill(0);
+        ip++;
+        while (ip <= matchLimit) {
+            let sequence = read32(src, ip);
+            let h = hash(sequence);
+            let ref = table[h];
+            table[h] = ip;
+            if (read32(src, ref) !== sequence || ref >= ip) {
+                // Skip faster through data that does not match.
+                ip += 1 + ((ip - anchor) >> SKIP_TRIGGER);
+                continue;
+            }
+
+            while (ip > anchor && ref > 0 && src[ip - 1] === src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            let matchEnd = ip + MIN_MATCH;
+            let refEnd = ref + MIN_MATCH;
+            while (matchEnd < extendLimit && src[matchEnd] === src[refEnd]) {
+                matchEnd++;
+                refEnd++;
+            }
+
+            literals = ip - anchor;
+            let matchLength = matchEnd - ip - MIN_MATCH;
+            if (maxSize - op < 1 + Math.floor(literals / 255) + 1 + literals + 2 + Math.floor(matchLength / 255) + 1) {
+                return null;
+            }
+            dst[op++] = (Math.min(literals, 15) << 4) | Math.min(matchLength, 15);
+            if (literals >= 15) {
+                op = writeLength(dst, op, literals - 15);
+            }
+            dst.set(src.subarray(anchor, ip), op);
+            op += literals;
+            dst[op++] = (ip - ref) & 0xFF;
+            dst[op++] = (ip - ref) >> 8;
+            if (matchLength >= 15) {
+                op = writeLength(dst, op, matchLength - 15);
+            }
+
+            ip = matchEnd;
+            anchor = ip;
+            if (ip <= matchLimit) {
+                // Position just before the next one improves chaining of repeated data.
+                table[hash(read32(src, ip - 2))] = ip - 2;
+            }
+        }
+    }
+
+    literals = end - anchor;
+    if (maxSize - op < 1 + Math.floor(literals / 255) + 1 + literals) {
+        return null;
+    }
+    dst[op++] = Math.min(literals, 15) << 4;
+    if (literals >= 15) {
+        op = writeLength(dst, op, literals - 15);
+    }
+    dst.set(src.subarray(anchor, end), op);
+    op += literals;
+    return dst.subarray(0, op);
+}
+
+/**
+ * Decompresses a block of known size. Throws if the block is malformed.
+ */
+export function lz4Decompress(src: Uint8Array, size: number): Uint8Array {
+    let dst = new Uint8Array(size);
+    let ip = 0;
+    let op = 0;
+    let ipEnd = src.length;
+    let malformed = () => new Error('Malformed LZ4 block.');
+
+    let readLength = (length: number) => {
+        let byte: number;
+        do {
+            if (ip >= ipEnd) {
+                throw malformed();
+            }
+            byte = src[ip++];
+            length += byte;
+        } while (byte === 255);
+        return length;
+    };
+
+    while (ip < ipEnd) {
+        let token = src[ip++];
+        let length = token >> 4;
+        if (length === 15) {
+            length = readLength(length);
+        }
+        if (length > ipEnd - ip || length > size - op) {
+            throw malformed();
+        }
+        dst.set(src.subarray(ip, ip + length), op);
+        op += length;
+        ip += length;
+        if (ip === ipEnd) {
+            // Last sequence contains only literals.
+            break;
+        }
+
+        if (ipEnd - ip < 2) {
+            throw malformed();
+        }
+        let offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset === 0 || offset > op) {
+            throw malformed();
+        }
+        length = token & 15;
+        if (length === 15) {
+            length = readLength(length);
+        }
+        length += MIN_MATCH;
+        if (length > size - op) {
+            throw malformed();
+        }
+        if (offset >= length) {
+            dst.copyWithin(op, op - offset, op - offset + length);
+            op += length;
+        } else {
+            // Overlapping match repeats the last offset bytes.
+            for (let i = 0; i < length; i++) {
+                dst[op] = dst[op - offset];
+                op++;
+            }
+        }
+    }
+    if (op !== size) {
+        throw malformed();
+    }
+    return dst;
+}
@@ -10,8 +10,13 @@
 import * as net from 'net';
 import * as fs from 'fs';
 import * as path from 'path';
+import * as os from 'os';
+import { Duplex } from 'stream';
 import { TextDecoder, TextEncoder } from 'util';
 import { Mutex } from 'async-mutex';
+import { lz4Compress, lz4Decompress, LZ4_MAX_BLOCK_SIZE } from './lz4';
+import { StubFrontend, StubJob } from './frontend';
+import { StubCache } from './cache';
 
 const mutexMember = Symbol();
 
@@ -33,6 +38,8 @@ function synchronized(target: any, propertyKey: string, descriptor: PropertyDesc
 }
 
 const CONNECTION_PREFIX = 'RemJobs75oKmnN7rWX';
+const STUB_MAGIC = 0x7F4A9400;
+const STUB_PROTOCOL_VERSION = 18;
 
 function serverError(error: any) {
     console.error('Server error: ', error);
@@ -42,11 +49,34 @@ function serverListening() {
     console.log('Server listening');
 }
 const STUB_RECV_TIMEOUT = 10000;
+const STUB_STDIN_WINDOW = 256 * 1024;
+// Below this size LZ4 does not pay off even on a 100 Mbit/s link (see stub-tool/bench/compression.c).
+const STUB_COMPRESSION_THRESHOLD = 1024;
+const COMPRESSION_NONE = 0;
+const COMPRESSION_LZ4 = 1;
+// Larger files are transferred through a descriptor passed by the stub instead of the socket.
+// Below this size opening the descriptor costs more than it saves (see stub-tool/bench/bulk.c).
+const STUB_BULK_THRESHOLD = 256 * 1024;
+
+// Limits of the WRITE_BATCH command: segment headers (8 bytes each) and data must fit in 64 KiB.
+const WRITE_BATCH_MAX_SIZE = 65536;
+const WRITE_BATCH_MAX_SEGMENTS = 1024;
+const WRITE_BATCH_HEADER_SIZE = 8;
+
+// Job phases of the PHASE command. While remote, the stub does not hold a GNU make job slot.
+const PHASE_LOCAL = 0;
+const PHASE_REMOTE = 1;
 
 const MAX_ENVIRONMENT_CACHE_SIZE = 5 * 1024 * 1024;
+const MAX_ENVIRONMENT_DELTA_BASES = 2;
+const NO_ENVIRONMENT_BASE = 0xFFFFFFFF;
+const INHERIT_ENVIRONMENT = 0xFFFFFFFF;
 
-let environmentCache: { [hash: string]: [number, string[]] } = {};
+// Per-variable hashes (8 bytes each) are kept for environments received with ENV_DELTA command.
+let environmentCache: { [hash: string]: [number, string[], Buffer | null] } = {};
 let environmentCacheSize = 0;
+// Called when an environment is removed from the cache, e.g. to notify the native front end.
+let environmentEvicted: ((hash: string) => void) | null = null;
 
 function getCachedEnvironment(hash: string): string[] | null {
     if (hash in environmentCache) {
@@ -59,8 +89,29 @@ function getCachedEnvironment(hash: string): string[] | null {
     }
 }
 
-function addCachedEnvironment(hash: string, value: string[]) {
+/**
+ * Returns up to MAX_ENVIRONMENT_DELTA_BASES most recently used environments that
+ * can be offered to the stub as a base for ENV_DELTA command.
+ */
+function getEnvironmentDeltaBases(): [string[], Buffer][] {
+    let result: [string[], Buffer][] = [];
+    let hashes = Object.keys(environmentCache);
+    for (let i = hashes.length - 1; i >= 0 && result.length < MAX_ENVIRONMENT_DELTA_BASES; i--) {
+        let [, env, varHashes] = environmentCache[hashes[i]];
+        if (varHashes !== null) {
+            result.push([env, varHashes]);
+        }
+    }
+    return result;
+}
+
+function addCachedEnvironment(hash: string, value: string[], varHashes: Buffer | null = null) {
     let size = 2 * value.reduce((sum, x) => sum + x.length, 0) + 64 * value.length;
+    if (hash in environmentCache) {
+        // Replaced entry becomes the newest one.
+        environmentCacheSize -= environmentCache[hash][0];
+        delete environmentCache[hash];
+    }
     while (environmentCacheSize > 0 && environmentCacheSize + size > MAX_ENVIRONMENT_CACHE_SIZE) {
         let oldestHash: string | null = null;
         for (let h in environmentCache) {
@@ -70,12 +121,180 @@ function addCachedEnvironment(hash: string, value: string[]) {
         if (oldestHash !== null) {
             environmentCacheSize -= environmentCache[oldestHash][0];
             delete environmentCache[oldestHash];
+            environmentEvicted?.(oldestHash);
         }
     }
-    environmentCache[hash] = [size, value];
+    environmentCache[hash] = [size, value, varHashes];
     environmentCacheSize += size;
 }
 
+const MAX_RESPONSE_FILE_CACHE_SIZE = 16 * 1024 * 1024;
+
+// Expanded response files by hash of the expansion, in the order of use.
+let responseFileCache = new Map<string, [number, string[]]>();
+let responseFileCacheSize = 0;
+
+function getCachedResponseFile(hash: string): string[] | null {
+    let entry = responseFileCache.get(hash);
+    if (entry === undefined) {
+        return null;
+    }
+    responseFileCache.delete(hash);
+    responseFileCache.set(hash, entry);
+    return entry[1];
+}
+
+function addCachedResponseFile(hash: string, args: string[]) {
+    let size = 2 * args.reduce((sum, x) => sum + x.length, 0) + 64 * args.length;
+    for (let [oldestHash, [oldestSize]] of responseFileCache) {
+        if (responseFileCacheSize + size <= MAX_RESPONSE_FILE_CACHE_SIZE) {
+            break;
+        }
+        responseFileCache.delete(oldestHash);
+        responseFileCacheSize -= oldestSize;
+    }
+    responseFileCache.set(hash, [size, args]);
+    responseFileCacheSize += size;
+}
+
+function writeAll(fd: number, data: Uint8Array) {
+    return new Promise<void>((resolve, reject) => {
+        let offset = 0;
+        let next = () => {
+            fs.write(fd, data, offset, data.length - offset, null, (err, written) => {
+                if (err) {
+                    reject(err);
+                    return;
+                }
+                offset += written;
+                if (offset < data.length) {
+                    next();
+                } else {
+                    resolve();
+                }
+            });
+        };
+        next();
+    });
+}
+
+const TRACE_START = 0;
+const TRACE_PROCESS_INFO = 1;
+const TRACE_ENV_HASH = 2;
+const TRACE_CONNECT = 3;
+const TRACE_WAIT = 4;
+const TRACE_COMMAND = 5;
+const TRACE_COMMAND_END = 6;
+const TRACE_JOBSERVER = 7;
+const TRACE_CACHE = 8;
+const TRACE_HANDSHAKE = 9;
+
+const COMMAND_NAMES = ['EXIT', 'STDOUT', 'STDERR', 'ENV', 'STDIO', 'ENV_SELECT', 'ENV_DELTA', 'STDIN',
+    'STDIN_CREDIT', 'READ_FILE', 'WRITE_FILE', 'HASH_FILES', 'EXEC', 'COMPRESSION', 'STDOUT_COMPRESSED',
+    'STDERR_COMPRESSED', 'TRACE', 'BUSY', 'RESPONSE_FILES', 'WRITE_BATCH', 'EXIT_METRICS',
+    'PHASE', 'READ_FILE_BULK', 'WRITE_FILE_BULK'];
+
+interface TraceRecord {
+    event: number;
+    arg: number;
+    time: number;   // nanoseconds since the first record
+}
+
+/**
+ * Histograms of stub-tool phase durations with power of two microsecond buckets.
+ */
+class TraceHistograms {
+
+    private histograms: { [phase: string]: number[] } = {};
+
+    private add(phase: string, ns: number) {
+        let bucket = Math.max(0, Math.ceil(Math.log2(Math.max(ns, 1) / 1000)));
+        let histogram = this.histograms[phase] || (this.histograms[phase] = []);
+        while (histogram.length <= bucket) {
+            histogram.push(0);
+        }
+        histogram[bucket]++;
+    }
+
+    public addTrace(records: TraceRecord[]) {
+        let time: number[] = [];
+        let waitTime = -1;
+        let commandTime = -1;
+        for (let record of records) {
+            switch (record.event) {
+                case TRACE_START:
+                case TRACE_PROCESS_INFO:
+                case TRACE_ENV_HASH:
+                case TRACE_CONNECT:
+                case TRACE_CACHE:
+                case TRACE_HANDSHAKE:
+                    time[record.event] = record.time;
+                    break;
+                case TRACE_WAIT:
+                    waitTime = record.time;
+                    break;
+                case TRACE_COMMAND:
+                    if (waitTime >= 0) {
+                        this.add('wait for controller', record.time - waitTime);
+                        waitTime = -1;
+                    }
+                    commandTime = record.time;
+                    break;
+                case TRACE_COMMAND_END:
+                    if (commandTime >= 0) {
+                        this.add(`command ${COMMAND_NAMES[record.arg] || record.arg}`, record.time - commandTime);
+                        commandTime = -1;
+                    }
+                    break;
+                case TRACE_JOBSERVER:
+                    this.add('wait for jobserver', record.arg * 1000);
+                    break;
+            }
+        }
+        if (time.length > TRACE_CONNECT) {
+            this.add('get process info', time[TRACE_PROCESS_INFO] - time[TRACE_START]);
+            this.add('calculate env hash', time[TRACE_ENV_HASH] - time[TRACE_PROCESS_INFO]);
+            let connectStart = time[TRACE_ENV_HASH];
+            if (time[TRACE_CACHE] !== undefined) {
+                this.add('local cache lookup', time[TRACE_CACHE] - time[TRACE_ENV_HASH]);
+                connectStart = time[TRACE_CACHE];
+            }
+            this.add('connect', time[TRACE_CONNECT] - connectStart);
+            if (time[TRACE_HANDSHAKE] !== undefined) {
+                this.add('send handshake', time[TRACE_HANDSHAKE] - time[TRACE_CONNECT]);
+            }
+        }
+    }
+
+    public print() {
+        for (let phase of Object.keys(this.histograms).sort()) {
+            let histogram = this.histograms[phase];
+            let total = histogram.reduce((a, b) => a + b, 0);
+            let buckets = histogram
+                .map((count, bucket) => count > 0 ? `<=${1 << bucket}us: ${count}` : '')
+                .filter(text => text !== '');
+            console.log(`${phase} (${total}): ${buckets.join(', ')}`);
+        }
+    }
+}
+
+let traceHistograms = new TraceHistograms();
+
+interface ExecResult {
+    status: number;     // exit code, 128 + signal number if killed, 127 if not started
+    error: number;      // system error code if the program was not started
+    userTime: number;   // in microseconds
+    systemTime: number; // in microseconds
+    maxRss: number;     // in kilobytes
+    wallTime: number;   // in nanoseconds
+}
+
+interface JobMetrics {
+    queueTime: number;  // time the job waited before it was started, in nanoseconds
+    wallTime: number;   // in nanoseconds
+    userTime: number;   // in microseconds
+    systemTime: number; // in microseconds
+}
 
 class StubTool {
 
@@ -92,16 +311,30 @@ class StubTool {
     private buffers: Buffer[] = [];
     private error: Error | null = null;
     private firstBufferUsed: number = 0;
-    private socket: net.Socket | null = null;
+    private socket: Duplex | null = null;
     private viewArray: Uint8Array = new Uint8Array(16);
     private view: DataView;
     private dec: TextDecoder = new TextDecoder();
     private enc: TextEncoder = new TextEncoder();
     private toolArgs: string[] = [];
+    private toolHandshakeArgs: string[] = [];
     private toolCwd: string = '';
     private toolEnv: string[] = [];
+    private toolVersion: number = 0;
+    private toolPid: number = 0;
+    private stdioFds: number[] | null = null;
+    private bulkUsable: boolean | null = null;
+    private recvTimeout: number = STUB_RECV_TIMEOUT;
+    private compression: number = COMPRESSION_NONE;
+    private compressionThreshold: number = STUB_COMPRESSION_THRESHOLD;
+    private coalesceOutput: boolean = false;
+    private outputBatch: [Uint8Array, boolean][] = [];
+    private outputBatchSize: number = 0;
+    private outputFlushScheduled: boolean = false;
+    private closing: boolean = false;
+    private cancelController: AbortController = new AbortController();
 
-    public constructor(socket: net.Socket) {
+    public constructor(socket: Duplex) {
         this.view = new DataView(this.viewArray.buffer, this.viewArray.byteOffset);
         this.socket = socket
             .on('close', hadError => {
@@ -110,6 +343,7 @@ class StubTool {
                     this.socket = null;
                     s.destroy();
                 }
+                this.closeStdio();
                 if (hadError && this.error === null) {
                     this.error = new Error('Socket close error.');
                 }
@@ -119,22 +353,36 @@ class StubTool {
                 this.buffers.push(data.subarray());
                 this.signal();
             })
+            .on('end', () => {
+                // Stub shuts down its sending direction only when it was interrupted by a signal.
+                // Closing the connection tells it that the job was cancelled.
+                if (!this.closing) {
+                    this.cancel();
+                }
+            })
             .on('error', err => {
                 this.setError(err);
             });
         this.socket.resume();
     }
 
+    private cancel() {
+        if (!this.cancelController.signal.aborted) {
+            this.cancelController.abort(new Error('Stub-tool was cancelled.'));
+        }
+        this.setError(this.cancelController.signal.reason);
+    }
+
     private waitForSignal() {
         return new Promise((resolve, reject) => {
             this.signalListeners.push([resolve, reject]);
-            if (this.timeout === null) {
+            if (this.timeout === null && this.recvTimeout > 0) {
                 this.timeout = setTimeout(() => {
                     this.timeout = null;
                     while (this.signalListeners.length > 0) {
                         (this.signalListeners.pop() as any)[1](new Error('Socket timeout error.'));
                     }
-                }, STUB_RECV_TIMEOUT);
+                }, this.recvTimeout);
             }
         })
     }
@@ -163,6 +411,7 @@ class StubTool {
     }
 
     private async close() {
+        this.closing = true;
         if (this.socket !== null) {
             this.socket.destroy();
             while (this.socket !== null) {
@@ -191,6 +440,33 @@ class StubTool {
         await this.send(this.viewArray.subarray(0, 4));
     }
 
+    /**
+     * Sends multiple fields with a single write. Numbers are sent as uint32, bigints as uint64,
+     * strings are UTF-8 encoded and prefixed by their length, binary data is sent as is.
+     */
+    private async sendMessage(...fields: (number | bigint | string | Uint8Array)[]) {
+        let parts: Uint8Array[] = [];
+        for (let field of fields) {
+            if (typeof field === 'number') {
+                let part = Buffer.alloc(4);
+                part.writeUInt32LE(field);
+                parts.push(part);
+            } else if (typeof field === 'bigint') {
+                let part = Buffer.alloc(8);
+                part.writeBigUInt64LE(field);
+                parts.push(part);
+            } else if (typeof field === 'string') {
+                let data = this.enc.encode(field);
+                let part = Buffer.alloc(4);
+                part.writeUInt32LE(data.length);
+                parts.push(part, data);
+            } else {
+                parts.push(field);
+            }
+        }
+        await this.send(Buffer.concat(parts));
+    }
+
     private async recvPartial(output: Uint8Array, length: number, offset: number) {
         while (this.buffers.length == 0) {
             if (this.error !== null) {
@@ -234,41 +510,760 @@ class StubTool {
         return this.dec.decode(buf);
     }
 
+    private async recvUint64() {
+        await this.recv(this.viewArray, 8);
+        return this.view.getUint32(0, true) + 0x100000000 * this.view.getUint32(4, true);
+    }
+
+    private async recvHash() {
+        let length = await this.recvUint32();
+        let hashBinary = new Uint8Array(length);
+        await this.recv(hashBinary, length);
+        return Buffer.from(hashBinary).toString('hex');
+    }
+
+    /**
+     * Receives payload data (file content, program output), decompressing it if compression is enabled.
+     */
+    private async recvPayload(size: number) {
+        let data = Buffer.allocUnsafe(size);
+        if (this.compression === COMPRESSION_NONE) {
+            await this.recv(data, size);
+            return data;
+        }
+        let offset = 0;
+        while (offset < size) {
+            let blockSize = await this.recvUint32();
+            let storedSize = await this.recvUint32();
+            if (blockSize === 0 || blockSize > size - offset || storedSize > blockSize) {
+                throw new Error('Invalid compressed block.');
+            }
+            if (storedSize === blockSize) {
+                await this.recv(data, blockSize, offset);
+            } else {
+                let block = new Uint8Array(storedSize);
+                await this.recv(block, storedSize);
+                data.set(lz4Decompress(block, blockSize), offset);
+            }
+            offset += blockSize;
+        }
+        return data;
+    }
+
+    /**
+     * Splits data into compressed blocks. Blocks smaller than the threshold are stored.
+     */
+    private encodeBlocks(data: Uint8Array) {
+        let parts: Uint8Array[] = [];
+        for (let offset = 0; offset < data.length; offset += LZ4_MAX_BLOCK_SIZE) {
+            let block = data.subarray(offset, offset + LZ4_MAX_BLOCK_SIZE);
+            let compressed = block.length >= this.compressionThreshold ? lz4Compress(block) : null;
+            let header = Buffer.alloc(8);
+            header.writeUInt32LE(block.length, 0);
+            header.writeUInt32LE(compressed !== null ? compressed.length : block.length, 4);
+            parts.push(header, compressed !== null ? compressed : block);
+        }
+        return Buffer.concat(parts);
+    }
+
+    private encodePayload(data: Uint8Array) {
+        return this.compression === COMPRESSION_NONE ? data : this.encodeBlocks(data);
+    }
+
+    private async recvEnv() {
+        let envCount = await this.recvUint32();
+        let env: string[] = new Array(envCount);
+        for (let i = 0; i < envCount; i++) {
+            env[i] = await this.recvString();
+        }
+        return env;
+    }
+
+    /**
+     * Receives environment as a difference against one of recently used environments
+     * and puts the result into the cache.
+     */
+    private async recvEnvDelta(hash: string) {
+        let bases = getEnvironmentDeltaBases();
+        let message: (number | Uint8Array)[] = [6, bases.length];
+        for (let [env, varHashes] of bases) {
+            message.push(env.length, varHashes);
+        }
+        await this.sendMessage(...message);
+        let baseIndex = await this.recvUint32();
+        let removedCount = await this.recvUint32();
+        let removed = new Set<number>();
+        for (let i = 0; i < removedCount; i++) {
+            removed.add(await this.recvUint32());
+        }
+        let env: string[] = [];
+        let varHashes: Uint8Array[] = [];
+        if (baseIndex !== NO_ENVIRONMENT_BASE) {
+            let [baseEnv, baseVarHashes] = bases[baseIndex];
+            for (let i = 0; i < baseEnv.length; i++) {
+                if (!removed.has(i)) {
+                    env.push(baseEnv[i]);
+                    varHashes.push(baseVarHashes.subarray(8 * i, 8 * i + 8));
+                }
+            }
+        }
+        let addedCount = await this.recvUint32();
+        for (let i = 0; i < addedCount; i++) {
+            let varHash = new Uint8Array(8);
+            await this.recv(varHash, 8);
+            varHashes.push(varHash);
+            env.push(await this.recvString());
+        }
+        addCachedEnvironment(hash, env, Buffer.concat(varHashes));
+        return env;
+    }
+
+    /**
+     * Receives only environment variables matching selectors (names or prefixes ending with '*').
+     * Environments that differ only in other variables share the same cache entry.
+     */
+    private async recvSelectedEnv(selectors: string[]) {
+        await this.sendMessage(5, selectors.length, ...selectors);
+        let hash = selectors.join('\0') + '\0' + await this.recvHash();
+        let cachedEnv = getCachedEnvironment(hash);
+        if (cachedEnv === null) {
+            await this.sendUint32(1);
+            let env = await this.recvEnv();
+            addCachedEnvironment(hash, env);
+            return env;
+        } else {
+            await this.sendUint32(0);
+            return cachedEnv;
+        }
+    }
+
+    /**
+     * Receives the job description from the stub. If envSelectors is provided, only matching
+     * environment variables are fetched (names or prefixes ending with '*').
+     */
     @synchronized
-    public async init() {
+    public async init(envSelectors: string[] | null = null) {
         try {
             let magic = await this.recvUint32();
-            if (magic != 0x7F4A9400) throw Error('Unsupported stub-tool version.');
+            this.toolVersion = magic & 0xFF;
+            if ((magic & 0xFFFFFF00) != STUB_MAGIC || this.toolVersion > STUB_PROTOCOL_VERSION) {
+                throw Error('Unsupported stub-tool version.');
+            }
             let argc = await this.recvUint32();
             this.toolArgs = new Array(argc);
             for (let i = 0; i < argc; i++) {
                 this.toolArgs[i] = await this.recvString();
             }
+            this.toolHandshakeArgs = this.toolArgs;
             this.toolCwd = await this.recvString();
-            let length = await this.recvUint32();
-            let hashBinary = new Uint8Array(length);
-            await this.recv(hashBinary, length);
+            let hash = await this.recvHash();
+            if (envSelectors !== null && this.toolVersion >= 3) {
+                this.toolEnv = await this.recvSelectedEnv(envSelectors);
+                return;
+            }
+            this.toolEnv = await this.getEnvByHash(hash);
+        } catch (err) {
+            throw this.setError(err);
+        }
+    }
+
+    /**
+     * Initializes from a job record received from the native front end instead of the handshake.
+     */
+    @synchronized
+    public async initFromJob(job: StubJob) {
+        try {
+            this.toolVersion = job.version;
+            if (this.toolVersion > STUB_PROTOCOL_VERSION) {
+                throw Error('Unsupported stub-tool version.');
+            }
+            this.toolArgs = job.args;
+            this.toolHandshakeArgs = job.args;
+            this.toolCwd = job.cwd;
+            if (job.env !== null) {
+                if (getCachedEnvironment(job.hash) === null) {
+                    addCachedEnvironment(job.hash, job.env);
+                }
+                this.toolEnv = job.env;
+            } else {
+                this.toolEnv = await this.getEnvByHash(job.hash);
+            }
+        } catch (err) {
+            throw this.setError(err);
+        }
+    }
+
+    private async getEnvByHash(hash: string) {
+        let cachedEnv = getCachedEnvironment(hash);
+        if (cachedEnv !== null) {
+            return cachedEnv;
+        } else if (this.toolVersion >= 4) {
+            return await this.recvEnvDelta(hash);
+        } else {
+            await this.sendUint32(3);
+            let env = await this.recvEnv();
+            addCachedEnvironment(hash, env);
+            return env;
+        }
+    }
+
+    /**
+     * Takes over stub's stdin, stdout and stderr, so the output is written directly
+     * without passing through the stub. Returns false if the stub does not support it.
+     */
+    @synchronized
+    public async openStdio() {
+        try {
+            if (this.stdioFds !== null) {
+                return true;
+            }
+            if (this.toolVersion < 1) {
+                return false;
+            }
+            await this.sendUint32(4);
+            this.toolPid = await this.recvUint32();
+            let count = await this.recvUint32();
+            if (count < 3 || process.platform !== 'linux') {
+                return false;
+            }
+            // Node.js does not expose SCM_RIGHTS ancillary data, so open the same files using procfs.
+            let fds: number[] = [];
+            try {
+                fds.push(fs.openSync(`/proc/${this.toolPid}/fd/0`, fs.constants.O_RDONLY | fs.constants.O_NOCTTY));
+                for (let fd = 1; fd <= 2; fd++) {
+                    fds.push(fs.openSync(`/proc/${this.toolPid}/fd/${fd}`,
+                        fs.constants.O_WRONLY | fs.constants.O_APPEND | fs.constants.O_NOCTTY));
+                }
+            } catch (err) {
+                fds.forEach(fd => fs.closeSync(fd));
+                return false;
+            }
+            this.stdioFds = fds;
+            return true;
+        } catch (err) {
+            throw this.setError(err);
+        }
+    }
+
+    @synchronized
+    private async startStdin(window: number) {
+        await this.sendMessage(7, window);
+    }
+
+    @synchronized
+    private async addStdinCredit(credit: number) {
+        await this.sendMessage(8, credit);
+    }
+
+    /**
+     * Streams stub's standard input. At most `window` bytes are in flight, more data is
+     * requested only when the consumer asks for the next chunk. Until the iteration is
+     * finished, only print() and exit() may be called on this object.
+     */
+    public async *readStdin(window: number = STUB_STDIN_WINDOW): AsyncGenerator<Uint8Array> {
+        if (this.toolVersion < 5) {
+            throw new Error('Stub-tool does not support stdin forwarding.');
+        }
+        await this.startStdin(window);
+        // Input producer may be idle for a long time, so do not apply the timeout.
+        this.recvTimeout = 0;
+        try {
+            while (true) {
+                let length = await this.recvUint32();
+                if (length === 0) {
+                    return;
+                }
+                let data = new Uint8Array(length);
+                await this.recv(data, length);
+                yield data;
+                await this.addStdinCredit(length);
+            }
+        } catch (err) {
+            throw this.setError(err);
+        } finally {
+            this.recvTimeout = STUB_RECV_TIMEOUT;
+        }
+    }
+
+    /**
+     * Reads a file on the stub side. Relative paths are relative to the tool's cwd.
+     */
+    @synchronized
+    public async readFile(filePath: string) {
+        if (this.toolVersion < 6) {
+            throw new Error('Stub-tool does not support file transfer.');
+        }
+        let result = await this.readFileOnce(filePath, this.bulkSupported());
+        if (result === null) {
+            // Descriptors of the stub cannot be opened, so it is read again inline.
+            result = await this.readFileOnce(filePath, false);
+        }
+        let [status, data] = result!;
+        if (status !== 0 || data === null) {
+            throw new Error(`Cannot read "${filePath}", error code ${status}.`);
+        }
+        return data;
+    }
+
+    /**
+     * Returns the status and content of a file or null if the bulk descriptor cannot be opened.
+     */
+    private async readFileOnce(filePath: string, bulk: boolean): Promise<[number, Buffer | null] | null> {
+        let status: number;
+        let data: Buffer | null = null;
+        try {
+            await this.sendMessage(bulk ? 22 : 9, filePath, ...(bulk ? [STUB_BULK_THRESHOLD] : []));
+            status = await this.recvUint32();
+            if (status === 0) {
+                let size = await this.recvUint64();
+                if (bulk && await this.recvUint32()) {
+                    let pid = await this.recvUint32();
+                    let handle = await this.recvUint32();
+                    let file = await this.openBulk(pid, handle, fs.constants.O_RDONLY);
+                    if (file === null) {
+                        return null;
+                    }
+                    data = Buffer.allocUnsafe(size);
+                    try {
+                        for (let offset = 0; offset < size;) {
+                            let { bytesRead } = await file.read(data, offset, size - offset, offset);
+                            if (bytesRead === 0) {
+                                throw new Error(`File "${filePath}" was truncated while reading.`);
+                            }
+                            offset += bytesRead;
+                        }
+                    } finally {
+                        await file.close();
+                    }
+                } else {
+                    data = await this.recvPayload(size);
+                    status = await this.recvUint32();
+                }
+            }
+        } catch (err) {
+            throw this.setError(err);
+        }
+        return [status, data];
+    }
+
+    /**
+     * Writes a file on the stub side. The file is replaced atomically.
+     * Relative paths are relative to the tool's cwd.
+     */
+    @synchronized
+    public async writeFile(filePath: string, data: Uint8Array, mode: number = 0o666) {
+        if (this.toolVersion < 6) {
+            throw new Error('Stub-tool does not support file transfer.');
+        }
+        let status = await this.writeFileOnce(filePath, data, mode,
+            this.bulkSupported() && data.length > STUB_BULK_THRESHOLD);
+        if (status === null) {
+            // Descriptors of the stub cannot be opened, so it is written again inline.
+            status = await this.writeFileOnce(filePath, data, mode, false);
+        }
+        if (status !== 0) {
+            throw new Error(`Cannot write "${filePath}", error code ${status}.`);
+        }
+    }
+
+    /**
+     * Returns the status or null if the bulk descriptor cannot be opened.
+     */
+    private async writeFileOnce(filePath: string, data: Uint8Array, mode: number, bulk: boolean) {
+        let status: number;
+        let file: fs.promises.FileHandle | null = null;
+        let writeError: any = null;
+        try {
+            await this.sendMessage(bulk ? 23 : 10, filePath, mode, data.length % 0x100000000,
+                Math.floor(data.length / 0x100000000));
+            if (bulk) {
+                status = await this.recvUint32();
+                if (status === 0) {
+                    let pid = await this.recvUint32();
+                    let handle = await this.recvUint32();
+                    file = await this.openBulk(pid, handle, fs.constants.O_WRONLY);
+                    writeError = file !== null ? await this.writeBulk(file, data) : null;
+                    // On error or fallback, the stub removes the temporary file.
+                    await this.sendUint32(file === null || writeError ? 1 : 0);
+                    status = await this.recvUint32();
+                    if (file === null) {
+                        return null;
+                    }
+                }
+            } else {
+                await this.send(this.encodePayload(data));
+                status = await this.recvUint32();
+            }
+        } catch (err) {
+            throw this.setError(err);
+        }
+        if (writeError) {
+            throw writeError;
+        }
+        return status;
+    }
+
+    private bulkSupported() {
+        return this.toolVersion >= 17 && process.platform === 'linux' && this.bulkUsable !== false;
+    }
+
+    /**
+     * Opens a descriptor passed by the READ_FILE_BULK or WRITE_FILE_BULK command. Returns null if
+     * it cannot be opened, inline commands are used for the rest of the connection then.
+     */
+    private async openBulk(pid: number, handle: number, flags: number) {
+        try {
+            if (this.bulkUsable === null) {
+                // Controller running as another user or in a container may not reach the stub's procfs
+                // entries. In another PID namespace, the pid may even belong to an unrelated process.
+                let cmdline = await fs.promises.readFile(`/proc/${pid}/cmdline`);
+                let cwd = await fs.promises.readlink(`/proc/${pid}/cwd`);
+                this.bulkUsable = cwd === this.toolCwd
+                    && cmdline.equals(Buffer.from(this.toolHandshakeArgs.map(arg => arg + '\0').join('')));
+            }
+            if (this.bulkUsable) {
+                // Node.js does not expose SCM_RIGHTS ancillary data, so open the same file using procfs.
+                return await fs.promises.open(`/proc/${pid}/fd/${handle}`, flags | fs.constants.O_NOCTTY);
+            }
+        } catch (err) {
+            this.bulkUsable = false;
+        }
+        return null;
+    }
+
+    private async writeBulk(file: fs.promises.FileHandle, data: Uint8Array) {
+        try {
+            for (let offset = 0; offset < data.length;) {
+                let { bytesWritten } = await file.write(data, offset, data.length - offset, offset);
+                offset += bytesWritten;
+            }
+            return null;
+        } catch (err) {
+            return err;
+        } finally {
+            await file.close();
+        }
+    }
+
+    /**
+     * Hashes environment variables matching selectors (names or prefixes ending with '*') on the
+     * stub side, without receiving them.
+     */
+    @synchronized
+    public async selectedEnvHash(selectors: string[]) {
+        if (this.toolVersion < 3) {
+            throw new Error('Stub-tool does not support environment selection.');
+        }
+        try {
+            await this.sendMessage(5, selectors.length, ...selectors);
+            let hash = Buffer.from(await this.recvHash(), 'hex');
+            await this.sendUint32(0);
+            return hash;
+        } catch (err) {
+            throw this.setError(err);
+        }
+    }
+
+    /**
+     * Hashes files on the stub side in parallel. Hash has the same format as environment hash.
+     * Modification time is in milliseconds since 1970-01-01 UTC.
+     */
+    @synchronized
+    public async hashFiles(paths: string[]) {
+        if (this.toolVersion < 7) {
+            throw new Error('Stub-tool does not support file hashing.');
+        }
+        try {
+            await this.sendMessage(11, paths.length, ...paths);
+            let hashLength = await this.recvUint32();
+            let result: { status: number, size: number, mtime: number, hash: string }[] = [];
+            for (let i = 0; i < paths.length; i++) {
+                let status = await this.recvUint32();
+                let size = await this.recvUint64();
+                await this.recv(this.viewArray, 8);
+                let mtime = this.view.getUint32(0, true) / 1000000 + this.view.getUint32(4, true) * (0x100000000 / 1000000);
+                let hash = new Uint8Array(hashLength);
+                await this.recv(hash, hashLength);
+                result.push({ status, size, mtime, hash: Buffer.from(hash).toString('hex') });
+            }
+            return result;
+        } catch (err) {
+            throw this.setError(err);
+        }
+    }
+
+    private async recvResponseFiles(includeArgs: boolean) {
+        await this.sendMessage(18, includeArgs ? 1 : 0);
+        let hashLength = await this.recvUint32();
+        let count = await this.recvUint32();
+        let result: { index: number, status: number, args: string[] | null }[] = [];
+        for (let i = 0; i < count; i++) {
+            let index = await this.recvUint32();
+            let status = await this.recvUint32();
+            let hashBinary = new Uint8Array(hashLength);
+            await this.recv(hashBinary, hashLength);
             let hash = Buffer.from(hashBinary).toString('hex');
-            let cachedEnv = getCachedEnvironment(hash);
-            if (cachedEnv === null) {
-                await this.sendUint32(3);
-                let envCount = await this.recvUint32();
-                this.toolEnv = new Array(envCount);
-                for (let i = 0; i < envCount; i++) {
-                    this.toolEnv[i] = await this.recvString();
+            let args: string[] | null = null;
+            if (status !== 0) {
+                // Argument is used as is, like GCC does when the file cannot be read.
+            } else if (includeArgs) {
+                args = new Array(await this.recvUint32());
+                let block = Buffer.alloc(await this.recvUint32());
+                await this.recv(block, block.length);
+                let offset = 0;
+                for (let k = 0; k < args.length; k++) {
+                    let length = block.readUInt32LE(offset);
+                    args[k] = this.dec.decode(block.subarray(offset + 4, offset + 4 + length));
+                    offset += 4 + length;
                 }
-                addCachedEnvironment(hash, this.toolEnv);
+                addCachedResponseFile(hash, args);
             } else {
-                this.toolEnv = cachedEnv;
+                args = getCachedResponseFile(hash);
+                if (args === null) {
+                    status = -1;
+                }
+            }
+            result.push({ index, status, args });
+        }
+        return result;
+    }
+
+    /**
+     * Replaces response file arguments ("@file") with their content, split on the stub side the
+     * same way as GCC does. Expanded files are cached by their hash, so only hashes are transferred
+     * when the same response file is used again. Arguments that cannot be read are left as they are.
+     * Returns false if the stub does not support it.
+     */
+    @synchronized
+    public async expandResponseFiles() {
+        if (this.toolVersion < 12) {
+            return false;
+        }
+        if (!this.toolArgs.some((arg, i) => i > 0 && arg.startsWith('@'))) {
+            return true;
+        }
+        try {
+            let files = await this.recvResponseFiles(false);
+            if (files.some(file => file.status === -1)) {
+                files = await this.recvResponseFiles(true);
+            }
+            // Response files may contain too many arguments to pass them as function parameters.
+            let parts: string[][] = [];
+            let next = 0;
+            for (let file of files) {
+                if (file.args !== null) {
+                    parts.push(this.toolArgs.slice(next, file.index), file.args);
+                    next = file.index + 1;
+                }
+            }
+            parts.push(this.toolArgs.slice(next));
+            this.toolArgs = ([] as string[]).concat(...parts);
+        } catch (err) {
+            throw this.setError(err);
+        }
+        return true;
+    }
+
+    @synchronized
+    private async startExec(args: string[], cwd: string, env: string[] | null) {
+        let envFields = env === null ? [INHERIT_ENVIRONMENT] : [env.length, ...env];
+        await this.sendMessage(12, args.length, ...args, cwd, ...envFields);
+    }
+
+    /**
+     * Executes a program on the stub side. Output is passed to `onOutput` as soon as it is
+     * produced, so it can be processed while the program is still running. Empty `cwd` means
+     * the tool's cwd, `null` environment means the tool's environment. Until the returned
+     * promise is resolved, only print() and exit() may be called on this object.
+     */
+    public async exec(args: string[], onOutput: (data: Uint8Array, stderr: boolean) => void | Promise<void>,
+        cwd: string = '', env: string[] | null = null): Promise<ExecResult> {
+        if (this.toolVersion < 8) {
+            throw new Error('Stub-tool does not support program execution.');
+        }
+        await this.startExec(args, cwd, env);
+        // Program may run for a long time without any output, so do not apply the timeout.
+        this.recvTimeout = 0;
+        try {
+            while (true) {
+                let stream = await this.recvUint32();
+                if (stream === 0) {
+                    break;
+                }
+                let length = await this.recvUint32();
+                let data = await this.recvPayload(length);
+                await onOutput(data, stream === 2);
+            }
+            return {
+                status: await this.recvUint32(),
+                error: await this.recvUint32(),
+                userTime: await this.recvUint64(),
+                systemTime: await this.recvUint64(),
+                maxRss: await this.recvUint64(),
+                wallTime: await this.recvUint64(),
+            };
+        } catch (err) {
+            throw this.setError(err);
+        } finally {
+            this.recvTimeout = STUB_RECV_TIMEOUT;
+        }
+    }
+
+    /**
+     * Enables LZ4 compression of file and program output payloads. Useful when the data is relayed
+     * over network, local transfers are faster without it. Blocks smaller than `threshold` bytes
+     * are not compressed. Returns true if the stub supports it.
+     */
+    @synchronized
+    public async enableCompression(threshold: number = STUB_COMPRESSION_THRESHOLD) {
+        if (this.toolVersion < 9) {
+            return false;
+        }
+        try {
+            await this.sendMessage(13, COMPRESSION_LZ4, threshold);
+            this.compression = await this.recvUint32();
+            this.compressionThreshold = threshold;
+        } catch (err) {
+            throw this.setError(err);
+        }
+        return this.compression !== COMPRESSION_NONE;
+    }
+
+    /**
+     * Gets timing trace of the stub. It is empty if the stub was not started with
+     * REMOTE_JOBS_TRACE environment variable.
+     */
+    @synchronized
+    public async trace() {
+        let records: TraceRecord[] = [];
+        if (this.toolVersion < 10) {
+            return records;
+        }
+        try {
+            await this.sendUint32(16);
+            let count = await this.recvUint32();
+            await this.recvUint32();
+            for (let i = 0; i < count; i++) {
+                let event = await this.recvUint32();
+                let arg = await this.recvUint32();
+                let time = await this.recvUint64();
+                records.push({ event, arg, time });
             }
         } catch (err) {
             throw this.setError(err);
         }
+        return records;
+    }
+
+    /**
+     * Tells the stub to run the tool locally. It must be called before anything else
+     * was done with the stub. Returns false if the stub does not support it.
+     */
+    @synchronized
+    public async busy() {
+        if (this.toolVersion < 11) {
+            return false;
+        }
+        try {
+            await this.sendUint32(17);
+            await this.close();
+        } catch (err) {
+            throw this.setError(err);
+        }
+        return true;
+    }
+
+    /**
+     * Tells the stub where the job runs. In PHASE_REMOTE, the stub gives its GNU make jobserver
+     * token back, so make can start more jobs than local slots. The stub takes it again before
+     * EXEC and exit. Returns false if the stub does not support it.
+     */
+    @synchronized
+    public async setPhase(phase: number) {
+        if (this.toolVersion < 16) {
+            return false;
+        }
+        try {
+            await this.sendMessage(21, phase);
+        } catch (err) {
+            throw this.setError(err);
+        }
+        return true;
+    }
+
+    private closeStdio() {
+        if (this.stdioFds !== null) {
+            this.stdioFds.forEach(fd => fs.closeSync(fd));
+            this.stdioFds = null;
+        }
+    }
+
+    /**
+     * Enables coalescing of print() calls. Output is collected and sent in a single WRITE_BATCH
+     * command when the batch is full or on the next event loop iteration, so relaying output
+     * line by line does not cost a message and a write on the stub side for every line.
+     * Returns false if the stub does not support it.
+     */
+    public setOutputCoalescing(enabled: boolean) {
+        this.coalesceOutput = enabled && this.toolVersion >= 13;
+        return this.coalesceOutput === enabled;
+    }
+
+    private async sendOutputBatch() {
+        let batch = this.outputBatch;
+        this.outputBatch = [];
+        this.outputBatchSize = 0;
+        if (batch.length === 1) {
+            await this.sendMessage(batch[0][1] ? 2 : 1, batch[0][0].length, batch[0][0]);
+        } else if (batch.length > 1) {
+            let headers: number[] = [];
+            for (let [value, stderr] of batch) {
+                headers.push(stderr ? 2 : 1, value.length);
+            }
+            let size = batch.reduce((sum, [value]) => sum + value.length, 0);
+            await this.sendMessage(19, batch.length, size, ...headers, ...batch.map(([value]) => value));
+        }
+    }
+
+    @synchronized
+    private async flushOutput() {
+        this.outputFlushScheduled = false;
+        try {
+            await this.sendOutputBatch();
+        } catch (err) {
+            this.setError(err);
+        }
     }
 
     @synchronized
     public async print(value: Uint8Array, stderr: boolean) {
         try {
+            if (this.stdioFds !== null) {
+                await this.sendOutputBatch();
+                await writeAll(this.stdioFds[stderr ? 2 : 1], value);
+                return;
+            }
+            let segmentSize = value.length + WRITE_BATCH_HEADER_SIZE;
+            if (this.coalesceOutput && segmentSize <= WRITE_BATCH_MAX_SIZE) {
+                if (this.outputBatchSize + segmentSize > WRITE_BATCH_MAX_SIZE
+                    || this.outputBatch.length >= WRITE_BATCH_MAX_SEGMENTS) {
+                    await this.sendOutputBatch();
+                }
+                // Caller owns the value, so it is copied if it stays in the batch.
+                this.outputBatch.push([Uint8Array.from(value), stderr]);
+                this.outputBatchSize += segmentSize;
+                if (!this.outputFlushScheduled) {
+                    this.outputFlushScheduled = true;
+                    setImmediate(() => this.flushOutput());
+                }
+                return;
+            }
+            // Output must stay in order.
+            await this.sendOutputBatch();
+            if (this.compression !== COMPRESSION_NONE && value.length >= this.compressionThreshold) {
+                await this.sendMessage(stderr ? 15 : 14, value.length, this.encodeBlocks(value));
+                return;
+            }
             await this.sendUint32(stderr ? 2 : 1);
             await this.sendUint32(value.length);
             await this.send(value);
@@ -277,11 +1272,21 @@ class StubTool {
         }
     }
 
+    /**
+     * Exits the stub with the status. Metrics of the job are written by the stub to the file
+     * given in REMOTE_JOBS_METRICS along with its own resource usage.
+     */
     @synchronized
-    public async exit(status: number) {
+    public async exit(status: number, metrics: JobMetrics | null = null) {
         try {
-            await this.sendUint32(0);
-            await this.sendUint32(status);
+            await this.sendOutputBatch();
+            this.closeStdio();
+            if (metrics !== null && this.toolVersion >= 14) {
+                let values = [metrics.queueTime, metrics.wallTime, metrics.userTime, metrics.systemTime];
+                await this.sendMessage(20, status, values.length, ...values.map(x => BigInt(Math.max(0, Math.round(x)))));
+            } else {
+                await this.sendMessage(0, status);
+            }
             await this.close();
         } catch (err) {
             throw this.setError(err);
@@ -292,6 +1297,10 @@ class StubTool {
         return this.toolEnv;
     }
 
+    public get version() {
+        return this.toolVersion;
+    }
+
     public get cwd() {
         return this.toolCwd;
     }
@@ -299,11 +1308,68 @@ class StubTool {
     public get args() {
         return this.toolArgs;
     }
+
+    /**
+     * Arguments as sent by the stub, before expandResponseFiles() replaced them.
+     */
+    public get handshakeArgs() {
+        return this.toolHandshakeArgs;
+    }
+
+    public get stdio() {
+        return this.stdioFds;
+    }
+
+    /**
+     * Signal aborted when the stub was interrupted (e.g. Ctrl-C) before the job exited.
+     * Work done for the job should be stopped, the stub is already waiting for its end.
+     */
+    public get cancelSignal(): AbortSignal {
+        return this.cancelController.signal;
+    }
 }
 
-async function handleClient(socket: net.Socket) {
-    let tool = new StubTool(socket);
-    await tool.init();
+const MAX_ACTIVE_CLIENTS = os.cpus().length;
+
+let activeClients = 0;
+
+// In benchmark mode, clients are only initialized and exited for handshake load testing.
+let benchMode = process.argv.includes('--bench');
+
+// Local cache read by stubs with REMOTE_JOBS_CACHE set to the same directory.
+const STUB_CACHE_MAX_SIZE = 1024 * 1024 * 1024;
+let stubCache: StubCache | null = null;
+
+async function handleClient(tool: StubTool) {
+    let received = process.hrtime.bigint();
+    if (activeClients >= MAX_ACTIVE_CLIENTS && await tool.busy()) {
+        // Stub runs the tool locally instead of waiting for the controller.
+        return;
+    }
+    activeClients++;
+    try {
+        if (benchMode) {
+            await tool.exit(0);
+        } else {
+            await runClient(tool, Number(process.hrtime.bigint() - received));
+        }
+    } catch (err) {
+        if (!tool.cancelSignal.aborted) {
+            throw err;
+        }
+    } finally {
+        activeClients--;
+    }
+}
+
+async function runClient(tool: StubTool, queueTime: number) {
+    let start = process.hrtime.bigint();
+    // Controller's CPU time is shared by all jobs, the real one would use CPU time of the remote process.
+    let cpu = process.cpuUsage();
+    tool.cancelSignal.addEventListener('abort', () => console.log('Job cancelled'));
+    await tool.expandResponseFiles();
+    await tool.setPhase(PHASE_REMOTE);
+    tool.setOutputCoalescing(true);
     for (let arg of tool.args) {
         console.log('arg', arg);
     }
@@ -312,21 +1378,71 @@ async function handleClient(socket: net.Socket) {
         console.log('env', env);
     }
     let enc = new TextEncoder();
-    await tool.print(enc.encode("This is stdout.\n"), false);
-    await tool.print(enc.encode("This is stderr.\n"), true);
-    await tool.exit(13);
+    let stdout = enc.encode("This is stdout.\n");
+    let stderr = enc.encode("This is stderr.\n");
+    await tool.openStdio();
+    await tool.print(stdout, false);
+    await tool.print(stderr, true);
+    traceHistograms.addTrace(await tool.trace());
+    if (stubCache !== null && tool.version >= 18) {
+        // Arguments naming existing files are the inputs of this job. The record is keyed by the
+        // handshake arguments, so the response files they were expanded from are inputs too.
+        let inputPaths = tool.args.slice(1).concat(tool.handshakeArgs.slice(1)
+            .filter(arg => arg.startsWith('@')).map(arg => arg.substring(1)));
+        let inputs = (await tool.hashFiles(inputPaths))
+            .map((file, i) => ({ path: inputPaths[i], hash: Buffer.from(file.hash, 'hex'), status: file.status }))
+            .filter(file => file.status === 0);
+        await stubCache.store(tool.handshakeArgs, tool.cwd, {
+            status: 13,
+            envSelectors: [],
+            envHash: await tool.selectedEnvHash([]),
+            inputs,
+            outputs: [],
+            stdout,
+            stderr,
+        });
+    }
+    cpu = process.cpuUsage(cpu);
+    await tool.exit(13, {
+        queueTime,
+        wallTime: Number(process.hrtime.bigint() - start),
+        userTime: cpu.user,
+        systemTime: cpu.system,
+    });
 }
 
-function serverConnection(socket: net.Socket) {
-    console.log('Server connected');
-    handleClient(socket);
+async function serverConnection(socket: net.Socket) {
+    if (!benchMode) {
+        console.log('Server connected');
+    }
+    let tool = new StubTool(socket);
+    await tool.init();
+    await handleClient(tool);
+}
+
+async function frontendJob(stream: Duplex, job: StubJob) {
+    let tool = new StubTool(stream);
+    await tool.initFromJob(job);
+    await handleClient(tool);
 }
 
 function serverClosed() {
     console.log('Server closed');
+    traceHistograms.print();
 }
 
 async function main() {
+    let cacheIndex = process.argv.indexOf('--cache');
+    if (cacheIndex >= 0) {
+        stubCache = new StubCache(process.argv[cacheIndex + 1], STUB_CACHE_MAX_SIZE);
+    }
+    let frontendIndex = process.argv.indexOf('--frontend');
+    if (frontendIndex >= 0) {
+        // Native front end accepts connections and parses handshakes.
+        let frontend = new StubFrontend(process.argv[frontendIndex + 1], '0', frontendJob);
+        environmentEvicted = hash => frontend.forgetEnvironment(hash);
+        return;
+    }
     let connection_path: string;
     if (process.platform === 'win32') {
         connection_path = `\\\\.\\pipe\\${CONNECTION_PREFIX}.0`;
@@ -339,14 +1455,23 @@ async function main() {
             fs.unlinkSync(connection_path);
         } catch { }
     }
-    let server = net.createServer()
-        .on('error', serverError)
-        .on('listening', serverListening)
-        .on('connection', serverConnection)
-        .on('close', serverClosed);
-    console.log(`listen: ${connection_path}0S`);
-    server.listen(connection_path);
-    setTimeout(() => server.close(), 20000);
+    let paths = [connection_path];
+    if (process.platform === 'linux') {
+        // Stub tries the abstract name first, it does not create any files.
+        paths.unshift(`\0${CONNECTION_PREFIX}/0S`);
+    }
+    for (let listenPath of paths) {
+        let server = net.createServer()
+            .on('error', serverError)
+            .on('listening', serverListening)
+            .on('connection', serverConnection)
+            .on('close', serverClosed);
+        console.log(`listen: ${JSON.stringify(listenPath)}`);
+        server.listen(listenPath);
+        if (!benchMode) {
+            setTimeout(() => server.close(), 20000);
+        }
+    }
 }
 
 main();
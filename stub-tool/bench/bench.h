@@ -0,0 +1,265 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define CONNECTION_PREFIX "RemJobs75oKmnN7rWX"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// Minimal stand-in controller used by the benchmarks. It speaks the protocol
+// described at the end of main.c and runs the stub-tool as a child process.
+
+typedef struct
+{
+    int sock;
+    uint8_t data[65536];
+    size_t begin;
+    size_t end;
+} bench_conn;
+
+static void bench_fail(const char *message)
+{
+    perror(message);
+    exit(1);
+}
+
+static uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_listen(const char *id)
+{
+    int sock;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    mkdir("/tmp/" CONNECTION_PREFIX, 0777);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/" CONNECTION_PREFIX "/%sS", id);
+    unlink(addr.sun_path);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        bench_fail("socket");
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        bench_fail("bind");
+    if (listen(sock, 1024) < 0)
+        bench_fail("listen");
+    return sock;
+}
+
+// Listens on the Linux abstract socket name used by the stub before it tries the path.
+static int bench_listen_abstract(const char *id)
+{
+    int sock;
+    int len;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    len = snprintf(&addr.sun_path[1], sizeof(addr.sun_path) - 1, CONNECTION_PREFIX "/%sS", id);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        bench_fail("socket");
+    if (bind(sock, (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + 1 + len) < 0)
+        bench_fail("bind");
+    if (listen(sock, 1024) < 0)
+        bench_fail("listen");
+    return sock;
+}
+
+static void bench_unlisten(int sock, const char *id)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/tmp/" CONNECTION_PREFIX "/%sS", id);
+    close(sock);
+    unlink(path);
+}
+
+static pid_t bench_spawn(const char *stub, const char *id, char *const *args, int stdout_fd)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+        bench_fail("fork");
+    if (pid == 0)
+    {
+        setenv("REMOTE_JOBS_CONNECTION_ID", id, 1);
+        if (stdout_fd >= 0)
+        {
+            dup2(stdout_fd, 1);
+        }
+        if (args != NULL)
+        {
+            execv(stub, args);
+        }
+        else
+        {
+            execl(stub, stub, "-c", "input.c", "-o", "output.o", NULL);
+        }
+        _exit(127);
+    }
+    return pid;
+}
+
+// Thread-safe variant of bench_spawn(), the environment is given explicitly.
+static pid_t bench_spawn_env(const char *stub, char *const *envp, int stdout_fd)
+{
+    static char *const args[] = {"stub-tool", "-c", "input.c", "-o", "output.o", NULL};
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int rc;
+    posix_spawn_file_actions_init(&actions);
+    if (stdout_fd >= 0)
+    {
+        posix_spawn_file_actions_adddup2(&actions, stdout_fd, 1);
+    }
+    rc = posix_spawn(&pid, stub, &actions, NULL, args, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0)
+    {
+        errno = rc;
+        bench_fail("posix_spawn");
+    }
+    return pid;
+}
+
+static int bench_wait(pid_t pid)
+{
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        bench_fail("waitpid");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void bench_accept(bench_conn *conn, int listen_sock)
+{
+    conn->sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn->sock < 0)
+        bench_fail("accept");
+    conn->begin = 0;
+    conn->end = 0;
+}
+
+static void bench_recv(bench_conn *conn, void *data, size_t size)
+{
+    uint8_t *ptr = data;
+    while (size > 0)
+    {
+        size_t n;
+        if (conn->begin == conn->end)
+        {
+            ssize_t r = recv(conn->sock, conn->data, sizeof(conn->data), 0);
+            if (r <= 0)
+                bench_fail("recv");
+            conn->begin = 0;
+            conn->end = r;
+        }
+        n = MIN(size, conn->end - conn->begin);
+        memcpy(ptr, &conn->data[conn->begin], n);
+        conn->begin += n;
+        ptr += n;
+        size -= n;
+    }
+}
+
+static uint32_t bench_recv_int(bench_conn *conn)
+{
+    uint32_t value;
+    bench_recv(conn, &value, sizeof(value));
+    return value;
+}
+
+static void bench_skip(bench_conn *conn, size_t size)
+{
+    uint8_t temp[4096];
+    while (size > 0)
+    {
+        size_t n = MIN(size, sizeof(temp));
+        bench_recv(conn, temp, n);
+        size -= n;
+    }
+}
+
+static void bench_send(bench_conn *conn, const void *data, size_t size)
+{
+    const uint8_t *ptr = data;
+    while (size > 0)
+    {
+        ssize_t n = send(conn->sock, ptr, size, MSG_NOSIGNAL);
+        if (n <= 0)
+            bench_fail("send");
+        ptr += n;
+        size -= n;
+    }
+}
+
+static void bench_send_int(bench_conn *conn, uint32_t value)
+{
+    bench_send(conn, &value, sizeof(value));
+}
+
+// Receives the handshake and returns the protocol version.
+static uint32_t bench_handshake(bench_conn *conn)
+{
+    uint32_t magic = bench_recv_int(conn);
+    uint32_t i;
+    uint32_t argc;
+    if ((magic & 0xFFFFFF00) != 0x7F4A9400)
+    {
+        fprintf(stderr, "Invalid magic value 0x%08X\n", magic);
+        exit(1);
+    }
+    argc = bench_recv_int(conn);
+    for (i = 0; i < argc; i++)
+    {
+        bench_skip(conn, bench_recv_int(conn));
+    }
+    bench_skip(conn, bench_recv_int(conn));
+    bench_skip(conn, bench_recv_int(conn));
+    return magic & 0xFF;
+}
+
+static void bench_exit(bench_conn *conn, uint32_t status)
+{
+    bench_send_int(conn, 0);
+    bench_send_int(conn, status);
+    close(conn->sock);
+    conn->sock = -1;
+}
+
+#endif
@@ -0,0 +1,219 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Bulk transfer benchmark.
+
+Writes and reads files of different sizes through the stub, once inline over the socket
+(WRITE_FILE, READ_FILE) and once through descriptors passed by the stub (WRITE_FILE_BULK,
+READ_FILE_BULK). The controller opens the descriptors through /proc/<pid>/fd, like the
+Node.js controller does. Reported times include opening the descriptor and copying the data
+between the controller's memory and the file.
+
+    gcc -O3 -pthread -o stub-tool/stub-tool stub-tool/main.c
+    gcc -O2 -o stub-tool/bench-bulk stub-tool/bench/bulk.c
+    stub-tool/bench-bulk stub-tool/stub-tool
+
+Options:
+    -d directory    directory for the files (default /tmp)
+    -n runs         number of transfers per size and mode (default 20)
+*/
+
+#include "bench.h"
+
+#include <limits.h>
+
+#define MAX_SIZE (64 * 1024 * 1024)
+
+static uint8_t *payload;
+static uint8_t *received;
+
+static void send_str(bench_conn *conn, const char *str)
+{
+    bench_send_int(conn, strlen(str));
+    bench_send(conn, str, strlen(str));
+}
+
+static void send_int64(bench_conn *conn, uint64_t value)
+{
+    bench_send(conn, &value, sizeof(value));
+}
+
+static uint64_t recv_int64(bench_conn *conn)
+{
+    uint64_t value;
+    bench_recv(conn, &value, sizeof(value));
+    return value;
+}
+
+static void check_status(uint32_t status, const char *operation)
+{
+    if (status != 0)
+    {
+        fprintf(stderr, "%s failed with error %u.\n", operation, status);
+        exit(1);
+    }
+}
+
+static int open_bulk(bench_conn *conn, int flags)
+{
+    char path[64];
+    uint32_t pid = bench_recv_int(conn);
+    uint32_t handle = bench_recv_int(conn);
+    int fd;
+    snprintf(path, sizeof(path), "/proc/%u/fd/%u", pid, handle);
+    fd = open(path, flags | O_CLOEXEC);
+    if (fd < 0)
+        bench_fail(path);
+    return fd;
+}
+
+static void write_file(bench_conn *conn, const char *path, size_t size, bool bulk)
+{
+    int fd;
+    bench_send_int(conn, bulk ? 23 : 10);
+    send_str(conn, path);
+    bench_send_int(conn, 0644);
+    send_int64(conn, size);
+    if (!bulk)
+    {
+        bench_send(conn, payload, size);
+    }
+    else
+    {
+        check_status(bench_recv_int(conn), "WRITE_FILE_BULK");
+        fd = open_bulk(conn, O_WRONLY);
+        if (pwrite(fd, payload, size, 0) != (ssize_t)size)
+            bench_fail("pwrite");
+        close(fd);
+        bench_send_int(conn, 0);
+    }
+    check_status(bench_recv_int(conn), bulk ? "WRITE_FILE_BULK" : "WRITE_FILE");
+}
+
+static void read_file(bench_conn *conn, const char *path, size_t size, bool bulk)
+{
+    uint64_t received_size;
+    int fd;
+    bench_send_int(conn, bulk ? 22 : 9);
+    send_str(conn, path);
+    if (bulk)
+    {
+        // Threshold 0 forces the bulk transfer, so both modes are measured at every size.
+        bench_send_int(conn, 0);
+    }
+    check_status(bench_recv_int(conn), bulk ? "READ_FILE_BULK" : "READ_FILE");
+    received_size = recv_int64(conn);
+    if (received_size != size)
+    {
+        fprintf(stderr, "File size mismatch.\n");
+        exit(1);
+    }
+    if (bulk && bench_recv_int(conn) == 1)
+    {
+        fd = open_bulk(conn, O_RDONLY);
+        if (pread(fd, received, size, 0) != (ssize_t)size)
+            bench_fail("pread");
+        close(fd);
+    }
+    else
+    {
+        bench_recv(conn, received, size);
+        check_status(bench_recv_int(conn), "READ_FILE");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = {64 * 1024, 1024 * 1024, 16 * 1024 * 1024, MAX_SIZE};
+    const char *dir = "/tmp";
+    char path[PATH_MAX];
+    bench_conn conn;
+    int listen_sock;
+    int runs = 20;
+    int opt;
+    size_t i;
+    int k;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "d:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d directory] [-n runs] stub\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc || runs < 1)
+    {
+        fprintf(stderr, "Usage: %s [-d directory] [-n runs] stub\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    payload = malloc(MAX_SIZE);
+    received = malloc(MAX_SIZE);
+    for (i = 0; i < MAX_SIZE; i++)
+    {
+        payload[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+    snprintf(path, sizeof(path), "%s/bench-bulk-%d.bin", dir, (int)getpid());
+
+    listen_sock = bench_listen_abstract("bench");
+    pid = bench_spawn(argv[optind], "bench", NULL, -1);
+    bench_accept(&conn, listen_sock);
+    close(listen_sock);
+    if (bench_handshake(&conn) < 17)
+    {
+        fprintf(stderr, "Stub-tool does not support bulk transfers.\n");
+        return 1;
+    }
+
+    printf("%10s %16s %16s %16s %16s\n", "size", "write inline", "write bulk", "read inline", "read bulk");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        double times[4];
+        int mode;
+        for (mode = 0; mode < 4; mode++)
+        {
+            bool bulk = mode & 1;
+            uint64_t start = bench_now();
+            for (k = 0; k < runs; k++)
+            {
+                if (mode < 2)
+                {
+                    write_file(&conn, path, sizes[i], bulk);
+                }
+                else
+                {
+                    read_file(&conn, path, sizes[i], bulk);
+                }
+            }
+            times[mode] = (bench_now() - start) / 1000.0 / runs;
+            if (mode >= 2 && memcmp(received, payload, sizes[i]) != 0)
+            {
+                fprintf(stderr, "Data mismatch.\n");
+                return 1;
+            }
+        }
+        printf("%8zuKB %13.1f us %13.1f us %13.1f us %13.1f us\n", sizes[i] / 1024, times[0], times[1], times[2],
+               times[3]);
+    }
+    unlink(path);
+    bench_exit(&conn, 0);
+    bench_wait(pid);
+    return 0;
+}
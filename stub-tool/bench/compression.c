@@ -0,0 +1,240 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Payload compression break-even benchmark.
+
+Reads files of different sizes with the READ_FILE command, with and without LZ4
+compression, and reports the time measured on the local socket. Slow links are
+simulated by adding the time needed to move the received bytes over a link of the
+given speed, which is an upper bound, because the real transfer overlaps with the
+compression. Text payload is built from /usr/include headers, binary payload is random.
+
+    gcc -O3 -pthread -o stub-tool/stub-tool stub-tool/main.c
+    gcc -O2 -o stub-tool/bench-compression stub-tool/bench/compression.c
+    stub-tool/bench-compression -n 20 -l 1000,100,10 stub-tool/stub-tool
+
+Options:
+    -n runs     number of transfers for each size (default 20)
+    -l links    comma separated link speeds in Mbit/s (default 1000,100,10)
+*/
+
+#include "bench.h"
+#include "../lz4.h"
+
+#include <dirent.h>
+
+#define MAX_PAYLOAD_SIZE (4 * 1024 * 1024)
+#define MAX_LINKS 8
+
+static const size_t sizes[] = {64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, MAX_PAYLOAD_SIZE};
+
+static void fill_text(uint8_t *data, size_t size)
+{
+    size_t pos = 0;
+    DIR *dir = opendir("/usr/include");
+    struct dirent *entry;
+    char path[512];
+    while (dir != NULL && pos < size && (entry = readdir(dir)) != NULL)
+    {
+        int fd;
+        ssize_t n;
+        if (strstr(entry->d_name, ".h") == NULL)
+            continue;
+        snprintf(path, sizeof(path), "/usr/include/%s", entry->d_name);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        while (fd >= 0 && pos < size && (n = read(fd, &data[pos], size - pos)) > 0)
+        {
+            pos += n;
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+    if (dir != NULL)
+        closedir(dir);
+    // Repeat what was found if headers are not available or too small.
+    if (pos == 0)
+    {
+        const char *line = "static inline int function_name(struct some_type *ptr, size_t size);\n";
+        pos = strlen(line);
+        memcpy(data, line, pos);
+    }
+    for (; pos < size; pos++)
+    {
+        data[pos] = data[pos % (pos / 2 + 1)];
+    }
+}
+
+static void fill_random(uint8_t *data, size_t size)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    size_t i;
+    for (i = 0; i < size; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        data[i] = (uint8_t)state;
+    }
+}
+
+static void write_payload(const char *path, const uint8_t *data, size_t size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || write(fd, data, size) != (ssize_t)size)
+        bench_fail("write payload");
+    close(fd);
+}
+
+// Reads the file and returns number of bytes received.
+static size_t read_file(bench_conn *conn, const char *path, size_t size, bool compressed)
+{
+    static uint8_t block[LZ4_MAX_BLOCK_SIZE];
+    static uint8_t output[LZ4_MAX_BLOCK_SIZE];
+    size_t wire = 0;
+    size_t left;
+    bench_send_int(conn, 9);
+    bench_send_int(conn, strlen(path));
+    bench_send(conn, path, strlen(path));
+    if (bench_recv_int(conn) != 0)
+        bench_fail("READ_FILE");
+    left = bench_recv_int(conn);
+    left |= (uint64_t)bench_recv_int(conn) << 32;
+    if (left != size)
+        bench_fail("READ_FILE size");
+    while (left > 0)
+    {
+        size_t raw = MIN(left, sizeof(block));
+        size_t stored = raw;
+        if (compressed)
+        {
+            raw = bench_recv_int(conn);
+            stored = bench_recv_int(conn);
+            wire += 8;
+        }
+        bench_recv(conn, block, stored);
+        if (stored != raw && lz4_decompress(block, stored, output, raw) != (ptrdiff_t)raw)
+            bench_fail("lz4_decompress");
+        wire += stored;
+        left -= raw;
+    }
+    if (bench_recv_int(conn) != 0)
+        bench_fail("READ_FILE status");
+    return wire;
+}
+
+static void run_type(const char *stub, const char *type, const uint8_t *data, int runs, const double *links,
+                     int links_count)
+{
+    const char *path = "/tmp/" CONNECTION_PREFIX "/bench-compression.bin";
+    double time[2][sizeof(sizes) / sizeof(sizes[0])];
+    size_t wire[2][sizeof(sizes) / sizeof(sizes[0])];
+    int mode;
+    int s;
+    int i;
+    int link;
+    int listen_sock = bench_listen("bench");
+
+    for (mode = 0; mode < 2; mode++)
+    {
+        bench_conn conn;
+        pid_t pid = bench_spawn(stub, "bench", NULL, -1);
+        bench_accept(&conn, listen_sock);
+        if (bench_handshake(&conn) < 9)
+        {
+            fprintf(stderr, "Stub-tool does not support compression.\n");
+            exit(1);
+        }
+        bench_send_int(&conn, 13);
+        bench_send_int(&conn, mode);
+        bench_send_int(&conn, 0);
+        if (bench_recv_int(&conn) != (uint32_t)mode)
+            bench_fail("COMPRESSION");
+        for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+        {
+            uint64_t start;
+            write_payload(path, data, sizes[s]);
+            read_file(&conn, path, sizes[s], mode);
+            start = bench_now();
+            for (i = 0; i < runs; i++)
+            {
+                wire[mode][s] = read_file(&conn, path, sizes[s], mode);
+            }
+            time[mode][s] = (double)(bench_now() - start) / 1e3 / runs;
+        }
+        bench_exit(&conn, 0);
+        bench_wait(pid);
+    }
+    bench_unlisten(listen_sock, "bench");
+    unlink(path);
+
+    printf("%s payload\n%9s %7s %10s %10s", type, "size", "ratio", "local raw", "local lz4");
+    for (link = 0; link < links_count; link++)
+    {
+        printf("  %5.0f Mbit/s raw/lz4", links[link]);
+    }
+    printf("\n");
+    for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        printf("%9zu %7.2f %8.1fus %8.1fus", sizes[s], (double)wire[0][s] / wire[1][s], time[0][s], time[1][s]);
+        for (link = 0; link < links_count; link++)
+        {
+            double us_per_byte = 8.0 / links[link];
+            printf("  %9.1fus %9.1fus", time[0][s] + wire[0][s] * us_per_byte,
+                   time[1][s] + wire[1][s] * us_per_byte);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int runs = 20;
+    double links[MAX_LINKS] = {1000, 100, 10};
+    int links_count = 3;
+    uint8_t *text = malloc(MAX_PAYLOAD_SIZE);
+    uint8_t *binary = malloc(MAX_PAYLOAD_SIZE);
+
+    while ((opt = getopt(argc, argv, "n:l:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'l':
+        {
+            char *save = NULL;
+            char *item;
+            links_count = 0;
+            for (item = strtok_r(optarg, ",", &save); item != NULL && links_count < MAX_LINKS;
+                 item = strtok_r(NULL, ",", &save))
+            {
+                links[links_count++] = atof(item);
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "Usage: %s [-n runs] [-l mbit,...] stub...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    fill_text(text, MAX_PAYLOAD_SIZE);
+    fill_random(binary, MAX_PAYLOAD_SIZE);
+    signal(SIGPIPE, SIG_IGN);
+    for (; optind < argc; optind++)
+    {
+        printf("%s\n", argv[optind]);
+        run_type(argv[optind], "text", text, runs, links, links_count);
+        run_type(argv[optind], "binary", binary, runs, links, links_count);
+    }
+    return 0;
+}
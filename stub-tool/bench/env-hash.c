@@ -0,0 +1,126 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Environment hash microbenchmark.
+
+Measures the cost of calc_env_hash() parts (sorting and hashing of the environment)
+for MD5 and fingerprint.h at different environment sizes. The "hash" column is
+the speedup of the hash alone, "total" includes sorting:
+
+    gcc -O3 -o stub-tool/bench-env-hash stub-tool/bench/env-hash.c
+    stub-tool/bench-env-hash
+*/
+
+#include "bench.h"
+
+#include "../md5.h"
+#include "../fingerprint.h"
+
+#define ENTRY_SIZE 64
+
+static char **env;
+static char **sorted_env;
+static int env_count;
+
+static int env_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void make_env(size_t total_size)
+{
+    int i;
+    env_count = (total_size + ENTRY_SIZE - 1) / ENTRY_SIZE;
+    env = malloc(env_count * sizeof(char *));
+    sorted_env = malloc(env_count * sizeof(char *));
+    for (i = 0; i < env_count; i++)
+    {
+        env[i] = malloc(ENTRY_SIZE);
+        snprintf(env[i], ENTRY_SIZE, "VAR_%08X=%0*d", (unsigned)(i * 2654435761u), ENTRY_SIZE - 15, i);
+    }
+}
+
+static void free_env()
+{
+    int i;
+    for (i = 0; i < env_count; i++)
+    {
+        free(env[i]);
+    }
+    free(env);
+    free(sorted_env);
+}
+
+static void hash_md5(uint8_t *digest)
+{
+    int i;
+    md5_ctx ctx;
+    md5_init(&ctx);
+    for (i = 0; i < env_count; i++)
+    {
+        md5_update(&ctx, (uint8_t *)sorted_env[i], strlen(sorted_env[i]) + 1);
+    }
+    md5_digest(&ctx, digest);
+}
+
+static void hash_fingerprint(uint8_t *digest)
+{
+    int i;
+    fp_ctx ctx;
+    fp_init(&ctx);
+    for (i = 0; i < env_count; i++)
+    {
+        fp_update(&ctx, (uint8_t *)sorted_env[i], strlen(sorted_env[i]) + 1);
+    }
+    fp_digest(&ctx, digest);
+}
+
+static void sort_env()
+{
+    memcpy(sorted_env, env, env_count * sizeof(char *));
+    qsort(sorted_env, env_count, sizeof(char *), env_compare);
+}
+
+static double measure(void (*func)(uint8_t *), int runs)
+{
+    uint8_t digest[16];
+    uint64_t start = bench_now();
+    int i;
+    for (i = 0; i < runs; i++)
+    {
+        func(digest);
+    }
+    return (double)(bench_now() - start) / runs;
+}
+
+static void sort_only(uint8_t *digest)
+{
+    sort_env();
+}
+
+int main()
+{
+    static const size_t sizes[] = {1024, 4096, 16384, 65536, 262144, 1048576};
+    size_t i;
+    printf("%10s %8s %10s %10s %10s %8s %8s\n", "env bytes", "entries", "sort ns", "md5 ns", "fp ns", "hash", "total");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        int runs = (int)(64 * 1024 * 1024 / sizes[i]);
+        double sort_time, md5_time, fp_time;
+        make_env(sizes[i]);
+        sort_time = measure(sort_only, runs);
+        md5_time = measure(hash_md5, runs);
+        fp_time = measure(hash_fingerprint, runs);
+        printf("%10zu %8d %10.0f %10.0f %10.0f %7.2fx %7.2fx\n", sizes[i], env_count, sort_time, md5_time, fp_time,
+               md5_time / fp_time, (sort_time + md5_time) / (sort_time + fp_time));
+        free_env();
+    }
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Multi-buffer MD5 benchmark.
+
+Hashes sets of independent messages with the scalar md5_update() one message at a time and
+with md5_multi() limited to 4, 8 and 16 lanes (kernels not supported by the CPU are skipped),
+and reports throughput and speedup over the scalar code. Digests of all kernels are compared
+with the scalar ones first, including all sizes around the padding boundaries. Sets:
+
+    env       4096 environment variables of 64 bytes
+    headers   256 files of 16 KiB
+    mixed     512 messages of random size up to 64 KiB
+    single    one 16 MiB message, the multi-buffer code falls back to the scalar one
+
+    gcc -O3 -o stub-tool/bench-md5 stub-tool/bench/md5.c
+    stub-tool/bench-md5
+*/
+
+#include "bench.h"
+
+#include "../md5.h"
+
+#define MAX_MESSAGES 4096
+
+typedef struct
+{
+    const char *name;
+    int count;
+    size_t size;   // size of each message, 0 for random sizes
+    size_t random; // maximum random size
+} message_set;
+
+static const message_set sets[] = {
+    {"env", 4096, 64, 0},
+    {"headers", 256, 16384, 0},
+    {"mixed", 512, 0, 65536},
+    {"single", 1, 16 * 1024 * 1024, 0},
+};
+
+static const uint8_t *data[MAX_MESSAGES];
+static size_t sizes[MAX_MESSAGES];
+static uint8_t digests[16 * MAX_MESSAGES];
+static uint8_t expected[16 * MAX_MESSAGES];
+
+static void hash_scalar(int count, uint8_t *output)
+{
+    md5_ctx ctx;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        md5_init(&ctx);
+        md5_update(&ctx, data[i], sizes[i]);
+        md5_digest(&ctx, &output[16 * i]);
+    }
+}
+
+static void verify(uint8_t *pool, int lanes)
+{
+    int count = 0;
+    size_t size;
+    int i;
+    // Every size up to 4 blocks covers all padding cases, 1 or 2 tail blocks.
+    for (size = 0; size <= 256; size++)
+    {
+        data[count] = pool + size;
+        sizes[count] = size;
+        count++;
+    }
+    for (i = 0; i < 200; i++)
+    {
+        data[count] = pool + (rand() & 63);
+        sizes[count] = rand() % 100000;
+        count++;
+    }
+    hash_scalar(count, expected);
+    for (i = 1; i <= count; i += i < 20 ? 1 : 37)
+    {
+        md5_multi(data, sizes, i, digests);
+        if (memcmp(digests, expected, 16 * i) != 0)
+        {
+            fprintf(stderr, "Digest mismatch with %d lanes and %d messages.\n", lanes, i);
+            exit(1);
+        }
+    }
+}
+
+static size_t make_set(uint8_t *pool, const message_set *set)
+{
+    size_t total = 0;
+    size_t offset = 0;
+    int i;
+    for (i = 0; i < set->count; i++)
+    {
+        sizes[i] = set->size != 0 ? set->size : (size_t)rand() % set->random;
+        data[i] = pool + offset;
+        offset += sizes[i];
+        total += sizes[i];
+    }
+    return total;
+}
+
+static double measure(int lanes, int count, size_t total)
+{
+    uint64_t start = bench_now();
+    uint64_t time;
+    int runs = 0;
+    do
+    {
+        if (lanes == 1)
+        {
+            hash_scalar(count, digests);
+        }
+        else
+        {
+            md5_multi(data, sizes, count, digests);
+        }
+        runs++;
+        time = bench_now() - start;
+    } while (time < 200000000);
+    return (double)total * runs / time * 1000000000.0 / (1024 * 1024);
+}
+
+int main()
+{
+    static const int lanes_list[] = {4, 8, 16};
+    size_t pool_size = 64 * 1024 * 1024;
+    uint8_t *pool = malloc(pool_size);
+    size_t i, j;
+
+    for (i = 0; i < pool_size; i++)
+    {
+        pool[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+    for (j = 0; j < sizeof(lanes_list) / sizeof(lanes_list[0]); j++)
+    {
+        if (md5_multi_init(lanes_list[j]) == lanes_list[j])
+        {
+            verify(pool, lanes_list[j]);
+        }
+    }
+
+    printf("%-8s %8s %10s %12s %8s\n", "set", "messages", "lanes", "MiB/s", "speedup");
+    for (i = 0; i < sizeof(sets) / sizeof(sets[0]); i++)
+    {
+        size_t total = make_set(pool, &sets[i]);
+        double scalar = measure(1, sets[i].count, total);
+        printf("%-8s %8d %10s %12.1f %7.2fx\n", sets[i].name, sets[i].count, "scalar", scalar, 1.0);
+        for (j = 0; j < sizeof(lanes_list) / sizeof(lanes_list[0]); j++)
+        {
+            double speed;
+            if (md5_multi_init(lanes_list[j]) != lanes_list[j])
+            {
+                continue;
+            }
+            speed = measure(lanes_list[j], sets[i].count, total);
+            printf("%-8s %8d %10d %12.1f %7.2fx\n", sets[i].name, sets[i].count, lanes_list[j], speed, speed / scalar);
+        }
+    }
+    free(pool);
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Output relay throughput benchmark.
+
+Sends a large STDOUT command to each given stub-tool binary and measures how fast
+it reaches the stub's standard output. To compare the splice and copy paths, build
+the stub twice:
+
+    gcc -O3 -o stub-tool/stub-tool stub-tool/main.c
+    gcc -O3 -DNO_SPLICE -o stub-tool/stub-tool-copy stub-tool/main.c
+    gcc -O2 -pthread -o stub-tool/bench-relay stub-tool/bench/relay.c
+    stub-tool/bench-relay -s 64 -n 5 -o pipe stub-tool/stub-tool stub-tool/stub-tool-copy
+
+Options:
+    -s size     megabytes sent in each run (default 16)
+    -n runs     number of runs per binary (default 5)
+    -o output   where the stub's stdout goes: pipe, null or file (default pipe)
+*/
+
+#include "bench.h"
+
+#include <pthread.h>
+
+#define SEND_CHUNK (1024 * 1024)
+
+static void *drain_pipe(void *arg)
+{
+    static uint8_t temp[65536];
+    int fd = (int)(intptr_t)arg;
+    while (read(fd, temp, sizeof(temp)) > 0)
+    {
+    }
+    return NULL;
+}
+
+static int open_output(const char *output, pthread_t *thread)
+{
+    int fd;
+    int fds[2];
+    if (strcmp(output, "null") == 0)
+    {
+        fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    }
+    else if (strcmp(output, "file") == 0)
+    {
+        fd = open("/tmp/" CONNECTION_PREFIX "/bench-relay.out", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    else
+    {
+        if (pipe2(fds, O_CLOEXEC) < 0)
+            bench_fail("pipe");
+        if (pthread_create(thread, NULL, drain_pipe, (void *)(intptr_t)fds[0]) != 0)
+            bench_fail("pthread_create");
+        fd = fds[1];
+    }
+    if (fd < 0)
+        bench_fail("open");
+    return fd;
+}
+
+static double run_once(int listen_sock, const char *stub, size_t size, const char *output, const uint8_t *data)
+{
+    bench_conn conn;
+    pthread_t thread = 0;
+    uint64_t start;
+    size_t left = size;
+    int out = open_output(output, &thread);
+    pid_t pid = bench_spawn(stub, "bench", NULL, out);
+
+    bench_accept(&conn, listen_sock);
+    bench_handshake(&conn);
+
+    start = bench_now();
+    bench_send_int(&conn, 1);
+    bench_send_int(&conn, size);
+    while (left > 0)
+    {
+        size_t n = MIN(left, SEND_CHUNK);
+        bench_send(&conn, data, n);
+        left -= n;
+    }
+    bench_exit(&conn, 0);
+    bench_wait(pid);
+    close(out);
+    if (thread)
+    {
+        pthread_join(thread, NULL);
+    }
+    return (double)(bench_now() - start) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int i;
+    int runs = 5;
+    size_t size = 16 * 1024 * 1024;
+    const char *output = "pipe";
+    uint8_t *data;
+    int listen_sock;
+
+    while ((opt = getopt(argc, argv, "s:n:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            size = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s size_mb] [-n runs] [-o pipe|null|file] stub...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    data = malloc(SEND_CHUNK);
+    for (i = 0; i < SEND_CHUNK; i++)
+    {
+        data[i] = "0123456789abcdef\n"[i % 17];
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    listen_sock = bench_listen("bench");
+    for (; optind < argc; optind++)
+    {
+        double best = 1e30;
+        double total = 0;
+        for (i = 0; i < runs; i++)
+        {
+            double t = run_once(listen_sock, argv[optind], size, output, data);
+            total += t;
+            best = MIN(best, t);
+        }
+        printf("%-40s %s %6zu MB  avg %8.1f MB/s  best %8.1f MB/s\n", argv[optind], output, size >> 20,
+               (double)size * runs / total / 1048576.0, (double)size / best / 1048576.0);
+    }
+    bench_unlisten(listen_sock, "bench");
+    return 0;
+}
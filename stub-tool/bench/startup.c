@@ -0,0 +1,166 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Startup latency benchmark.
+
+Measures the time from fork to the exit of each given stub-tool binary, with the
+controller reached in different ways:
+
+    path      controller listens only on the /tmp path (abstract connect fails first)
+    abstract  controller listens on the Linux abstract socket name
+    fd        connected socket is inherited through REMOTE_JOBS_FD
+
+    gcc -O3 -pthread -o stub-tool/stub-tool stub-tool/main.c
+    gcc -O2 -o stub-tool/bench-startup stub-tool/bench/startup.c
+    stub-tool/bench-startup -n 2000 stub-tool/stub-tool
+
+Options:
+    -n runs     number of runs per mode and binary (default 1000)
+    -m modes    comma separated list of modes (default path,abstract,fd)
+*/
+
+#include "bench.h"
+
+#define INHERITED_FD 3
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static pid_t spawn_with_fd(const char *stub, int fd)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+        bench_fail("fork");
+    if (pid == 0)
+    {
+        char value[16];
+        dup2(fd, INHERITED_FD);
+        snprintf(value, sizeof(value), "%d", INHERITED_FD);
+        setenv("REMOTE_JOBS_FD", value, 1);
+        execl(stub, stub, "-c", "input.c", "-o", "output.o", NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+static uint64_t run_once(const char *stub, const char *mode, int listen_sock)
+{
+    bench_conn conn;
+    pid_t pid;
+    uint64_t start = bench_now();
+    if (strcmp(mode, "fd") == 0)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+            bench_fail("socketpair");
+        pid = spawn_with_fd(stub, fds[1]);
+        close(fds[1]);
+        conn.sock = fds[0];
+        conn.begin = 0;
+        conn.end = 0;
+    }
+    else
+    {
+        pid = bench_spawn(stub, "bench", NULL, -1);
+        bench_accept(&conn, listen_sock);
+    }
+    bench_handshake(&conn);
+    bench_exit(&conn, 0);
+    if (bench_wait(pid) != 0)
+    {
+        fprintf(stderr, "Stub-tool failed in %s mode.\n", mode);
+        exit(1);
+    }
+    return bench_now() - start;
+}
+
+static void run_mode(const char *stub, const char *mode, int runs)
+{
+    uint64_t *times = malloc(runs * sizeof(uint64_t));
+    uint64_t total = 0;
+    int listen_sock = -1;
+    int i;
+
+    if (strcmp(mode, "path") == 0)
+    {
+        listen_sock = bench_listen("bench");
+    }
+    else if (strcmp(mode, "abstract") == 0)
+    {
+        listen_sock = bench_listen_abstract("bench");
+    }
+    else if (strcmp(mode, "fd") != 0)
+    {
+        fprintf(stderr, "Unknown mode %s\n", mode);
+        exit(1);
+    }
+
+    for (i = 0; i < runs; i++)
+    {
+        times[i] = run_once(stub, mode, listen_sock);
+        total += times[i];
+    }
+    qsort(times, runs, sizeof(uint64_t), compare_u64);
+    printf("%-40s %-8s  avg %7.1f us  p50 %7.1f us  p99 %7.1f us\n", stub, mode,
+           total / 1000.0 / runs, times[runs / 2] / 1000.0, times[runs * 99 / 100] / 1000.0);
+
+    if (strcmp(mode, "path") == 0)
+    {
+        bench_unlisten(listen_sock, "bench");
+    }
+    else if (listen_sock >= 0)
+    {
+        close(listen_sock);
+    }
+    free(times);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int runs = 1000;
+    char *modes = strdup("path,abstract,fd");
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'm':
+            free(modes);
+            modes = strdup(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n runs] [-m path,abstract,fd] stub...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for (; optind < argc; optind++)
+    {
+        char *list = strdup(modes);
+        char *save = NULL;
+        char *mode;
+        for (mode = strtok_r(list, ",", &save); mode != NULL; mode = strtok_r(NULL, ",", &save))
+        {
+            run_mode(argv[optind], mode, runs);
+        }
+        free(list);
+    }
+    free(modes);
+    return 0;
+}
@@ -0,0 +1,323 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Stub-tool benchmark suite.
+
+Runs the stub-tool against a native stand-in controller and measures:
+
+    latency   end-to-end invocation time (spawn to exit) with a warm environment hash
+              (controller knows the environment) and a cold one (ENV command is used),
+              for each environment size and number of concurrent stubs
+    relay     STDOUT relay throughput to /dev/null
+
+Results are written as JSON, a human readable summary goes to stderr. Build and run:
+
+    npm run bench-stub-tool
+
+or manually:
+
+    gcc -O3 -pthread -o stub-tool/stub-tool stub-tool/main.c
+    gcc -O2 -pthread -o stub-tool/bench-suite stub-tool/bench/suite.c
+    stub-tool/bench-suite -o stub-tool/bench-results.json stub-tool/stub-tool
+
+Options:
+    -n runs         invocations per data point, at least the concurrency (default 200)
+    -e sizes        comma separated environment sizes in bytes (default 1024,16384,262144,1048576)
+    -c counts       comma separated numbers of concurrent stubs (default 1,4,16,64,256)
+    -r megabytes    data relayed by each relay invocation, 0 to skip (default 64)
+    -o file         JSON output file (default stdout)
+*/
+
+#include "bench.h"
+
+#include <pthread.h>
+
+#define MAX_LIST 16
+#define ENV_VAR_SIZE 128
+#define RELAY_CHUNK (1024 * 1024)
+
+typedef struct
+{
+    const char *stub;
+    size_t env_size;
+    bool cold;
+    size_t relay_size;
+    int runs;
+    int next;
+    uint64_t *times;
+} scenario;
+
+typedef struct
+{
+    scenario *sc;
+    int index;
+} worker_arg;
+
+static uint8_t relay_data[RELAY_CHUNK];
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int parse_list(char *text, size_t *list)
+{
+    char *save = NULL;
+    char *item;
+    int count = 0;
+    for (item = strtok_r(text, ",", &save); item != NULL && count < MAX_LIST; item = strtok_r(NULL, ",", &save))
+    {
+        list[count++] = strtoull(item, NULL, 10);
+    }
+    return count;
+}
+
+// Builds an environment of approximately env_size bytes from ENV_VAR_SIZE byte variables.
+static char **make_env(size_t env_size, const char *id)
+{
+    size_t count = env_size / ENV_VAR_SIZE + 1;
+    char **envp = malloc((count + 2) * sizeof(char *));
+    size_t i;
+    if (envp == NULL)
+        bench_fail("malloc");
+    for (i = 0; i < count; i++)
+    {
+        size_t size = i + 1 < count ? ENV_VAR_SIZE : env_size % ENV_VAR_SIZE + 16;
+        envp[i] = malloc(size);
+        if (envp[i] == NULL)
+            bench_fail("malloc");
+        snprintf(envp[i], size, "BENCH_VAR_%06zu=", i);
+        memset(envp[i] + strlen(envp[i]), 'a' + i % 26, size - strlen(envp[i]) - 1);
+        envp[i][size - 1] = 0;
+    }
+    envp[count] = malloc(64);
+    snprintf(envp[count], 64, "REMOTE_JOBS_CONNECTION_ID=%s", id);
+    envp[count + 1] = NULL;
+    return envp;
+}
+
+static void free_env(char **envp)
+{
+    char **ptr;
+    for (ptr = envp; *ptr != NULL; ptr++)
+    {
+        free(*ptr);
+    }
+    free(envp);
+}
+
+static void invoke(scenario *sc, int listen_sock, char **envp, int out)
+{
+    static __thread bench_conn conn;
+    uint32_t i;
+    pid_t pid = bench_spawn_env(sc->stub, envp, out);
+    bench_accept(&conn, listen_sock);
+    bench_handshake(&conn);
+    if (sc->cold)
+    {
+        uint32_t count;
+        bench_send_int(&conn, 3);
+        count = bench_recv_int(&conn);
+        for (i = 0; i < count; i++)
+        {
+            bench_skip(&conn, bench_recv_int(&conn));
+        }
+    }
+    if (sc->relay_size > 0)
+    {
+        size_t left = sc->relay_size;
+        bench_send_int(&conn, 1);
+        bench_send_int(&conn, sc->relay_size);
+        while (left > 0)
+        {
+            size_t n = MIN(left, RELAY_CHUNK);
+            bench_send(&conn, relay_data, n);
+            left -= n;
+        }
+    }
+    bench_exit(&conn, 0);
+    if (bench_wait(pid) != 0)
+    {
+        fprintf(stderr, "Stub-tool failed.\n");
+        exit(1);
+    }
+}
+
+static void *worker(void *arg)
+{
+    worker_arg *wa = arg;
+    scenario *sc = wa->sc;
+    char id[32];
+    int listen_sock;
+    int out = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    char **envp;
+    int i;
+
+    // Each worker has its own connection id, so it accepts only its own stubs.
+    snprintf(id, sizeof(id), "suite%d", wa->index);
+    listen_sock = bench_listen_abstract(id);
+    envp = make_env(sc->env_size, id);
+    while ((i = __atomic_fetch_add(&sc->next, 1, __ATOMIC_RELAXED)) < sc->runs)
+    {
+        uint64_t start = bench_now();
+        invoke(sc, listen_sock, envp, out);
+        sc->times[i] = bench_now() - start;
+    }
+    free_env(envp);
+    close(listen_sock);
+    close(out);
+    return NULL;
+}
+
+static void run_scenario(FILE *json, bool *first, scenario *sc, int concurrency)
+{
+    pthread_t threads[concurrency];
+    worker_arg args[concurrency];
+    uint64_t start;
+    double elapsed;
+    double total = 0;
+    double p50;
+    double p99;
+    int i;
+
+    sc->next = 0;
+    sc->times = malloc(sc->runs * sizeof(uint64_t));
+    start = bench_now();
+    for (i = 0; i < concurrency; i++)
+    {
+        args[i].sc = sc;
+        args[i].index = i;
+        if (pthread_create(&threads[i], NULL, worker, &args[i]) != 0)
+            bench_fail("pthread_create");
+    }
+    for (i = 0; i < concurrency; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = (double)(bench_now() - start) / 1e9;
+
+    qsort(sc->times, sc->runs, sizeof(uint64_t), compare_u64);
+    for (i = 0; i < sc->runs; i++)
+    {
+        total += sc->times[i];
+    }
+    p50 = sc->times[sc->runs / 2] / 1e3;
+    p99 = sc->times[(sc->runs * 99) / 100] / 1e3;
+
+    fprintf(json, "%s\n    {\"scenario\": \"%s\", \"env_bytes\": %zu, \"env_hash\": \"%s\", "
+                  "\"concurrency\": %d, \"runs\": %d, \"avg_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+                  "\"invocations_per_s\": %.1f",
+            *first ? "" : ",", sc->relay_size > 0 ? "relay" : "latency", sc->env_size, sc->cold ? "cold" : "warm",
+            concurrency, sc->runs, total / 1e3 / sc->runs, p50, p99, sc->runs / elapsed);
+    if (sc->relay_size > 0)
+    {
+        fprintf(json, ", \"relay_bytes\": %zu, \"mb_per_s\": %.1f", sc->relay_size,
+                (double)sc->relay_size * sc->runs / elapsed / 1048576.0);
+        fprintf(stderr, "relay    %8zu MB  c=%-3d  p50 %9.1f us  p99 %9.1f us  %8.1f MB/s\n", sc->relay_size >> 20,
+                concurrency, p50, p99, (double)sc->relay_size * sc->runs / elapsed / 1048576.0);
+    }
+    else
+    {
+        fprintf(stderr, "latency  env %8zu B  %s  c=%-3d  p50 %9.1f us  p99 %9.1f us  %8.1f inv/s\n", sc->env_size,
+                sc->cold ? "cold" : "warm", concurrency, p50, p99, sc->runs / elapsed);
+    }
+    fprintf(json, "}");
+    *first = false;
+    free(sc->times);
+}
+
+int main(int argc, char *argv[])
+{
+    char default_env_sizes[] = "1024,16384,262144,1048576";
+    char default_concurrency[] = "1,4,16,64,256";
+    size_t env_sizes[MAX_LIST];
+    size_t concurrency[MAX_LIST];
+    int env_count = parse_list(default_env_sizes, env_sizes);
+    int concurrency_count = parse_list(default_concurrency, concurrency);
+    size_t relay_size = 64 * 1024 * 1024;
+    int runs = 200;
+    FILE *json = stdout;
+    bool first = true;
+    scenario sc;
+    int opt;
+    int e, c, cold;
+
+    while ((opt = getopt(argc, argv, "n:e:c:r:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'e':
+            env_count = parse_list(optarg, env_sizes);
+            break;
+        case 'c':
+            concurrency_count = parse_list(optarg, concurrency);
+            break;
+        case 'r':
+            relay_size = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'o':
+            json = fopen(optarg, "w");
+            if (json == NULL)
+                bench_fail(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n runs] [-e sizes] [-c counts] [-r relay_mb] [-o file] stub\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc)
+    {
+        fprintf(stderr, "Usage: %s [-n runs] [-e sizes] [-c counts] [-r relay_mb] [-o file] stub\n", argv[0]);
+        return 1;
+    }
+
+    memset(relay_data, 'x', sizeof(relay_data));
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(json, "{\n  \"stub\": \"%s\",\n  \"cpus\": %ld,\n  \"results\": [", argv[optind],
+            sysconf(_SC_NPROCESSORS_ONLN));
+
+    memset(&sc, 0, sizeof(sc));
+    sc.stub = argv[optind];
+    for (e = 0; e < env_count; e++)
+    {
+        for (cold = 0; cold < 2; cold++)
+        {
+            for (c = 0; c < concurrency_count; c++)
+            {
+                sc.env_size = env_sizes[e];
+                sc.cold = cold;
+                sc.relay_size = 0;
+                sc.runs = MAX(runs, (int)concurrency[c]);
+                run_scenario(json, &first, &sc, concurrency[c]);
+            }
+        }
+    }
+
+    if (relay_size > 0)
+    {
+        sc.env_size = env_sizes[0];
+        sc.cold = false;
+        sc.relay_size = relay_size;
+        sc.runs = 5;
+        run_scenario(json, &first, &sc, 1);
+    }
+
+    fprintf(json, "\n  ]\n}\n");
+    if (json != stdout)
+    {
+        fclose(json);
+    }
+    return 0;
+}
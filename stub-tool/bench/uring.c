@@ -0,0 +1,172 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+io_uring backend benchmark.
+
+Runs a stub-tool built with -DUSE_IO_URING with the io_uring backend and with the plain
+socket backend (REMOTE_JOBS_IO_URING=0) and reports latency from fork to exit and number
+of system calls per invocation (as counted by REMOTE_JOBS_SYSCALL_LOG). Scenarios:
+
+    exit      handshake and EXIT
+    env       handshake, ENV and EXIT
+    messages  handshake and 32 STDOUT commands of 200 bytes each, e.g. compiler warnings
+    bulk      handshake and 16 MiB written by a single STDOUT command
+
+    gcc -O3 -pthread -DUSE_IO_URING -o stub-tool/stub-tool-uring stub-tool/main.c
+    gcc -O2 -o stub-tool/bench-uring stub-tool/bench/uring.c
+    stub-tool/bench-uring stub-tool/stub-tool-uring
+
+Options:
+    -n runs     number of runs per scenario and backend (default 1000, bulk runs 20 times less)
+*/
+
+#include "bench.h"
+
+#define MESSAGES_COUNT 32
+#define MESSAGES_SIZE 200
+#define BULK_SIZE (16 * 1024 * 1024)
+
+static const char *scenarios[] = {"exit", "env", "messages", "bulk"};
+static char log_path[64];
+static uint8_t *bulk_data;
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_scenario(bench_conn *conn, const char *scenario)
+{
+    uint8_t message[MESSAGES_SIZE];
+    uint32_t count;
+    uint32_t i;
+    if (strcmp(scenario, "env") == 0)
+    {
+        bench_send_int(conn, 3);
+        count = bench_recv_int(conn);
+        for (i = 0; i < count; i++)
+        {
+            bench_skip(conn, bench_recv_int(conn));
+        }
+    }
+    else if (strcmp(scenario, "messages") == 0)
+    {
+        memset(message, 'w', sizeof(message));
+        message[sizeof(message) - 1] = '\n';
+        for (i = 0; i < MESSAGES_COUNT; i++)
+        {
+            bench_send_int(conn, 1);
+            bench_send_int(conn, sizeof(message));
+            bench_send(conn, message, sizeof(message));
+        }
+    }
+    else if (strcmp(scenario, "bulk") == 0)
+    {
+        bench_send_int(conn, 1);
+        bench_send_int(conn, BULK_SIZE);
+        bench_send(conn, bulk_data, BULK_SIZE);
+    }
+}
+
+// Returns the number of system calls logged by the last invocation.
+static uint32_t read_syscall_count()
+{
+    char line[256];
+    uint32_t count = 0;
+    FILE *f = fopen(log_path, "r");
+    if (f == NULL)
+        bench_fail(log_path);
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        count = strtoul(line, NULL, 10);
+    }
+    fclose(f);
+    unlink(log_path);
+    return count;
+}
+
+static void run(const char *stub, const char *scenario, bool uring, int runs, int listen_sock, int out)
+{
+    uint64_t *times = malloc(runs * sizeof(uint64_t));
+    uint64_t total = 0;
+    uint64_t syscalls = 0;
+    int i;
+
+    setenv("REMOTE_JOBS_IO_URING", uring ? "1" : "0", 1);
+    for (i = 0; i < runs; i++)
+    {
+        bench_conn conn;
+        uint64_t start = bench_now();
+        pid_t pid = bench_spawn(stub, "bench", NULL, out);
+        bench_accept(&conn, listen_sock);
+        bench_handshake(&conn);
+        run_scenario(&conn, scenario);
+        bench_exit(&conn, 0);
+        if (bench_wait(pid) != 0)
+        {
+            fprintf(stderr, "Stub-tool failed.\n");
+            exit(1);
+        }
+        times[i] = bench_now() - start;
+        total += times[i];
+        syscalls += read_syscall_count();
+    }
+    qsort(times, runs, sizeof(uint64_t), compare_u64);
+    printf("%-9s %-8s  syscalls %6.1f  avg %9.1f us  p50 %9.1f us  p99 %9.1f us\n", scenario,
+           uring ? "io_uring" : "plain", (double)syscalls / runs, total / 1000.0 / runs, times[runs / 2] / 1000.0,
+           times[runs * 99 / 100] / 1000.0);
+    free(times);
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = 1000;
+    int listen_sock;
+    int out;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n runs] stub\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc || runs < 20)
+    {
+        fprintf(stderr, "Usage: %s [-n runs] stub\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    bulk_data = malloc(BULK_SIZE);
+    memset(bulk_data, 'x', BULK_SIZE);
+    snprintf(log_path, sizeof(log_path), "/tmp/bench-uring-%d.log", (int)getpid());
+    setenv("REMOTE_JOBS_SYSCALL_LOG", log_path, 1);
+    out = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    listen_sock = bench_listen_abstract("bench");
+
+    for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+    {
+        int n = strcmp(scenarios[i], "bulk") == 0 ? runs / 20 : runs;
+        run(argv[optind], scenarios[i], false, n, listen_sock, out);
+        run(argv[optind], scenarios[i], true, n, listen_sock, out);
+    }
+    close(listen_sock);
+    return 0;
+}
@@ -0,0 +1,193 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+Batched output benchmark.
+
+Relays a warning flood (many short lines) to the stub's stdout, once with a STDOUT command per
+line and once with WRITE_BATCH commands, and reports time from the first line to the stub exit
+and number of system calls made by the stub (as counted by REMOTE_JOBS_SYSCALL_LOG). The stub's
+stdout is a pipe drained by another thread, like output of a tool run by make.
+
+    gcc -O3 -pthread -o stub-tool/stub-tool stub-tool/main.c
+    gcc -O2 -pthread -o stub-tool/bench-write-batch stub-tool/bench/write-batch.c
+    stub-tool/bench-write-batch stub-tool/stub-tool
+
+Options:
+    -l lines    number of lines in each run (default 10000)
+    -s bytes    length of each line (default 100)
+    -n runs     number of runs per mode (default 20)
+*/
+
+#include "bench.h"
+
+#include <pthread.h>
+
+#define BATCH_MAX_SIZE 65536
+#define BATCH_MAX_SEGMENTS 1024
+
+static char log_path[64];
+static uint64_t drained;
+
+static void *drain_pipe(void *arg)
+{
+    static uint8_t temp[65536];
+    int fd = (int)(intptr_t)arg;
+    ssize_t n;
+    while ((n = read(fd, temp, sizeof(temp))) > 0)
+    {
+        __atomic_fetch_add(&drained, n, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static uint32_t read_syscall_count()
+{
+    char line[256];
+    uint32_t count = 0;
+    FILE *f = fopen(log_path, "r");
+    if (f == NULL)
+        bench_fail(log_path);
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        count = strtoul(line, NULL, 10);
+    }
+    fclose(f);
+    unlink(log_path);
+    return count;
+}
+
+static void send_lines(bench_conn *conn, const uint8_t *line, uint32_t size, int lines)
+{
+    int i;
+    for (i = 0; i < lines; i++)
+    {
+        bench_send_int(conn, 1);
+        bench_send_int(conn, size);
+        bench_send(conn, line, size);
+    }
+}
+
+static void send_batches(bench_conn *conn, const uint8_t *line, uint32_t size, int lines)
+{
+    static uint32_t headers[2 * BATCH_MAX_SEGMENTS];
+    static uint8_t data[BATCH_MAX_SIZE];
+    while (lines > 0)
+    {
+        uint32_t count = 0;
+        while (count < (uint32_t)lines && count < BATCH_MAX_SEGMENTS &&
+               8 * (count + 1) + size * (count + 1) <= BATCH_MAX_SIZE)
+        {
+            headers[2 * count] = 1;
+            headers[2 * count + 1] = size;
+            memcpy(&data[count * size], line, size);
+            count++;
+        }
+        if (count == 0)
+            bench_fail("line too long");
+        bench_send_int(conn, 19);
+        bench_send_int(conn, count);
+        bench_send_int(conn, count * size);
+        bench_send(conn, headers, 8 * count);
+        bench_send(conn, data, count * size);
+        lines -= count;
+    }
+}
+
+static void run(const char *stub, bool batch, int runs, int lines, uint32_t size)
+{
+    uint8_t *line = malloc(size);
+    uint64_t total = 0;
+    uint64_t syscalls = 0;
+    int i;
+
+    memset(line, 'w', size);
+    line[size - 1] = '\n';
+    for (i = 0; i < runs; i++)
+    {
+        bench_conn conn;
+        pthread_t thread;
+        int fds[2];
+        uint64_t start;
+        pid_t pid;
+        int listen_sock = bench_listen_abstract("bench");
+        if (pipe2(fds, O_CLOEXEC) < 0)
+            bench_fail("pipe");
+        drained = 0;
+        if (pthread_create(&thread, NULL, drain_pipe, (void *)(intptr_t)fds[0]) != 0)
+            bench_fail("pthread_create");
+        pid = bench_spawn(stub, "bench", NULL, fds[1]);
+        close(fds[1]);
+        bench_accept(&conn, listen_sock);
+        close(listen_sock);
+        bench_handshake(&conn);
+        start = bench_now();
+        if (batch)
+            send_batches(&conn, line, size, lines);
+        else
+            send_lines(&conn, line, size, lines);
+        bench_exit(&conn, 0);
+        if (bench_wait(pid) != 0)
+        {
+            fprintf(stderr, "Stub-tool failed.\n");
+            exit(1);
+        }
+        total += bench_now() - start;
+        pthread_join(thread, NULL);
+        close(fds[0]);
+        if (drained != (uint64_t)lines * size)
+        {
+            fprintf(stderr, "Output size mismatch.\n");
+            exit(1);
+        }
+        syscalls += read_syscall_count();
+    }
+    printf("%-11s %d lines x %u bytes  syscalls %8.1f  avg %9.1f us\n", batch ? "WRITE_BATCH" : "STDOUT", lines,
+           size, (double)syscalls / runs, total / 1000.0 / runs);
+    free(line);
+}
+
+int main(int argc, char *argv[])
+{
+    int lines = 10000;
+    int size = 100;
+    int runs = 20;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:s:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            lines = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-l lines] [-s bytes] [-n runs] stub\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc || lines < 1 || size < 1 || runs < 1)
+    {
+        fprintf(stderr, "Usage: %s [-l lines] [-s bytes] [-n runs] stub\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(log_path, sizeof(log_path), "/tmp/bench-write-batch-%d.log", (int)getpid());
+    setenv("REMOTE_JOBS_SYSCALL_LOG", log_path, 1);
+    run(argv[optind], false, runs, lines, size);
+    run(argv[optind], true, runs, lines, size);
+    return 0;
+}
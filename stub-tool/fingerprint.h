@@ -0,0 +1,239 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _FINGERPRINT_H_
+#define _FINGERPRINT_H_
+
+/*
+Fast non-cryptographic 128-bit fingerprint.
+
+It follows the structure of XXH3 long hash: eight 64-bit accumulators consume 64-byte
+stripes using 32x32->64 multiplications, every 16 stripes the accumulators are scrambled,
+and the final state is folded into two 64-bit halves. Secret constants are not the XXH3
+ones, so the output is NOT compatible with XXH3. Data is processed in a streaming way,
+so it can be used in the same way as md5.h.
+
+SSE2 code is used when available, otherwise portable C code gives identical results.
+*/
+
+#include <memory.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FP_USE_SSE2 1
+#endif
+
+#define FP_STRIPE_SIZE 64
+#define FP_STRIPES_PER_BLOCK 16
+#define FP_PRIME32_1 0x9E3779B1U
+#define FP_PRIME64_1 0x9E3779B185EBCA87ULL
+#define FP_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+typedef struct
+{
+    uint64_t acc[8];
+    uint64_t count;
+    uint32_t stripe;
+    uint8_t buffer[FP_STRIPE_SIZE];
+} fp_ctx;
+
+static const uint64_t fp_secret[24] = {
+    0x9C651B042238B2D6ULL, 0x325409E68BCF4889ULL, 0x01C4612732FADB06ULL,
+    0x9A845A230D5F869DULL, 0x2F2E5FB7C6A34201ULL, 0x875FF5AC0222F60AULL,
+    0xE1181764F74AC7A6ULL, 0x195C747E8C631E8BULL, 0xAECD2115AD7A4A57ULL,
+    0xED7C98BAB1EE3985ULL, 0x144BB2682AF4A9D2ULL, 0x12A3F36E5A03F1A1ULL,
+    0xCAAAABB983743493ULL, 0x3E6A9BC874B8A4B1ULL, 0x5D2D855BF09BFFCBULL,
+    0x54A0EA81ACE435C3ULL, 0x019ADC20273EA98EULL, 0xB97EB8F85853CA4FULL,
+    0xE0D749108E562523ULL, 0xB571E1AD7C56EC62ULL, 0x5DC22C637D4AD6B9ULL,
+    0xBCB20F17CD09D41AULL, 0x808E5BC676126E1AULL, 0xFC9FD10ABFAEEE15ULL,
+};
+
+static inline uint64_t fp_read64(const uint8_t *ptr)
+{
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+static inline uint64_t fp_mul128_fold64(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t hi_hi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+static inline uint64_t fp_avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+static void fp_accumulate(uint64_t *acc, const uint8_t *ptr, const uint64_t *secret)
+{
+#ifdef FP_USE_SSE2
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        __m128i data = _mm_loadu_si128((const __m128i *)(ptr + 16 * i));
+        __m128i key = _mm_xor_si128(data, _mm_loadu_si128((const __m128i *)(secret + 2 * i)));
+        __m128i product = _mm_mul_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + 2 * i));
+        a = _mm_add_epi64(a, _mm_add_epi64(product, swapped));
+        _mm_storeu_si128((__m128i *)(acc + 2 * i), a);
+    }
+#else
+    int i;
+    for (i = 0; i < 8; i++)
+    {
+        uint64_t data = fp_read64(ptr + 8 * i);
+        uint64_t key = data ^ secret[i];
+        acc[i ^ 1] += data;
+        acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+#endif
+}
+
+static void fp_scramble(uint64_t *acc)
+{
+    const uint64_t *secret = &fp_secret[16];
+#ifdef FP_USE_SSE2
+    int i;
+    __m128i prime = _mm_set1_epi32(FP_PRIME32_1);
+    for (i = 0; i < 4; i++)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + 2 * i));
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(secret + 2 * i)));
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+        a = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+        _mm_storeu_si128((__m128i *)(acc + 2 * i), a);
+    }
+#else
+    int i;
+    for (i = 0; i < 8; i++)
+    {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= secret[i];
+        acc[i] = a * FP_PRIME32_1;
+    }
+#endif
+}
+
+static void fp_process_stripe(fp_ctx *ctx, const uint8_t *ptr)
+{
+    fp_accumulate(ctx->acc, ptr, &fp_secret[ctx->stripe]);
+    ctx->stripe++;
+    if (ctx->stripe == FP_STRIPES_PER_BLOCK)
+    {
+        fp_scramble(ctx->acc);
+        ctx->stripe = 0;
+    }
+}
+
+static void fp_init(fp_ctx *ctx)
+{
+    ctx->acc[0] = FP_PRIME32_1;
+    ctx->acc[1] = FP_PRIME64_1;
+    ctx->acc[2] = FP_PRIME64_2;
+    ctx->acc[3] = 0x165667B19E3779F9ULL;
+    ctx->acc[4] = 0x85EBCA77C2B2AE63ULL;
+    ctx->acc[5] = 0x27D4EB2F165667C5ULL;
+    ctx->acc[6] = 0x85EBCA77U;
+    ctx->acc[7] = 0xC2B2AE3DU;
+    ctx->count = 0;
+    ctx->stripe = 0;
+}
+
+static void fp_update(fp_ctx *ctx, const uint8_t *buffer, size_t buffer_size)
+{
+    size_t used = ctx->count & (FP_STRIPE_SIZE - 1);
+    ctx->count += buffer_size;
+
+    if (used > 0)
+    {
+        size_t copy_bytes = FP_STRIPE_SIZE - used;
+        if (copy_bytes > buffer_size)
+        {
+            memcpy(&ctx->buffer[used], buffer, buffer_size);
+            return;
+        }
+        memcpy(&ctx->buffer[used], buffer, copy_bytes);
+        fp_process_stripe(ctx, ctx->buffer);
+        buffer += copy_bytes;
+        buffer_size -= copy_bytes;
+    }
+
+    while (buffer_size >= FP_STRIPE_SIZE)
+    {
+        fp_process_stripe(ctx, buffer);
+        buffer += FP_STRIPE_SIZE;
+        buffer_size -= FP_STRIPE_SIZE;
+    }
+
+    if (buffer_size > 0)
+    {
+        memcpy(ctx->buffer, buffer, buffer_size);
+    }
+}
+
+static uint64_t fp_merge(const uint64_t *acc, const uint64_t *secret, uint64_t start)
+{
+    uint64_t result = start;
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        result += fp_mul128_fold64(acc[2 * i] ^ secret[2 * i], acc[2 * i + 1] ^ secret[2 * i + 1]);
+    }
+    return fp_avalanche(result);
+}
+
+static void fp_digest(fp_ctx *ctx, uint8_t *digest)
+{
+    uint64_t lo, hi;
+    int i;
+    size_t used = ctx->count & (FP_STRIPE_SIZE - 1);
+
+    // Last partial stripe is zero-padded, total length is mixed in below.
+    if (used > 0)
+    {
+        memset(&ctx->buffer[used], 0, FP_STRIPE_SIZE - used);
+        fp_process_stripe(ctx, ctx->buffer);
+    }
+
+    lo = fp_merge(ctx->acc, &fp_secret[3], ctx->count * FP_PRIME64_1);
+    hi = fp_merge(ctx->acc, &fp_secret[11], ~(ctx->count * FP_PRIME64_2));
+
+    for (i = 0; i < 8; i++)
+    {
+        digest[i] = (uint8_t)(lo >> (8 * i));
+        digest[i + 8] = (uint8_t)(hi >> (8 * i));
+    }
+}
+
+#endif /* _FINGERPRINT_H_ */
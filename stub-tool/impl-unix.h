@@ -11,6 +11,10 @@
 #define _IMPL_UNIX_H_
 #ifndef WIN32
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <malloc.h>
@@ -19,15 +23,66 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <limits.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include "main.h"
 
 #define UNIX_CONNECTION_PREFIX "/tmp/" CONNECTION_PREFIX "/"
 
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_SPAWN_ADDCHDIR 1
+#endif
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE 1
+#endif
+
+#if defined(__linux__) && !defined(NO_SPLICE)
+#define USE_SPLICE 1
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+#endif
+
 extern char **environ;
 
 static int client_sock = -1;
 static char client_path[128];
+static int attached_handles[3];
+static int attached_handles_count = 0;
+static int input_file = -1;
+static pid_t child_pid = -1;
+static int child_pipes[3] = {-1, -1, -1};
+static uint64_t child_start;
+static uint64_t cancel_timeout = 500;
+static int jobserver_fds[2] = {-1, -1};
+static char jobserver_path[PATH_MAX] = "";
+static int bulk_fd = -1;
+static char *bulk_temp_path = NULL;
+
+#ifdef USE_SPLICE
+static int splice_pipe[2] = {-1, -1};
+static size_t splice_pipe_size = 0;
+static bool splice_disabled[3] = {false, false, false};
+static bool splice_file_disabled = false;
+#endif
+
+#include "impl-uring.h"
 
 static void fatal(const char *message)
 {
@@ -41,11 +96,132 @@ static void fatal(const char *message)
     exit(99);
 }
 
-static void connect_to_controller()
+// Adopts a connected socket passed by the parent process in REMOTE_JOBS_FD.
+static bool use_inherited_socket()
+{
+    int type;
+    socklen_t len = sizeof(type);
+    char *end;
+    long fd;
+    const char *value = getenv("REMOTE_JOBS_FD");
+    if (value == NULL || value[0] == 0)
+    {
+        return false;
+    }
+    fd = strtol(value, &end, 10);
+    if (*end != 0 || fd < 0 || fd > 0xFFFF)
+    {
+        return false;
+    }
+    // Variable may be inherited by a process that does not have the descriptor anymore.
+    syscall_count++;
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM)
+    {
+        return false;
+    }
+    syscall_count++;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    unsetenv("REMOTE_JOBS_FD");
+    client_sock = fd;
+    return true;
+}
+
+#ifdef __linux__
+
+// Abstract socket names do not exist in the file system, so the client does not need a bound path.
+// They also have no permissions, any user can bind the name first, so the controller must run
+// as the same user.
+static bool connect_abstract(const char *id)
+{
+    struct sockaddr_un sockaddr;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int rc;
+    sockaddr.sun_family = AF_UNIX;
+    sockaddr.sun_path[0] = 0;
+    rc = snprintf(&sockaddr.sun_path[1], sizeof(sockaddr.sun_path) - 1, "%s/%sS", CONNECTION_PREFIX, id);
+    test(rc > 0 && (size_t)rc < MEMBER_SIZE(struct sockaddr_un, sun_path) - 1, "Connection id too long.");
+    syscall_count++;
+    rc = connect(client_sock, (struct sockaddr *)&sockaddr, offsetof(struct sockaddr_un, sun_path) + 1 + rc);
+    if (rc < 0)
+    {
+        return false;
+    }
+    syscall_count += 2;
+    if (getsockopt(client_sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid())
+    {
+        // Connected socket cannot be reused for the path socket.
+        syscall_count++;
+        close(client_sock);
+        client_sock = -1;
+        return false;
+    }
+    return true;
+}
+
+#endif
+
+static uint64_t get_time_ns()
+{
+    struct timespec ts;
+    // Served by vDSO, so it is not counted as a system call.
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Set while REMOTE_JOBS_CONNECT_TIMEOUT also limits waiting for the first command.
+static bool handshake_timeout = false;
+
+// Sets SO_SNDTIMEO (also applies to connect()) or SO_RCVTIMEO in milliseconds, 0 disables the timeout.
+static void set_socket_timeout(int option, uint32_t timeout)
+{
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    syscall_count++;
+    setsockopt(client_sock, SOL_SOCKET, option, &tv, sizeof(tv));
+}
+
+// Called after the first command was received, the job may take as long as needed.
+static void clear_handshake_timeout()
+{
+    if (handshake_timeout)
+    {
+        handshake_timeout = false;
+        set_socket_timeout(SO_RCVTIMEO, 0);
+    }
+}
+
+static void create_client_socket(uint32_t timeout)
+{
+    syscall_count++;
+#ifdef SOCK_CLOEXEC
+    client_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+#else
+    client_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    fcntl(client_sock, F_SETFD, FD_CLOEXEC);
+#endif
+    test(client_sock >= 0, "Cannot create UNIX socket.");
+    if (timeout > 0)
+    {
+        set_socket_timeout(SO_SNDTIMEO, timeout);
+    }
+}
+
+static bool connect_to_controller()
 {
     int rc;
     struct sockaddr_un sockaddr;
     char server_path[128];
+    const char *timeout_str = getenv("REMOTE_JOBS_CONNECT_TIMEOUT");
+    uint32_t timeout = timeout_str != NULL ? strtoul(timeout_str, NULL, 10) : 0;
+    uint64_t deadline = get_time_ns() + (uint64_t)timeout * 1000000;
+    uint64_t now;
+
+    if (use_inherited_socket())
+    {
+        return true;
+    }
 
     const char *id = getenv("REMOTE_JOBS_CONNECTION_ID");
     if (id == NULL)
@@ -53,43 +229,387 @@ static void connect_to_controller()
         id = "0";
     }
 
-    snprintf(server_path, sizeof(server_path), "%s%sS", UNIX_CONNECTION_PREFIX, id);
-    rc = snprintf(client_path, sizeof(client_path), "%s%sC%d", UNIX_CONNECTION_PREFIX, id, (int)getpid());
-    test(rc > 0 && rc < MEMBER_SIZE(struct sockaddr_un, sun_path), "Connection id too long.");
+    create_client_socket(timeout);
 
-    client_sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    test(client_sock >= 0, "Cannot create UNIX socket.");
+#ifdef __linux__
+    if (connect_abstract(id))
+    {
+        goto connected;
+    }
+    if (client_sock < 0)
+    {
+        create_client_socket(timeout);
+    }
+#endif
+
+    snprintf(server_path, sizeof(server_path), "%s%sS", UNIX_CONNECTION_PREFIX, id);
+    rc = snprintf(client_path, sizeof(client_path), "%s%sC%d", UNIX_CONNECTION_PREFIX, id, (int)ipid);
+    test(rc > 0 && (size_t)rc < MEMBER_SIZE(struct sockaddr_un, sun_path), "Connection id too long.");
 
+    // unlink, bind and connect
+    syscall_count += 3;
     unlink(client_path);
     sockaddr.sun_family = AF_UNIX;
     strcpy(sockaddr.sun_path, client_path);
     rc = bind(client_sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
-    test(rc >= 0, "Cannot bind path to UNIX socket.");
+    if (rc < 0)
+    {
+        // Directory does not exist if no controller was started.
+        client_path[0] = 0;
+        return false;
+    }
 
     sockaddr.sun_family = AF_UNIX;
     strcpy(sockaddr.sun_path, server_path);
     rc = connect(client_sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
-    test(rc >= 0, "Cannot connect to controller.");
+    if (rc < 0)
+    {
+        return false;
+    }
+
+connected:
+    if (timeout > 0)
+    {
+        // Timeout must not apply to later sends. The rest of it limits waiting for the first
+        // command, a controller that accepted the connection may still be too busy to start the job.
+        set_socket_timeout(SO_SNDTIMEO, 0);
+        now = get_time_ns();
+        set_socket_timeout(SO_RCVTIMEO, now + 1000000 < deadline ? (deadline - now) / 1000000 : 1);
+        handshake_timeout = true;
+    }
+    return true;
 }
 
 static void disconnect_from_controller()
 {
+    syscall_count++;
     close(client_sock);
-    unlink(client_path);
     client_sock = -1;
+    if (client_path[0] != 0)
+    {
+        syscall_count++;
+        unlink(client_path);
+        client_path[0] = 0;
+    }
+}
+
+// Takes the token back only if one is available now. It is called from a signal handler, so
+// the descriptor shared with make cannot be made non-blocking, a new one is opened instead.
+static void jobserver_try_acquire()
+{
+    uint8_t token;
+    int fd;
+    if (jobserver_path[0] == 0)
+    {
+        return;
+    }
+    fd = open(jobserver_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        if (read(fd, &token, 1) == 1)
+        {
+            jobserver_released = false;
+        }
+        close(fd);
+    }
+}
+
+static void cancel_handler(int sig)
+{
+    uint8_t data[4096];
+    struct pollfd fd;
+    uint64_t deadline;
+    uint64_t now;
+    // Only async-signal-safe functions are used here, the main thread may be in any state.
+    if (child_pid > 0)
+    {
+        kill(child_pid, sig);
+    }
+    if (client_sock >= 0)
+    {
+        // End of the stream while the stub is still connected tells the controller that the job
+        // was cancelled. It acknowledges by closing the connection.
+        shutdown(client_sock, SHUT_WR);
+        deadline = get_time_ns() + cancel_timeout * 1000000;
+        while ((now = get_time_ns()) < deadline)
+        {
+            int rc;
+            fd.fd = client_sock;
+            fd.events = POLLIN;
+            rc = poll(&fd, 1, (deadline - now + 999999) / 1000000);
+            if (rc == 0 || (rc < 0 && errno != EINTR) || (rc > 0 && recv(client_sock, data, sizeof(data), 0) <= 0))
+            {
+                break;
+            }
+        }
+    }
+    if (client_path[0] != 0)
+    {
+        unlink(client_path);
+    }
+    if (jobserver_released)
+    {
+        // atexit() handlers do not run when the stub is terminated by the signal, but make
+        // still counts the released token as taken by the stub.
+        jobserver_try_acquire();
+    }
+    // Handler was reset to the default one, so the stub is terminated by the same signal.
+    raise(sig);
 }
 
-static size_t send_part(const uint8_t *data, size_t max_size)
+static void install_cancel_handlers()
 {
-    ssize_t n = send(client_sock, data, max_size, 0);
+    static const int signals[] = {SIGINT, SIGTERM, SIGHUP};
+    struct sigaction action;
+    struct sigaction old;
+    const char *value = getenv("REMOTE_JOBS_CANCEL_TIMEOUT");
+    size_t i;
+
+    if (value != NULL && value[0] != 0)
+    {
+        cancel_timeout = strtoul(value, NULL, 10);
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = cancel_handler;
+    // Repeated signal terminates the stub immediately, other ones wait for the handler.
+    action.sa_flags = SA_RESETHAND | SA_NODEFER;
+    for (i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+    {
+        sigemptyset(&action.sa_mask);
+        sigaddset(&action.sa_mask, signals[(i + 1) % 3]);
+        sigaddset(&action.sa_mask, signals[(i + 2) % 3]);
+        syscall_count++;
+        if (sigaction(signals[i], &action, &old) == 0 && old.sa_handler == SIG_IGN)
+        {
+            // Signal was ignored by the parent (e.g. background job), keep it that way.
+            syscall_count++;
+            sigaction(signals[i], &old, NULL);
+        }
+    }
+}
+
+// Opens the jobserver: "fifo:PATH" (GNU make 4.4) or "R,W" descriptors inherited from make.
+static bool jobserver_open(const char *auth)
+{
+    struct stat st;
+    int i;
+    if (strncmp(auth, "fifo:", 5) == 0)
+    {
+        syscall_count++;
+        jobserver_fds[0] = open(auth + 5, O_RDWR | O_CLOEXEC);
+        jobserver_fds[1] = jobserver_fds[0];
+        snprintf(jobserver_path, sizeof(jobserver_path), "%s", auth + 5);
+        return jobserver_fds[0] >= 0;
+    }
+    if (sscanf(auth, "%d,%d", &jobserver_fds[0], &jobserver_fds[1]) != 2)
+    {
+        return false;
+    }
+    // Make closes the descriptors for commands that are not marked as recursive, so they
+    // may be reused by the stub's own files.
+    for (i = 0; i < 2; i++)
+    {
+        syscall_count++;
+        if (jobserver_fds[i] < 0 || fstat(jobserver_fds[i], &st) < 0 || !S_ISFIFO(st.st_mode))
+        {
+            return false;
+        }
+    }
+#ifdef __linux__
+    // Opening the pipe again gives a new file description that can be non-blocking.
+    snprintf(jobserver_path, sizeof(jobserver_path), "/proc/self/fd/%d", jobserver_fds[0]);
+#endif
+    return true;
+}
+
+static bool jobserver_release()
+{
+    ssize_t rc;
+    do
+    {
+        syscall_count++;
+        rc = write(jobserver_fds[1], "+", 1);
+    } while (rc < 0 && errno == EINTR);
+    return rc == 1;
+}
+
+static void jobserver_acquire()
+{
+    uint8_t token;
+    struct pollfd fd;
+    ssize_t rc;
+    while (true)
+    {
+        syscall_count++;
+        rc = read(jobserver_fds[0], &token, 1);
+        if (rc >= 0)
+        {
+            // End of file means that make is gone and there is nothing to give back.
+            return;
+        }
+        else if (errno == EAGAIN)
+        {
+            // Make may have set O_NONBLOCK on the shared pipe.
+            fd.fd = jobserver_fds[0];
+            fd.events = POLLIN;
+            syscall_count++;
+            poll(&fd, 1, -1);
+        }
+        else if (errno != EINTR)
+        {
+            return;
+        }
+    }
+}
+
+// Identifies the stub executable, so it can be skipped when looking for the real tool.
+static bool get_self_stat(struct stat *self)
+{
+#ifdef __linux__
+    syscall_count++;
+    if (stat("/proc/self/exe", self) == 0)
+    {
+        return true;
+    }
+#endif
+    if (strchr(iarg[0], '/') != NULL)
+    {
+        syscall_count++;
+        return stat(iarg[0], self) == 0;
+    }
+    return false;
+}
+
+// Finds an executable named the same as the stub in REMOTE_JOBS_LOCAL_PATH or, if it is not set, in PATH,
+// skipping the stub itself. Result is written to file.
+static bool find_local_tool(char *file, size_t file_size)
+{
+    struct stat self;
+    struct stat st;
+    const char *name = strrchr(iarg[0], '/');
+    const char *path = getenv("REMOTE_JOBS_LOCAL_PATH");
+    const char *end;
+    bool self_known = get_self_stat(&self);
+    // Stub started by a PATH lookup is the first match, when the shell found it the same way.
+    bool skip_first = !self_known && path == NULL;
+    int rc;
+
+    name = name != NULL ? name + 1 : iarg[0];
+    if (path == NULL)
+    {
+        path = getenv("PATH");
+    }
+    if (path == NULL || name[0] == 0)
+    {
+        return false;
+    }
+    do
+    {
+        end = strchr(path, ':');
+        if (end == NULL)
+        {
+            end = path + strlen(path);
+        }
+        // Empty entry means the current directory.
+        if (end == path)
+        {
+            rc = snprintf(file, file_size, "./%s", name);
+        }
+        else
+        {
+            rc = snprintf(file, file_size, "%.*s/%s", (int)(end - path), path, name);
+        }
+        path = end + 1;
+        syscall_count += 2;
+        if (rc <= 0 || (size_t)rc >= file_size || stat(file, &st) < 0 || !S_ISREG(st.st_mode) || access(file, X_OK) < 0)
+        {
+            continue;
+        }
+        if (self_known ? st.st_dev == self.st_dev && st.st_ino == self.st_ino : skip_first)
+        {
+            skip_first = false;
+            continue;
+        }
+        return true;
+    } while (*end != 0);
+    return false;
+}
+
+// Replaces the stub with the real tool. Returns only if the tool cannot be found or started.
+static void run_local_tool()
+{
+    char file[PATH_MAX];
+    if (!find_local_tool(file, sizeof(file)))
+    {
+        return;
+    }
+    if (client_sock >= 0)
+    {
+        disconnect_from_controller();
+    }
+    syscall_count++;
+    execv(file, (char **)iarg);
+}
+
+static size_t send_vec_part(const io_vec *vec, int count)
+{
+    struct msghdr msg;
+    union
+    {
+        struct cmsghdr header;
+        uint8_t data[CMSG_SPACE(sizeof(attached_handles))];
+    } control;
+    ssize_t n;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)vec;
+    msg.msg_iovlen = count;
+    if (attached_handles_count > 0)
+    {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.data;
+        msg.msg_controllen = CMSG_SPACE(attached_handles_count * sizeof(int));
+        control.header.cmsg_level = SOL_SOCKET;
+        control.header.cmsg_type = SCM_RIGHTS;
+        control.header.cmsg_len = CMSG_LEN(attached_handles_count * sizeof(int));
+        memcpy(CMSG_DATA(&control.header), attached_handles, attached_handles_count * sizeof(int));
+    }
+    syscall_count++;
+    n = sendmsg(client_sock, &msg, 0);
+    attached_handles_count = 0;
     test(n >= 0, "Sending to controller error.");
     test(n > 0, "Controller stopped receiving data.");
     return n;
 }
 
+static size_t send_recv_part(const io_vec *vec, int count, uint8_t *data, size_t max_size, size_t *sent)
+{
+#ifdef URING_ENABLED
+    // Descriptors attached to the message are sent with the plain sendmsg(). Receive timeout
+    // does not apply to io_uring.
+    if (attached_handles_count == 0 && !handshake_timeout && uring_enabled())
+    {
+        return uring_send_recv_part(vec, count, data, max_size, sent);
+    }
+#endif
+    (void)vec;
+    (void)count;
+    (void)data;
+    (void)max_size;
+    *sent = 0;
+    return 0;
+}
+
 static size_t recv_part(uint8_t *data, size_t max_size)
 {
-    ssize_t n = recv(client_sock, data, max_size, 0);
+    ssize_t n;
+    syscall_count++;
+    n = recv(client_sock, data, max_size, 0);
+    if (n < 0 && handshake_timeout && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        // Nothing observable happened before the first command, so the tool can run locally.
+        run_local_tool();
+        fatal("Controller did not respond in time and the local tool cannot be started.");
+    }
     test(n >= 0, "Communication with controller failed.");
     test(n > 0, "Controller closed communication unexpectedly.");
     return n;
@@ -102,13 +622,35 @@ static void send_str(const ichar *str)
     send_all(str, len);
 }
 
+static ichar *recv_str()
+{
+    size_t len = recv_int();
+    char *str = malloc(len + 1);
+    test(str != NULL, "Memory allocation failed.");
+    recv_all(str, len);
+    str[len] = 0;
+    return str;
+}
+
+static ichar *str_from_utf8(const char *str)
+{
+    ichar *result = strdup(str);
+    test(result != NULL, "Memory allocation failed.");
+    return result;
+}
+
 static void get_process_info(int argc, char *argv[])
 {
     // Get process arguments
     iarg_count = argc;
     iarg = (const ichar **)argv;
 
+    // Process id
+    syscall_count++;
+    ipid = getpid();
+
     // Current working directory
+    syscall_count++;
     icwd = getcwd(buffer, sizeof(buffer));
     test(icwd != NULL, "Cannot get current working directory.");
 
@@ -125,11 +667,876 @@ static void get_process_info(int argc, char *argv[])
 
 static size_t write_output(int fd, const uint8_t *data, size_t size)
 {
-    int n = write(fd, data, size);
+    int n;
+    syscall_count++;
+    n = write(fd, data, size);
     test(n >= 0, "Write to stdout or stderr failed.");
     test(n > 0, "Cannot write more data to stdout or stderr.");
     return n;
 }
 
+static size_t write_output_vec(int fd, const io_vec *vec, int count)
+{
+    ssize_t n;
+    syscall_count++;
+    n = writev(fd, vec, count);
+    test(n >= 0, "Write to stdout or stderr failed.");
+    test(n > 0, "Cannot write more data to stdout or stderr.");
+    return n;
+}
+
+static uint32_t attach_stdio_handles()
+{
+    int fd;
+    // Descriptors are attached to the first byte sent by the next send_vec_part() call.
+    send_flush();
+    for (fd = 0; fd < 3; fd++)
+    {
+        syscall_count++;
+        if (fcntl(fd, F_GETFD) < 0)
+        {
+            return 0;
+        }
+        attached_handles[fd] = fd;
+    }
+    attached_handles_count = 3;
+    return 3;
+}
+
+static bool wait_for_stdin()
+{
+    struct pollfd fds[2];
+    int rc;
+    fds[0].fd = client_sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = 0;
+    fds[1].events = POLLIN;
+    send_flush();
+    do
+    {
+        syscall_count++;
+        rc = poll(fds, 2, -1);
+    } while (rc < 0 && errno == EINTR);
+    test(rc > 0, "Waiting for input failed.");
+    // Commands from the controller go first, errors are reported when reading.
+    return fds[0].revents == 0;
+}
+
+static size_t read_stdin(uint8_t *data, size_t max_size)
+{
+    ssize_t n;
+    do
+    {
+        syscall_count++;
+        n = read(0, data, max_size);
+    } while (n < 0 && errno == EINTR);
+    return n > 0 ? n : 0;
+}
+
+#ifdef USE_SPLICE
+
+static bool splice_init()
+{
+    ssize_t n;
+    if (splice_pipe[0] >= 0)
+    {
+        return true;
+    }
+    syscall_count++;
+    if (pipe2(splice_pipe, O_CLOEXEC) < 0)
+    {
+        return false;
+    }
+    // Larger pipe moves more data per splice call. Unprivileged processes may get less.
+    syscall_count++;
+    n = fcntl(splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    splice_pipe_size = n > 0 ? (size_t)n : sizeof(buffer);
+    return true;
+}
+
+// Moves data from the controller to the internal pipe. Returns 0 if the socket cannot be spliced.
+static size_t splice_recv(size_t max_size)
+{
+    ssize_t n;
+    syscall_count++;
+    n = splice(client_sock, NULL, splice_pipe[1], NULL, MIN(max_size, splice_pipe_size), SPLICE_F_MOVE);
+    if (n < 0 && errno == EINVAL)
+    {
+        return 0;
+    }
+    test(n >= 0, "Communication with controller failed.");
+    test(n > 0, "Controller closed communication unexpectedly.");
+    return n;
+}
+
+// Moves data from the internal pipe to the fd. If the fd cannot be spliced, *unsupported is set
+// and data is copied instead. Returns 0 or errno of the first failed write, in which case
+// remaining data is discarded.
+static int splice_send(int fd, size_t size, bool *unsupported)
+{
+    int error = 0;
+    while (size > 0)
+    {
+        ssize_t n;
+        if (!*unsupported && error == 0)
+        {
+            syscall_count++;
+            n = splice(splice_pipe[0], NULL, fd, NULL, size, SPLICE_F_MOVE);
+            if (n > 0)
+            {
+                size -= n;
+                continue;
+            }
+            if (n < 0 && errno == EINVAL)
+            {
+                *unsupported = true;
+                continue;
+            }
+            error = n < 0 ? errno : EIO;
+            continue;
+        }
+        syscall_count++;
+        n = read(splice_pipe[0], buffer, MIN(size, sizeof(buffer)));
+        test(n > 0, "Cannot read from internal pipe.");
+        size -= n;
+        if (error == 0)
+        {
+            uint8_t *ptr = buffer;
+            while (n > 0 && error == 0)
+            {
+                ssize_t written;
+                syscall_count++;
+                written = write(fd, ptr, n);
+                if (written <= 0)
+                {
+                    error = written < 0 ? errno : EIO;
+                    break;
+                }
+                ptr += written;
+                n -= written;
+            }
+        }
+    }
+    return error;
+}
+
+#endif
+
+static size_t splice_output(int fd, size_t max_size)
+{
+#ifdef URING_ENABLED
+    // Larger output is moved faster by splice, without copying it through the buffer.
+    if (max_size <= sizeof(buffer) && uring_enabled())
+    {
+        return uring_output(fd, max_size);
+    }
+#endif
+#ifdef USE_SPLICE
+    size_t n;
+    int error;
+    if (splice_disabled[fd])
+    {
+        return 0;
+    }
+    if (!splice_init() || (n = splice_recv(max_size)) == 0)
+    {
+        splice_disabled[1] = true;
+        splice_disabled[2] = true;
+        return 0;
+    }
+    // Output (e.g. a terminal) may not support splicing, then it falls back to copying.
+    error = splice_send(fd, n, &splice_disabled[fd]);
+    test(error == 0, "Write to stdout or stderr failed.");
+    return n;
+#else
+    (void)fd;
+    (void)max_size;
+    return 0;
+#endif
+}
+
+
+static uint32_t open_file(const ichar *path, uint64_t *size)
+{
+    struct stat st;
+    int rc;
+    syscall_count++;
+    input_file = open(path, O_RDONLY | O_CLOEXEC);
+    if (input_file < 0)
+    {
+        return errno;
+    }
+    syscall_count++;
+    rc = fstat(input_file, &st);
+    if (rc < 0 || !S_ISREG(st.st_mode))
+    {
+        int error = rc < 0 ? errno : S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        syscall_count++;
+        close(input_file);
+        input_file = -1;
+        return error;
+    }
+    *size = st.st_size;
+    return 0;
+}
+
+static uint32_t send_file(uint64_t size)
+{
+    int error = 0;
+    // Compressed data has to go through the buffer.
+    bool use_sendfile = compression == COMPRESSION_NONE;
+    send_flush();
+    while (size > 0)
+    {
+        ssize_t n;
+        if (error != 0)
+        {
+            // Data size was already sent, so pad the rest with zeros.
+            n = MIN(size, sizeof(buffer));
+            memset(buffer, 0, n);
+            send_payload(buffer, n);
+            size -= n;
+            continue;
+        }
+#ifdef __linux__
+        if (use_sendfile)
+        {
+            syscall_count++;
+            n = sendfile(client_sock, input_file, NULL, MIN(size, 0x40000000));
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                use_sendfile = false;
+                continue;
+            }
+        }
+        else
+#endif
+        {
+            syscall_count++;
+            n = read(input_file, buffer, MIN(size, sizeof(buffer)));
+            if (n > 0)
+            {
+                send_payload(buffer, n);
+            }
+        }
+        if (n <= 0)
+        {
+            error = n < 0 ? errno : EIO;
+            continue;
+        }
+        size -= n;
+    }
+    (void)use_sendfile;
+    syscall_count++;
+    close(input_file);
+    input_file = -1;
+    return error;
+}
+
+// Creates a temporary file in the same directory as path, so the final rename is atomic.
+static int create_temp_file(const ichar *path, uint32_t mode, uint64_t size, char **temp_path, int *error)
+{
+    int fd;
+    mode_t mask;
+    *temp_path = malloc(strlen(path) + 16);
+    test(*temp_path != NULL, "Memory allocation failed.");
+
+    sprintf(*temp_path, "%s.rjXXXXXX", path);
+    syscall_count++;
+    fd = mkostemp(*temp_path, O_CLOEXEC);
+    if (fd < 0)
+    {
+        *error = errno;
+    }
+    else
+    {
+        syscall_count += 3;
+        mask = umask(0);
+        umask(mask);
+        fchmod(fd, mode & ~mask & 07777);
+#ifdef __linux__
+        if (size > 0)
+        {
+            // Allocation failures are not fatal, e.g. file system may not support it.
+            syscall_count++;
+            fallocate(fd, 0, 0, size);
+        }
+#endif
+    }
+    return fd;
+}
+
+// Closes the temporary file and renames it to path or removes it on error.
+static uint32_t finish_temp_file(int fd, char *temp_path, const ichar *path, int error)
+{
+    if (fd >= 0)
+    {
+        syscall_count++;
+        if (close(fd) < 0 && error == 0)
+        {
+            error = errno;
+        }
+        syscall_count++;
+        if (error == 0 && rename(temp_path, path) < 0)
+        {
+            error = errno;
+        }
+        if (error != 0)
+        {
+            syscall_count++;
+            unlink(temp_path);
+        }
+    }
+    free(temp_path);
+    return error;
+}
+
+static uint32_t recv_file(const ichar *path, uint32_t mode, uint64_t size)
+{
+    int error = 0;
+    char *temp_path;
+    int fd = create_temp_file(path, mode, size, &temp_path, &error);
+
+    while (size > 0)
+    {
+        size_t n = 0;
+#ifdef USE_SPLICE
+        if (error == 0 && !splice_file_disabled && compression == COMPRESSION_NONE && splice_init())
+        {
+            n = splice_recv(size);
+            if (n > 0)
+            {
+                error = splice_send(fd, n, &splice_file_disabled);
+            }
+            else
+            {
+                splice_file_disabled = true;
+            }
+        }
+#endif
+        if (n == 0)
+        {
+            uint8_t *ptr = buffer;
+            ssize_t left = n = recv_payload_part(size);
+            while (left > 0 && error == 0)
+            {
+                ssize_t written;
+                syscall_count++;
+                written = write(fd, ptr, left);
+                if (written <= 0)
+                {
+                    error = written < 0 ? errno : EIO;
+                    break;
+                }
+                ptr += written;
+                left -= written;
+            }
+        }
+        size -= n;
+    }
+
+    return finish_temp_file(fd, temp_path, path, error);
+}
+
+// Closes the descriptor of the previous bulk transfer. The controller has opened it already,
+// because it sent another command.
+static void bulk_close()
+{
+    if (bulk_fd >= 0)
+    {
+        syscall_count++;
+        close(bulk_fd);
+        bulk_fd = -1;
+    }
+}
+
+static void bulk_attach(int fd, uint32_t *handle)
+{
+    bulk_close();
+    bulk_fd = fd;
+    *handle = fd;
+    // Descriptor is attached to the first byte sent by the next send_vec_part() call.
+    send_flush();
+    attached_handles[0] = fd;
+    attached_handles_count = 1;
+}
+
+// Passes the file opened by open_file() to the controller. It stays open until the next bulk transfer.
+static bool bulk_read_file(uint32_t *handle)
+{
+    bulk_attach(input_file, handle);
+    input_file = -1;
+    return true;
+}
+
+// Creates a temporary file for the controller to write, like recv_file() does.
+static uint32_t bulk_create_file(const ichar *path, uint32_t mode, uint64_t size, uint32_t *handle)
+{
+    int error = 0;
+    int fd = create_temp_file(path, mode, size, &bulk_temp_path, &error);
+    if (fd < 0)
+    {
+        error = finish_temp_file(fd, bulk_temp_path, path, error);
+        bulk_temp_path = NULL;
+        return error;
+    }
+    bulk_attach(fd, handle);
+    return 0;
+}
+
+// Renames the file written by the controller to path, or removes it if the controller failed.
+static uint32_t bulk_finish_file(const ichar *path, uint32_t error)
+{
+    uint32_t status = finish_temp_file(bulk_fd, bulk_temp_path, path, error);
+    bulk_fd = -1;
+    bulk_temp_path = NULL;
+    return status;
+}
+
+static uint32_t map_file(const ichar *path, const uint8_t **data, uint64_t *size, uint64_t *mtime)
+{
+    struct stat st;
+    int error = 0;
+    int fd;
+    // This is called from multiple threads.
+    __atomic_fetch_add(&syscall_count, 4, __ATOMIC_RELAXED);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return errno;
+    }
+    if (fstat(fd, &st) < 0)
+    {
+        error = errno;
+    }
+    else if (!S_ISREG(st.st_mode))
+    {
+        error = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    }
+    else
+    {
+        *size = st.st_size;
+        *mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        *data = NULL;
+        if (st.st_size > 0)
+        {
+#ifdef MAP_POPULATE
+            void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+#else
+            void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+#endif
+            if (ptr == MAP_FAILED)
+            {
+                error = errno;
+            }
+            else
+            {
+                *data = ptr;
+            }
+        }
+    }
+    close(fd);
+    return error;
+}
+
+static void unmap_file(const uint8_t *data, uint64_t size)
+{
+    if (data != NULL)
+    {
+        __atomic_fetch_add(&syscall_count, 1, __ATOMIC_RELAXED);
+        munmap((void *)data, size);
+    }
+}
+
+// Maps a file for reading and writing. Changes are visible to other processes mapping it.
+static uint32_t map_file_shared(const ichar *path, uint8_t **data, uint64_t *size)
+{
+    struct stat st;
+    int error = 0;
+    int fd;
+    void *ptr;
+    syscall_count++;
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return errno;
+    }
+    syscall_count += 3;
+    if (fstat(fd, &st) < 0)
+    {
+        error = errno;
+    }
+    else
+    {
+        ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED)
+        {
+            error = errno;
+        }
+        else
+        {
+            *data = ptr;
+            *size = st.st_size;
+        }
+    }
+    close(fd);
+    return error;
+}
+
+static int copy_file_data(int out, int in, uint64_t size)
+{
+    ssize_t n;
+#ifdef HAVE_COPY_FILE_RANGE
+    bool use_copy_range = true;
+#endif
+#ifdef FICLONE
+    // Reflink shares data blocks of both files, nothing is copied.
+    syscall_count++;
+    if (ioctl(out, FICLONE, in) == 0)
+    {
+        return 0;
+    }
+#endif
+    while (size > 0)
+    {
+        syscall_count++;
+#ifdef HAVE_COPY_FILE_RANGE
+        if (use_copy_range)
+        {
+            n = copy_file_range(in, NULL, out, NULL, MIN(size, 0x40000000), 0);
+            // Not supported by the kernel or between these file systems.
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                use_copy_range = false;
+                continue;
+            }
+        }
+        else
+#endif
+        {
+#ifdef __linux__
+            n = sendfile(out, in, NULL, MIN(size, 0x40000000));
+#else
+            ssize_t offset = 0;
+            n = read(in, buffer, MIN(size, sizeof(buffer)));
+            while (n > 0 && offset < n)
+            {
+                ssize_t written;
+                syscall_count++;
+                written = write(out, &buffer[offset], n - offset);
+                if (written < 0 && errno != EINTR)
+                {
+                    return errno;
+                }
+                offset += written > 0 ? written : 0;
+            }
+#endif
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (n < 0)
+        {
+            return errno;
+        }
+        else if (n == 0)
+        {
+            // File was truncated while copying.
+            return EIO;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+// Copies a file to path, the file is replaced atomically.
+static uint32_t copy_file(const ichar *source, const ichar *path, uint32_t mode)
+{
+    struct stat st;
+    char *temp_path;
+    int error = 0;
+    int in;
+    int fd;
+    syscall_count++;
+    in = open(source, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        return errno;
+    }
+    syscall_count++;
+    if (fstat(in, &st) < 0)
+    {
+        error = errno;
+    }
+    else
+    {
+        // Size is not preallocated, blocks of a reflink would replace the allocated ones.
+        fd = create_temp_file(path, mode, 0, &temp_path, &error);
+        if (fd >= 0)
+        {
+            error = copy_file_data(fd, in, st.st_size);
+        }
+        error = finish_temp_file(fd, temp_path, path, error);
+    }
+    syscall_count++;
+    close(in);
+    return error;
+}
+
+typedef struct
+{
+    void (*worker)(void *ctx, int index);
+    void *ctx;
+    int count;
+    int next;
+} parallel_state;
+
+static void *parallel_thread(void *arg)
+{
+    parallel_state *state = arg;
+    int index;
+    while ((index = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < state->count)
+    {
+        state->worker(state->ctx, index);
+    }
+    return NULL;
+}
+
+static void run_parallel(void (*worker)(void *ctx, int index), void *ctx, int count, int max_threads)
+{
+    pthread_t threads[max_threads];
+    parallel_state state = {worker, ctx, count, 0};
+    int threads_count = MIN(count, MIN(max_threads, (int)sysconf(_SC_NPROCESSORS_ONLN)));
+    int i;
+    int started = 0;
+    // Calling thread is also a worker.
+    for (i = 1; i < threads_count; i++)
+    {
+        if (pthread_create(&threads[started], NULL, parallel_thread, &state) == 0)
+        {
+            started++;
+        }
+    }
+    parallel_thread(&state);
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    syscall_count += 2 * started;
+}
+
+static int pipe_cloexec(int fds[2])
+{
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) < 0)
+    {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+static uint32_t process_spawn(ichar **args, const ichar *cwd, ichar **env)
+{
+    posix_spawn_file_actions_t actions;
+    int out_pipe[2];
+    int err_pipe[2];
+    int error;
+    int i;
+
+    syscall_count += 2;
+    if (pipe_cloexec(out_pipe) < 0)
+    {
+        return errno;
+    }
+    if (pipe_cloexec(err_pipe) < 0)
+    {
+        error = errno;
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return error;
+    }
+
+    // Only duplicated descriptors are inherited, all other are close-on-exec.
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, err_pipe[1], 2);
+#ifdef HAVE_SPAWN_ADDCHDIR
+    if (cwd != NULL)
+    {
+        posix_spawn_file_actions_addchdir_np(&actions, cwd);
+    }
+#else
+    int old_cwd = -1;
+    if (cwd != NULL)
+    {
+        syscall_count += 2;
+        old_cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (old_cwd < 0 || chdir(cwd) < 0)
+        {
+            error = errno;
+            goto cleanup;
+        }
+    }
+#endif
+
+    syscall_count += 2;
+    child_start = get_time_ns();
+    // posix_spawnp uses vfork (or clone with CLONE_VM), so it does not copy page tables.
+    error = posix_spawnp(&child_pid, args[0], &actions, NULL, args, env != NULL ? env : environ);
+
+#ifndef HAVE_SPAWN_ADDCHDIR
+    if (old_cwd >= 0)
+    {
+        syscall_count++;
+        test(fchdir(old_cwd) == 0, "Cannot restore working directory.");
+    }
+cleanup:
+    if (old_cwd >= 0)
+    {
+        syscall_count++;
+        close(old_cwd);
+    }
+#endif
+    posix_spawn_file_actions_destroy(&actions);
+
+    syscall_count += 2;
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    child_pipes[1] = out_pipe[0];
+    child_pipes[2] = err_pipe[0];
+    if (error != 0)
+    {
+        child_pid = -1;
+        for (i = 1; i <= 2; i++)
+        {
+            syscall_count++;
+            close(child_pipes[i]);
+            child_pipes[i] = -1;
+        }
+    }
+    return error;
+}
+
+static int process_wait(uint8_t *data, size_t max_size, size_t *size)
+{
+    struct pollfd fds[3];
+    int fd_stream[3];
+    int count;
+    int i;
+    ssize_t n;
+
+    send_flush();
+    while (1)
+    {
+        count = 0;
+        for (i = 1; i <= 2; i++)
+        {
+            if (child_pipes[i] >= 0)
+            {
+                fds[count].fd = child_pipes[i];
+                fds[count].events = POLLIN;
+                fd_stream[count] = i;
+                count++;
+            }
+        }
+        if (count == 0)
+        {
+            return PROCESS_EVENT_DONE;
+        }
+        fds[count].fd = client_sock;
+        fds[count].events = POLLIN;
+        fd_stream[count] = PROCESS_EVENT_CONTROLLER;
+        count++;
+
+        syscall_count++;
+        if (poll(fds, count, -1) < 0)
+        {
+            test(errno == EINTR, "Cannot wait for child process output.");
+            continue;
+        }
+
+        // Child output goes first, so the controller can overlap it with further work.
+        for (i = 0; i < count; i++)
+        {
+            if (fds[i].revents == 0)
+            {
+                continue;
+            }
+            if (fd_stream[i] == PROCESS_EVENT_CONTROLLER)
+            {
+                return PROCESS_EVENT_CONTROLLER;
+            }
+            syscall_count++;
+            n = read(fds[i].fd, data, max_size);
+            if (n > 0)
+            {
+                *size = n;
+                return fd_stream[i];
+            }
+            if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            {
+                continue;
+            }
+            syscall_count++;
+            close(fds[i].fd);
+            child_pipes[fd_stream[i]] = -1;
+        }
+    }
+}
+
+static void process_finish(process_result *result)
+{
+    struct rusage usage;
+    int status;
+    pid_t pid;
+
+    do
+    {
+        syscall_count++;
+        pid = wait4(child_pid, &status, 0, &usage);
+    } while (pid < 0 && errno == EINTR);
+    test(pid == child_pid, "Cannot wait for child process.");
+    child_pid = -1;
+
+    result->wall_time = get_time_ns() - child_start;
+
+    if (WIFSIGNALED(status))
+    {
+        result->status = 128 + WTERMSIG(status);
+    }
+    else
+    {
+        result->status = WEXITSTATUS(status);
+    }
+    result->user_time = (uint64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+    result->system_time = (uint64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+#ifdef __APPLE__
+    result->max_rss = usage.ru_maxrss / 1024;
+#else
+    result->max_rss = usage.ru_maxrss;
+#endif
+}
+
+static void get_self_usage(process_result *result)
+{
+    struct rusage usage;
+    syscall_count++;
+    memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_SELF, &usage);
+    result->user_time = (uint64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+    result->system_time = (uint64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+#ifdef __APPLE__
+    result->max_rss = usage.ru_maxrss / 1024;
+#else
+    result->max_rss = usage.ru_maxrss;
+#endif
+}
+
 #endif
 #endif
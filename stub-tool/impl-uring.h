@@ -0,0 +1,226 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _IMPL_URING_H_
+#define _IMPL_URING_H_
+
+/*
+io_uring transport for Linux, used by impl-unix.h when compiled with -DUSE_IO_URING.
+
+Two exchanges are submitted as linked requests, so each takes one system call instead of two:
+- queued data is sent and the reply starts being received (handshake and every command
+  that has a response),
+- output of STDOUT/STDERR commands that fits in `buffer` is read from the socket and written
+  to the descriptor, larger output is still moved by splice.
+The buffer is not registered with IORING_REGISTER_BUFFERS: pinning it costs more than a
+single short-lived process saves on a few small writes.
+A link is broken when the first request completes short, the caller finishes the work with
+plain system calls then. If the ring cannot be created (kernel before 5.7, io_uring disabled by
+a sysctl or seccomp) or REMOTE_JOBS_IO_URING=0, the plain socket backend is used.
+*/
+
+#if defined(USE_IO_URING) && defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#define URING_ENABLED 1
+#ifndef IORING_FEAT_FAST_POLL
+#define IORING_FEAT_FAST_POLL (1U << 5)
+#endif
+#define URING_ENTRIES 4
+
+static int uring_fd = -1;
+static bool uring_tried = false;
+static struct io_uring_sqe *uring_sqes;
+static uint32_t *uring_sq_tail;
+static uint32_t *uring_sq_mask;
+static uint32_t *uring_sq_array;
+static uint32_t *uring_cq_head;
+static uint32_t *uring_cq_tail;
+static uint32_t *uring_cq_mask;
+static struct io_uring_cqe *uring_cqes;
+static uint32_t uring_sq_pending = 0;
+
+static bool uring_init()
+{
+    struct io_uring_params params;
+    uint8_t *ring;
+    size_t ring_size;
+    const char *value = getenv("REMOTE_JOBS_IO_URING");
+
+    uring_tried = true;
+    if (value != NULL && strcmp(value, "0") == 0)
+    {
+        return false;
+    }
+    memset(&params, 0, sizeof(params));
+    syscall_count++;
+    uring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring_fd < 0)
+    {
+        return false;
+    }
+    // RECV, READ and WRITE operations need Linux 5.6. Fast poll (5.7) is checked instead of probing
+    // the operations, so no system call is added. It also keeps socket receives off worker threads.
+    // Older kernels use the fallback.
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_FAST_POLL))
+    {
+        goto fail;
+    }
+    ring_size = MAX(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    syscall_count += 2;
+    ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED)
+    {
+        goto fail;
+    }
+    uring_sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+    if (uring_sqes == MAP_FAILED)
+    {
+        goto fail;
+    }
+    uring_sq_tail = (uint32_t *)(ring + params.sq_off.tail);
+    uring_sq_mask = (uint32_t *)(ring + params.sq_off.ring_mask);
+    uring_sq_array = (uint32_t *)(ring + params.sq_off.array);
+    uring_cq_head = (uint32_t *)(ring + params.cq_off.head);
+    uring_cq_tail = (uint32_t *)(ring + params.cq_off.tail);
+    uring_cq_mask = (uint32_t *)(ring + params.cq_off.ring_mask);
+    uring_cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    return true;
+
+fail:
+    // Mappings are left for the process exit, they are small.
+    syscall_count++;
+    close(uring_fd);
+    uring_fd = -1;
+    return false;
+}
+
+static bool uring_enabled()
+{
+    return uring_fd >= 0 || (!uring_tried && uring_init());
+}
+
+static struct io_uring_sqe *uring_get_sqe(uint8_t opcode, int fd, uint64_t user_data)
+{
+    uint32_t index = (*uring_sq_tail + uring_sq_pending) & *uring_sq_mask;
+    struct io_uring_sqe *sqe = &uring_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    uring_sq_array[index] = index;
+    uring_sq_pending++;
+    return sqe;
+}
+
+// Submits pending requests and waits for all of them. Results are stored by user_data index.
+static void uring_submit(int32_t *results)
+{
+    uint32_t count = uring_sq_pending;
+    uint32_t done = 0;
+    uint32_t submit = count;
+    __atomic_store_n(uring_sq_tail, *uring_sq_tail + count, __ATOMIC_RELEASE);
+    uring_sq_pending = 0;
+    while (done < count)
+    {
+        uint32_t head = *uring_cq_head;
+        uint32_t tail = __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            int rc;
+            syscall_count++;
+            rc = syscall(__NR_io_uring_enter, uring_fd, submit, count - done, IORING_ENTER_GETEVENTS, NULL, 0);
+            test(rc >= 0 || errno == EINTR, "io_uring_enter failed.");
+            if (rc > 0)
+            {
+                submit -= MIN(submit, (uint32_t)rc);
+            }
+            continue;
+        }
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &uring_cqes[head & *uring_cq_mask];
+            results[cqe->user_data] = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(uring_cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+// Sends the vector and receives up to max_size bytes. Returns number of received bytes, 0 if
+// the receive was not done, because the data was not sent completely.
+static size_t uring_send_recv_part(const io_vec *vec, int count, uint8_t *data, size_t max_size, size_t *sent)
+{
+    struct msghdr msg;
+    struct io_uring_sqe *sqe;
+    int32_t results[2];
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)vec;
+    msg.msg_iovlen = count;
+    sqe = uring_get_sqe(IORING_OP_SENDMSG, client_sock, 0);
+    sqe->addr = (uintptr_t)&msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = uring_get_sqe(IORING_OP_RECV, client_sock, 1);
+    sqe->addr = (uintptr_t)data;
+    sqe->len = max_size;
+    uring_submit(results);
+
+    test(results[0] >= 0, "Sending to controller error.");
+    test(results[0] > 0, "Controller stopped receiving data.");
+    *sent = results[0];
+    if (results[1] == -ECANCELED)
+    {
+        return 0;
+    }
+    test(results[1] >= 0, "Communication with controller failed.");
+    test(results[1] > 0, "Controller closed communication unexpectedly.");
+    return results[1];
+}
+
+// Moves up to max_size bytes of output from the socket to the descriptor.
+static size_t uring_output(int fd, size_t max_size)
+{
+    struct io_uring_sqe *sqe;
+    int32_t results[2];
+    size_t size = MIN(max_size, sizeof(buffer));
+
+    sqe = uring_get_sqe(IORING_OP_READ, client_sock, 0);
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = size;
+    sqe->off = (uint64_t)-1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = uring_get_sqe(IORING_OP_WRITE, fd, 1);
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = size;
+    sqe->off = (uint64_t)-1;
+    uring_submit(results);
+
+    test(results[0] >= 0, "Communication with controller failed.");
+    test(results[0] > 0, "Controller closed communication unexpectedly.");
+    if (results[1] == -ECANCELED)
+    {
+        // Only part of the output was available, so the write was not started.
+        results[1] = 0;
+    }
+    test(results[1] >= 0, "Write to stdout or stderr failed.");
+    write_output_all(fd, buffer + results[1], results[0] - results[1]);
+    return results[0];
+}
+
+#endif
+#endif /* _IMPL_URING_H_ */
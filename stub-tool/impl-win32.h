@@ -13,7 +13,10 @@
 
 #include <malloc.h>
 #include <stdio.h>
+#include <string.h>
 #include <windows.h>
+#define PSAPI_VERSION 2
+#include <psapi.h>
 #include <wchar.h>
 #include <fcntl.h>
 #include <io.h>
@@ -25,6 +28,11 @@
 #define WIN32_CONNECTION_PREFIX _WIN32_CONNECTION_PREFIX1(CONNECTION_PREFIX)
 
 static HANDLE pipe_handle = INVALID_HANDLE_VALUE;
+static HANDLE input_file = INVALID_HANDLE_VALUE;
+static HANDLE child_process = INVALID_HANDLE_VALUE;
+static HANDLE child_pipes[3] = {INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE};
+static uint64_t child_start;
+static HANDLE jobserver_semaphore = NULL;
 
 static void fatal(const char *message)
 {
@@ -36,12 +44,56 @@ static void fatal(const char *message)
     exit(99);
 }
 
-static void connect_to_controller()
+// Adopts a connected pipe handle passed by the parent process in REMOTE_JOBS_FD.
+static bool use_inherited_pipe()
+{
+    WCHAR value[32];
+    WCHAR *end;
+    HANDLE handle;
+    DWORD n = GetEnvironmentVariableW(L"REMOTE_JOBS_FD", value, sizeof(value) / sizeof(value[0]));
+    if (n == 0 || n >= sizeof(value) / sizeof(value[0]))
+    {
+        return false;
+    }
+    handle = (HANDLE)(uintptr_t)wcstoull(value, &end, 10);
+    // Variable may be inherited by a process that does not have the handle anymore.
+    syscall_count++;
+    if (*end != 0 || GetFileType(handle) != FILE_TYPE_PIPE)
+    {
+        return false;
+    }
+    syscall_count += 2;
+    SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0);
+    SetEnvironmentVariableW(L"REMOTE_JOBS_FD", NULL);
+    pipe_handle = handle;
+    return true;
+}
+
+static uint64_t get_time_ns()
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000 +
+           (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+}
+
+static bool connect_to_controller()
 {
     int n;
     WCHAR pipe_name[256];
+    WCHAR timeout_str[16];
+    DWORD timeout = 0;
     size_t prefix_len = wcslen(WIN32_CONNECTION_PREFIX);
     WCHAR *id_ptr = pipe_name + prefix_len;
+    if (use_inherited_pipe())
+    {
+        return true;
+    }
     wcscpy(pipe_name, WIN32_CONNECTION_PREFIX);
     n = GetEnvironmentVariableW(L"REMOTE_JOBS_CONNECTION_ID", id_ptr, sizeof(pipe_name) - prefix_len);
     if (n <= 0)
@@ -49,29 +101,205 @@ static void connect_to_controller()
         wcscpy(id_ptr, L"0");
     }
     test(n < sizeof(pipe_name) - prefix_len, "Connection id too long.");
-    pipe_handle = CreateFileW(pipe_name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    test(pipe_handle != INVALID_HANDLE_VALUE, "Cannot open pipe to controller.");
+    n = GetEnvironmentVariableW(L"REMOTE_JOBS_CONNECT_TIMEOUT", timeout_str, sizeof(timeout_str) / sizeof(timeout_str[0]));
+    if (n > 0 && n < sizeof(timeout_str) / sizeof(timeout_str[0]))
+    {
+        timeout = wcstoul(timeout_str, NULL, 10);
+    }
+    while (true)
+    {
+        syscall_count++;
+        pipe_handle = CreateFileW(pipe_name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (pipe_handle != INVALID_HANDLE_VALUE)
+        {
+            return true;
+        }
+        // All pipe instances are busy, wait for one unless the wait times out.
+        syscall_count += 2;
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(pipe_name, timeout > 0 ? timeout : NMPWAIT_WAIT_FOREVER))
+        {
+            return false;
+        }
+    }
+}
+
+static void clear_handshake_timeout()
+{
+    // Synchronous pipe reads have no timeout, REMOTE_JOBS_CONNECT_TIMEOUT applies only to connecting.
 }
 
 static void disconnect_from_controller()
 {
+    syscall_count++;
     CloseHandle(pipe_handle);
     pipe_handle = INVALID_HANDLE_VALUE;
 }
 
-static size_t send_part(const uint8_t *data, size_t max_size)
+static void install_cancel_handlers()
+{
+    // Pipes cannot be half-closed. Console control events terminate the process, which closes
+    // the pipe, so the controller sees the end of the stream anyway.
+}
+
+// GNU make on Windows shares the tokens through a named semaphore.
+static bool jobserver_open(const char *auth)
+{
+    syscall_count++;
+    jobserver_semaphore = OpenSemaphoreA(SEMAPHORE_MODIFY_STATE | SYNCHRONIZE, FALSE, auth);
+    return jobserver_semaphore != NULL;
+}
+
+static bool jobserver_release()
+{
+    // Fails when the semaphore is full, i.e. the stub runs in make's own job slot and
+    // all other tokens are free.
+    syscall_count++;
+    return ReleaseSemaphore(jobserver_semaphore, 1, NULL);
+}
+
+static void jobserver_acquire()
+{
+    syscall_count++;
+    WaitForSingleObject(jobserver_semaphore, INFINITE);
+}
+
+// Checks if the file is the stub executable, so it can be skipped when looking for the real tool.
+static bool is_self(const WCHAR *file)
+{
+    static WCHAR self[MAX_PATH];
+    WCHAR full[MAX_PATH];
+    if (self[0] == 0)
+    {
+        syscall_count++;
+        GetModuleFileNameW(NULL, self, MAX_PATH);
+    }
+    syscall_count++;
+    return GetFullPathNameW(file, MAX_PATH, full, NULL) > 0 && _wcsicmp(full, self) == 0;
+}
+
+// Finds an executable named the same as the stub in REMOTE_JOBS_LOCAL_PATH or, if it is not set, in PATH,
+// skipping the stub itself. Result is written to file (MAX_PATH characters).
+static bool find_local_tool(WCHAR *file)
+{
+    WCHAR *path;
+    WCHAR *dir;
+    WCHAR *next;
+    const WCHAR *name = iarg[0];
+    const WCHAR *ptr;
+    const WCHAR *extension;
+    DWORD size;
+    bool found = false;
+
+    for (ptr = iarg[0]; *ptr != 0; ptr++)
+    {
+        if (*ptr == L'\\' || *ptr == L'/' || *ptr == L':')
+        {
+            name = ptr + 1;
+        }
+    }
+    extension = wcsrchr(name, L'.') != NULL ? NULL : L".exe";
+    size = GetEnvironmentVariableW(L"REMOTE_JOBS_LOCAL_PATH", NULL, 0);
+    if (size == 0)
+    {
+        size = GetEnvironmentVariableW(L"PATH", NULL, 0);
+        if (size == 0)
+        {
+            return false;
+        }
+    }
+    path = malloc(size * sizeof(WCHAR));
+    test(path != NULL, "Memory allocation failed.");
+    if (GetEnvironmentVariableW(L"REMOTE_JOBS_LOCAL_PATH", path, size) == 0)
+    {
+        GetEnvironmentVariableW(L"PATH", path, size);
+    }
+    for (dir = path; dir != NULL && !found; dir = next)
+    {
+        next = wcschr(dir, L';');
+        if (next != NULL)
+        {
+            *next++ = 0;
+        }
+        syscall_count++;
+        found = dir[0] != 0 && SearchPathW(dir, name, extension, MAX_PATH, file, NULL) > 0 && !is_self(file);
+    }
+    free(path);
+    return found;
+}
+
+// Runs the real tool with the same command line and exits with its exit code. Returns only if the tool
+// cannot be found or started.
+static void run_local_tool()
 {
+    WCHAR file[MAX_PATH];
+    STARTUPINFOW startup;
+    PROCESS_INFORMATION info;
+    DWORD exit_code = 99;
+    if (!find_local_tool(file))
+    {
+        return;
+    }
+    if (pipe_handle != INVALID_HANDLE_VALUE)
+    {
+        disconnect_from_controller();
+    }
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    syscall_count++;
+    if (!CreateProcessW(file, GetCommandLineW(), NULL, NULL, TRUE, 0, NULL, NULL, &startup, &info))
+    {
+        return;
+    }
+    CloseHandle(info.hThread);
+    WaitForSingleObject(info.hProcess, INFINITE);
+    GetExitCodeProcess(info.hProcess, &exit_code);
+    exit(exit_code);
+}
+
+static size_t send_vec_part(const io_vec *vec, int count)
+{
+    static uint8_t gather_buffer[65536];
+    const uint8_t *data = vec[0].iov_base;
+    DWORD size = vec[0].iov_len;
     DWORD written;
-    WINBOOL ok = WriteFile(pipe_handle, data, max_size, &written, NULL);
+    WINBOOL ok;
+    int i;
+    // WriteFile has no gather variant, so merge small buffers before writing.
+    if (count > 1 && size < sizeof(gather_buffer))
+    {
+        size = 0;
+        for (i = 0; i < count && size < sizeof(gather_buffer); i++)
+        {
+            size_t n = MIN(vec[i].iov_len, sizeof(gather_buffer) - size);
+            memcpy(&gather_buffer[size], vec[i].iov_base, n);
+            size += n;
+        }
+        data = gather_buffer;
+    }
+    syscall_count++;
+    ok = WriteFile(pipe_handle, data, size, &written, NULL);
     test(ok, "Writing to pipe failed.");
     test(written > 0, "Controller stopped receiving data.");
     return written;
 }
 
+static size_t send_recv_part(const io_vec *vec, int count, uint8_t *data, size_t max_size, size_t *sent)
+{
+    (void)vec;
+    (void)count;
+    (void)data;
+    (void)max_size;
+    *sent = 0;
+    return 0;
+}
+
 static size_t recv_part(uint8_t *data, size_t max_size)
 {
     DWORD read;
-    WINBOOL ok = ReadFile(pipe_handle, data, max_size, &read, NULL);
+    WINBOOL ok;
+    syscall_count++;
+    ok = ReadFile(pipe_handle, data, max_size, &read, NULL);
     test(ok, "Reading from pipe failed.");
     test(read > 0, "Controller stopped sending data.");
     return read;
@@ -82,22 +310,56 @@ static void send_str(const ichar *str)
     int n;
     static char *temp = NULL;
     static int temp_len = 0;
-    n = WideCharToMultiByte(CP_UTF8, 0, str, -1, temp, temp_len, NULL, NULL);
-    if (n <= 0 || n > temp_len)
+    static int temp_used = 0;
+    n = WideCharToMultiByte(CP_UTF8, 0, str, -1, NULL, 0, NULL, NULL);
+    test(n > 0, "Failed to convert string.");
+    if (temp_used + n > temp_len)
     {
-        n = WideCharToMultiByte(CP_UTF8, 0, str, -1, NULL, 0, NULL, NULL);
-        if (temp != NULL)
+        // Converted strings stay queued until sent, so flush them before reusing the memory.
+        send_flush();
+        temp_used = 0;
+        if (n > temp_len)
         {
-            free(temp);
+            if (temp != NULL)
+            {
+                free(temp);
+            }
+            temp_len = n + n / 2 + 65536;
+            temp = (char *)malloc(temp_len);
+            test(temp != NULL, "Failed to allocate memory.");
         }
-        temp_len = n + n / 2 + 16;
-        temp = (char *)malloc(temp_len);
-        test(temp != NULL, "Failed to allocate memory.");
-        n = WideCharToMultiByte(CP_UTF8, 0, str, -1, temp, temp_len, NULL, NULL);
     }
-    test(n > 0 && n <= temp_len, "Failed to convert string.");
+    n = WideCharToMultiByte(CP_UTF8, 0, str, -1, &temp[temp_used], temp_len - temp_used, NULL, NULL);
+    test(n > 0 && temp_used + n <= temp_len, "Failed to convert string.");
     send_int(n - 1);
-    send_all(temp, n - 1);
+    send_all(&temp[temp_used], n - 1);
+    temp_used += n;
+}
+
+static ichar *str_from_utf8(const char *str)
+{
+    int n;
+    ichar *result;
+    n = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+    test(n > 0, "Failed to convert string.");
+    result = (ichar *)malloc(n * sizeof(ichar));
+    test(result != NULL, "Memory allocation failed.");
+    n = MultiByteToWideChar(CP_UTF8, 0, str, -1, result, n);
+    test(n > 0, "Failed to convert string.");
+    return result;
+}
+
+static ichar *recv_str()
+{
+    size_t len = recv_int();
+    char *temp = (char *)malloc(len + 1);
+    ichar *str;
+    test(temp != NULL, "Memory allocation failed.");
+    recv_all(temp, len);
+    temp[len] = 0;
+    str = str_from_utf8(temp);
+    free(temp);
+    return str;
 }
 
 static void get_process_info(int argc, char *argv[])
@@ -105,6 +367,9 @@ static void get_process_info(int argc, char *argv[])
     // Set stdout to binary mode to avoid any tranformations
     _setmode(_fileno(stdout), _O_BINARY);
 
+    // Get process id
+    ipid = GetCurrentProcessId();
+
     // Get process arguments (ignore argv from main, because it contains ANSI string)
     iarg = (const ichar **)CommandLineToArgvW(GetCommandLineW(), &iarg_count);
 
@@ -139,10 +404,621 @@ static void get_process_info(int argc, char *argv[])
 static size_t write_output(int fd, const uint8_t *data, size_t size)
 {
     FILE *dest = fd == 1 ? stdout : stderr;
-    int n = fwrite(data, 1, size, dest);
+    int n;
+    syscall_count++;
+    n = fwrite(data, 1, size, dest);
     test(n > 0, "Write to stdout or stderr failed.");
     return n;
 }
 
+static size_t write_output_vec(int fd, const io_vec *vec, int count)
+{
+    size_t total = 0;
+    int i;
+    // Standard streams are buffered by the C library, so there is nothing to gain from a single call.
+    for (i = 0; i < count; i++)
+    {
+        if (vec[i].iov_len > 0)
+        {
+            total += write_output(fd, vec[i].iov_base, vec[i].iov_len);
+        }
+    }
+    return total;
+}
+
+static size_t splice_output(int fd, size_t max_size)
+{
+    return 0;
+}
+
+static uint32_t attach_stdio_handles()
+{
+    return 0;
+}
+
+static bool wait_for_stdin()
+{
+    HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+    DWORD type = GetFileType(input);
+    send_flush();
+    // Anonymous and named pipes cannot be waited on, so poll them.
+    while (1)
+    {
+        DWORD available = 0;
+        syscall_count++;
+        if (!PeekNamedPipe(pipe_handle, NULL, 0, NULL, &available, NULL) || available > 0)
+        {
+            return false;
+        }
+        if (type != FILE_TYPE_PIPE)
+        {
+            return true;
+        }
+        syscall_count++;
+        if (!PeekNamedPipe(input, NULL, 0, NULL, &available, NULL) || available > 0)
+        {
+            return true;
+        }
+        Sleep(1);
+    }
+}
+
+static uint32_t open_file(const ichar *path, uint64_t *size)
+{
+    LARGE_INTEGER file_size;
+    syscall_count++;
+    input_file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (input_file == INVALID_HANDLE_VALUE)
+    {
+        return GetLastError();
+    }
+    syscall_count++;
+    if (!GetFileSizeEx(input_file, &file_size))
+    {
+        DWORD error = GetLastError();
+        CloseHandle(input_file);
+        input_file = INVALID_HANDLE_VALUE;
+        return error;
+    }
+    *size = file_size.QuadPart;
+    return 0;
+}
+
+static uint32_t send_file(uint64_t size)
+{
+    DWORD error = 0;
+    while (size > 0)
+    {
+        DWORD n = 0;
+        if (error == 0)
+        {
+            syscall_count++;
+            if (!ReadFile(input_file, buffer, MIN(size, sizeof(buffer)), &n, NULL))
+            {
+                error = GetLastError();
+            }
+            else if (n == 0)
+            {
+                error = ERROR_HANDLE_EOF;
+            }
+        }
+        if (n == 0)
+        {
+            // Data size was already sent, so pad the rest with zeros.
+            n = MIN(size, sizeof(buffer));
+            memset(buffer, 0, n);
+        }
+        send_payload(buffer, n);
+        size -= n;
+    }
+    syscall_count++;
+    CloseHandle(input_file);
+    input_file = INVALID_HANDLE_VALUE;
+    return error;
+}
+
+static uint32_t recv_file(const ichar *path, uint32_t mode, uint64_t size)
+{
+    HANDLE file;
+    DWORD error = 0;
+    FILE_ALLOCATION_INFO allocation;
+    size_t path_len = wcslen(path);
+    WCHAR *temp_path = (WCHAR *)malloc((path_len + 32) * sizeof(WCHAR));
+    test(temp_path != NULL, "Memory allocation failed.");
+
+    // Data goes to a temporary file in the same directory, so the rename is atomic.
+    swprintf(temp_path, path_len + 32, L"%ls.rj%08X", path, (unsigned)ipid);
+    syscall_count++;
+    file = CreateFileW(temp_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        error = GetLastError();
+    }
+    else if (size > 0)
+    {
+        // Allocation failures are not fatal, e.g. file system may not support it.
+        allocation.AllocationSize.QuadPart = size;
+        syscall_count++;
+        SetFileInformationByHandle(file, FileAllocationInfo, &allocation, sizeof(allocation));
+    }
+
+    while (size > 0)
+    {
+        size_t n = recv_payload_part(size);
+        DWORD written;
+        size_t offset = 0;
+        while (error == 0 && offset < n)
+        {
+            syscall_count++;
+            if (!WriteFile(file, &buffer[offset], n - offset, &written, NULL))
+            {
+                error = GetLastError();
+            }
+            offset += written;
+        }
+        size -= n;
+    }
+
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        syscall_count++;
+        CloseHandle(file);
+        syscall_count++;
+        if (error == 0 && !MoveFileExW(temp_path, path, MOVEFILE_REPLACE_EXISTING))
+        {
+            error = GetLastError();
+        }
+        if (error != 0)
+        {
+            syscall_count++;
+            DeleteFileW(temp_path);
+        }
+    }
+    free(temp_path);
+    (void)mode;
+    return error;
+}
+
+// Bulk transfers are not implemented, handles would have to be duplicated into the controller
+// process. Controllers use inline transfers instead.
+static bool bulk_read_file(uint32_t *handle)
+{
+    return false;
+}
+
+static uint32_t bulk_create_file(const ichar *path, uint32_t mode, uint64_t size, uint32_t *handle)
+{
+    return ERROR_NOT_SUPPORTED;
+}
+
+static uint32_t bulk_finish_file(const ichar *path, uint32_t error)
+{
+    return ERROR_NOT_SUPPORTED;
+}
+
+static uint32_t map_file(const ichar *path, const uint8_t **data, uint64_t *size, uint64_t *mtime)
+{
+    HANDLE file;
+    HANDLE mapping;
+    BY_HANDLE_FILE_INFORMATION info;
+    DWORD error = 0;
+    // This is called from multiple threads.
+    __atomic_fetch_add(&syscall_count, 3, __ATOMIC_RELAXED);
+    file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return GetLastError();
+    }
+    if (!GetFileInformationByHandle(file, &info))
+    {
+        error = GetLastError();
+    }
+    else
+    {
+        // FILETIME counts 100ns intervals since 1601-01-01.
+        uint64_t time = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+        *mtime = (time - 116444736000000000ULL) * 100;
+        *size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+        *data = NULL;
+        if (*size > 0)
+        {
+            __atomic_fetch_add(&syscall_count, 2, __ATOMIC_RELAXED);
+            mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping == NULL)
+            {
+                error = GetLastError();
+            }
+            else
+            {
+                *data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                if (*data == NULL)
+                {
+                    error = GetLastError();
+                }
+                CloseHandle(mapping);
+            }
+        }
+    }
+    CloseHandle(file);
+    return error;
+}
+
+static void unmap_file(const uint8_t *data, uint64_t size)
+{
+    if (data != NULL)
+    {
+        __atomic_fetch_add(&syscall_count, 1, __ATOMIC_RELAXED);
+        UnmapViewOfFile(data);
+    }
+}
+
+// Maps a file for reading and writing. Changes are visible to other processes mapping it.
+static uint32_t map_file_shared(const ichar *path, uint8_t **data, uint64_t *size)
+{
+    HANDLE file;
+    HANDLE mapping;
+    LARGE_INTEGER file_size;
+    DWORD error = 0;
+    syscall_count++;
+    file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return GetLastError();
+    }
+    syscall_count += 4;
+    if (!GetFileSizeEx(file, &file_size))
+    {
+        error = GetLastError();
+    }
+    else if ((mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, 0, 0, NULL)) == NULL)
+    {
+        error = GetLastError();
+    }
+    else
+    {
+        *data = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+        *size = file_size.QuadPart;
+        if (*data == NULL)
+        {
+            error = GetLastError();
+        }
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    return error;
+}
+
+// Copies a file to path, the file is replaced atomically. CopyFileW clones blocks on file
+// systems that support it.
+static uint32_t copy_file(const ichar *source, const ichar *path, uint32_t mode)
+{
+    DWORD error = 0;
+    size_t path_len = wcslen(path);
+    WCHAR *temp_path = (WCHAR *)malloc((path_len + 32) * sizeof(WCHAR));
+    test(temp_path != NULL, "Memory allocation failed.");
+
+    swprintf(temp_path, path_len + 32, L"%ls.rj%08X", path, (unsigned)ipid);
+    syscall_count++;
+    if (!CopyFileW(source, temp_path, FALSE))
+    {
+        error = GetLastError();
+    }
+    else
+    {
+        syscall_count++;
+        if (!MoveFileExW(temp_path, path, MOVEFILE_REPLACE_EXISTING))
+        {
+            error = GetLastError();
+            syscall_count++;
+            DeleteFileW(temp_path);
+        }
+    }
+    free(temp_path);
+    (void)mode;
+    return error;
+}
+
+typedef struct
+{
+    void (*worker)(void *ctx, int index);
+    void *ctx;
+    LONG count;
+    LONG next;
+} parallel_state;
+
+static DWORD WINAPI parallel_thread(LPVOID arg)
+{
+    parallel_state *state = (parallel_state *)arg;
+    LONG index;
+    while ((index = InterlockedIncrement(&state->next) - 1) < state->count)
+    {
+        state->worker(state->ctx, index);
+    }
+    return 0;
+}
+
+static void run_parallel(void (*worker)(void *ctx, int index), void *ctx, int count, int max_threads)
+{
+    HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+    parallel_state state = {worker, ctx, count, 0};
+    SYSTEM_INFO info;
+    int threads_count;
+    int i;
+    int started = 0;
+    GetSystemInfo(&info);
+    threads_count = MIN(count, MIN(MIN(max_threads, MAXIMUM_WAIT_OBJECTS), (int)info.dwNumberOfProcessors));
+    // Calling thread is also a worker.
+    for (i = 1; i < threads_count; i++)
+    {
+        threads[started] = CreateThread(NULL, 0, parallel_thread, &state, 0, NULL);
+        if (threads[started] != NULL)
+        {
+            started++;
+        }
+    }
+    parallel_thread(&state);
+    if (started > 0)
+    {
+        WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    }
+    for (i = 0; i < started; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+    syscall_count += 2 * started;
+}
+
+static size_t read_stdin(uint8_t *data, size_t max_size)
+{
+    DWORD read;
+    syscall_count++;
+    if (!ReadFile(GetStdHandle(STD_INPUT_HANDLE), data, max_size, &read, NULL))
+    {
+        return 0;
+    }
+    return read;
+}
+
+// Appends an argument quoted in the way expected by CommandLineToArgvW and the C runtime.
+static WCHAR *append_argument(WCHAR *ptr, const WCHAR *arg)
+{
+    int backslashes;
+    if (arg[0] != 0 && wcspbrk(arg, L" \t\n\v\"") == NULL)
+    {
+        wcscpy(ptr, arg);
+        return ptr + wcslen(arg);
+    }
+    *ptr++ = L'"';
+    while (1)
+    {
+        backslashes = 0;
+        while (*arg == L'\\')
+        {
+            backslashes++;
+            arg++;
+        }
+        if (*arg == 0)
+        {
+            // Backslashes before the closing quote must be doubled.
+            wmemset(ptr, L'\\', 2 * backslashes);
+            ptr += 2 * backslashes;
+            break;
+        }
+        if (*arg == L'"')
+        {
+            backslashes = 2 * backslashes + 1;
+        }
+        wmemset(ptr, L'\\', backslashes);
+        ptr += backslashes;
+        *ptr++ = *arg++;
+    }
+    *ptr++ = L'"';
+    return ptr;
+}
+
+static uint32_t process_spawn(ichar **args, const ichar *cwd, ichar **env)
+{
+    SECURITY_ATTRIBUTES security = {sizeof(SECURITY_ATTRIBUTES), NULL, TRUE};
+    STARTUPINFOW startup;
+    PROCESS_INFORMATION info;
+    HANDLE write_ends[3] = {INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE};
+    WCHAR *command_line;
+    WCHAR *env_block = NULL;
+    WCHAR *ptr;
+    size_t size;
+    uint32_t error = 0;
+    int i;
+
+    // Each character may be escaped, plus quotes and a separator.
+    size = 1;
+    for (i = 0; args[i] != NULL; i++)
+    {
+        size += 2 * wcslen(args[i]) + 3;
+    }
+    command_line = malloc(size * sizeof(WCHAR));
+    test(command_line != NULL, "Memory allocation failed.");
+    ptr = command_line;
+    for (i = 0; args[i] != NULL; i++)
+    {
+        if (i > 0)
+        {
+            *ptr++ = L' ';
+        }
+        ptr = append_argument(ptr, args[i]);
+    }
+    *ptr = 0;
+
+    if (env != NULL)
+    {
+        size = 2;
+        for (i = 0; env[i] != NULL; i++)
+        {
+            size += wcslen(env[i]) + 1;
+        }
+        env_block = malloc(size * sizeof(WCHAR));
+        test(env_block != NULL, "Memory allocation failed.");
+        ptr = env_block;
+        for (i = 0; env[i] != NULL; i++)
+        {
+            wcscpy(ptr, env[i]);
+            ptr += wcslen(env[i]) + 1;
+        }
+        ptr[0] = 0;
+        ptr[1] = 0;
+    }
+
+    // Only write ends are inherited by the child.
+    for (i = 1; i <= 2; i++)
+    {
+        syscall_count += 2;
+        if (!CreatePipe(&child_pipes[i], &write_ends[i], &security, 0) ||
+            !SetHandleInformation(child_pipes[i], HANDLE_FLAG_INHERIT, 0))
+        {
+            error = GetLastError();
+            goto cleanup;
+        }
+    }
+
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    startup.hStdOutput = write_ends[1];
+    startup.hStdError = write_ends[2];
+
+    syscall_count += 2;
+    child_start = get_time_ns();
+    if (!CreateProcessW(NULL, command_line, NULL, NULL, TRUE, CREATE_UNICODE_ENVIRONMENT, env_block, cwd,
+                        &startup, &info))
+    {
+        error = GetLastError();
+        goto cleanup;
+    }
+    CloseHandle(info.hThread);
+    child_process = info.hProcess;
+
+cleanup:
+    for (i = 1; i <= 2; i++)
+    {
+        if (write_ends[i] != INVALID_HANDLE_VALUE)
+        {
+            syscall_count++;
+            CloseHandle(write_ends[i]);
+        }
+        if (error != 0 && child_pipes[i] != INVALID_HANDLE_VALUE)
+        {
+            syscall_count++;
+            CloseHandle(child_pipes[i]);
+            child_pipes[i] = INVALID_HANDLE_VALUE;
+        }
+    }
+    free(command_line);
+    free(env_block);
+    return error;
+}
+
+static int process_wait(uint8_t *data, size_t max_size, size_t *size)
+{
+    DWORD available;
+    DWORD read;
+    bool running;
+    int i;
+
+    send_flush();
+    // Anonymous and named pipes cannot be waited on, so poll them.
+    while (1)
+    {
+        running = false;
+        for (i = 1; i <= 2; i++)
+        {
+            if (child_pipes[i] == INVALID_HANDLE_VALUE)
+            {
+                continue;
+            }
+            syscall_count++;
+            if (!PeekNamedPipe(child_pipes[i], NULL, 0, NULL, &available, NULL))
+            {
+                // Child closed its end of the pipe.
+                syscall_count++;
+                CloseHandle(child_pipes[i]);
+                child_pipes[i] = INVALID_HANDLE_VALUE;
+                continue;
+            }
+            running = true;
+            if (available > 0)
+            {
+                syscall_count++;
+                if (ReadFile(child_pipes[i], data, MIN(available, max_size), &read, NULL) && read > 0)
+                {
+                    *size = read;
+                    return i;
+                }
+            }
+        }
+        if (!running)
+        {
+            return PROCESS_EVENT_DONE;
+        }
+        syscall_count++;
+        if (!PeekNamedPipe(pipe_handle, NULL, 0, NULL, &available, NULL) || available > 0)
+        {
+            return PROCESS_EVENT_CONTROLLER;
+        }
+        Sleep(1);
+    }
+}
+
+static uint64_t filetime_to_us(const FILETIME *time)
+{
+    return (((uint64_t)time->dwHighDateTime << 32) | time->dwLowDateTime) / 10;
+}
+
+static void process_finish(process_result *result)
+{
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+    PROCESS_MEMORY_COUNTERS memory;
+    DWORD status;
+
+    syscall_count++;
+    test(WaitForSingleObject(child_process, INFINITE) == WAIT_OBJECT_0, "Cannot wait for child process.");
+    result->wall_time = get_time_ns() - child_start;
+
+    syscall_count += 3;
+    GetExitCodeProcess(child_process, &status);
+    result->status = status;
+    if (GetProcessTimes(child_process, &creation_time, &exit_time, &kernel_time, &user_time))
+    {
+        result->user_time = filetime_to_us(&user_time);
+        result->system_time = filetime_to_us(&kernel_time);
+    }
+    if (GetProcessMemoryInfo(child_process, &memory, sizeof(memory)))
+    {
+        result->max_rss = memory.PeakWorkingSetSize / 1024;
+    }
+
+    syscall_count++;
+    CloseHandle(child_process);
+    child_process = INVALID_HANDLE_VALUE;
+}
+
+static void get_self_usage(process_result *result)
+{
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+    PROCESS_MEMORY_COUNTERS memory;
+    syscall_count += 2;
+    if (GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time))
+    {
+        result->user_time = filetime_to_us(&user_time);
+        result->system_time = filetime_to_us(&kernel_time);
+    }
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory)))
+    {
+        result->max_rss = memory.PeakWorkingSetSize / 1024;
+    }
+}
+
 #endif
 #endif
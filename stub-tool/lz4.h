@@ -0,0 +1,290 @@
+/*!
+ * Copyright (c) 2022, Dominik Kilian <kontakt@dominik.cc>
+ * All rights reserved.
+ *
+ * This software is distributed under the BSD 3-Clause License. See the
+ * LICENSE.txt file for details.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+/*
+LZ4 block format compressor and decompressor.
+
+Output of lz4_compress() can be decoded by any LZ4 block decoder and lz4_decompress()
+accepts any valid LZ4 block. Compressor uses a single-probe hash table with greedy
+matching, which is the same trade-off as the LZ4 "fast" mode. Blocks are limited to
+64 KiB, because all offsets fit in the 16-bit field then.
+*/
+
+#include <memory.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define LZ4_MAX_BLOCK_SIZE 65536
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_FIND_LIMIT 12
+#define LZ4_HASH_BITS 12
+#define LZ4_SKIP_TRIGGER 6
+
+static inline uint32_t lz4_read32(const uint8_t *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline uint64_t lz4_read64(const uint8_t *ptr)
+{
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+// Returns number of equal bytes at the beginning of a and b, but not more than limit - a.
+static inline size_t lz4_count(const uint8_t *a, const uint8_t *b, const uint8_t *limit)
+{
+    const uint8_t *start = a;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (limit - a >= 8)
+    {
+        uint64_t diff = lz4_read64(a) ^ lz4_read64(b);
+        if (diff != 0)
+        {
+            return a - start + (__builtin_ctzll(diff) >> 3);
+        }
+        a += 8;
+        b += 8;
+    }
+#endif
+    while (a < limit && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+// Copies 8 bytes at a time, so it may write up to 7 bytes after dst + size.
+static inline void lz4_wild_copy(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    uint8_t *end = dst + size;
+    do
+    {
+        memcpy(dst, src, 8);
+        dst += 8;
+        src += 8;
+    } while (dst < end);
+}
+
+static inline uint32_t lz4_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static uint8_t *lz4_write_length(uint8_t *op, size_t length)
+{
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// Compresses up to LZ4_MAX_BLOCK_SIZE bytes. Returns compressed size or 0 if the result
+// does not fit in dst_size bytes, so passing src_size - 1 finds incompressible data quickly.
+static inline size_t lz4_compress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size)
+{
+    uint16_t table[1 << LZ4_HASH_BITS];
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + src_size;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_size;
+    size_t literals;
+
+    if (src_size > LZ4_MAX_BLOCK_SIZE)
+    {
+        return 0;
+    }
+
+    if (src_size > LZ4_MATCH_FIND_LIMIT)
+    {
+        const uint8_t *match_limit = end - LZ4_MATCH_FIND_LIMIT;
+        const uint8_t *extend_limit = end - LZ4_LAST_LITERALS;
+        memset(table, 0, sizeof(table));
+        ip++;
+        while (ip <= match_limit)
+        {
+            uint32_t sequence = lz4_read32(ip);
+            uint32_t hash = lz4_hash(sequence);
+            const uint8_t *ref = src + table[hash];
+            const uint8_t *match_end;
+            size_t match_length;
+            table[hash] = (uint16_t)(ip - src);
+            if (lz4_read32(ref) != sequence || ref >= ip)
+            {
+                // Skip faster through data that does not match.
+                ip += 1 + ((ip - anchor) >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+            match_end = ip + LZ4_MIN_MATCH;
+            match_end += lz4_count(match_end, ref + LZ4_MIN_MATCH, extend_limit);
+
+            literals = ip - anchor;
+            match_length = match_end - ip - LZ4_MIN_MATCH;
+            if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals + 2 + match_length / 255 + 1)
+            {
+                return 0;
+            }
+            *op = (uint8_t)((literals >= 15 ? 15 : literals) << 4) | (match_length >= 15 ? 15 : match_length);
+            op++;
+            if (literals >= 15)
+            {
+                op = lz4_write_length(op, literals - 15);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+            op[0] = (uint8_t)(ip - ref);
+            op[1] = (uint8_t)((ip - ref) >> 8);
+            op += 2;
+            if (match_length >= 15)
+            {
+                op = lz4_write_length(op, match_length - 15);
+            }
+
+            ip = match_end;
+            anchor = ip;
+            if (ip <= match_limit)
+            {
+                // Position just before the next one improves chaining of repeated data.
+                table[lz4_hash(lz4_read32(ip - 2))] = (uint16_t)(ip - 2 - src);
+            }
+        }
+    }
+
+    literals = end - anchor;
+    if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals)
+    {
+        return 0;
+    }
+    *op++ = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15)
+    {
+        op = lz4_write_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+static const uint8_t *lz4_read_length(const uint8_t *ip, const uint8_t *ip_end, size_t *length)
+{
+    uint8_t byte;
+    do
+    {
+        if (ip >= ip_end)
+        {
+            return NULL;
+        }
+        byte = *ip++;
+        *length += byte;
+    } while (byte == 255);
+    return ip;
+}
+
+// Decompresses a block. Returns decompressed size or -1 if the block is malformed
+// or it does not fit in dst_size bytes.
+static inline ptrdiff_t lz4_decompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size)
+{
+    const uint8_t *ip = src;
+    const uint8_t *ip_end = src + src_size;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_size;
+
+    while (ip < ip_end)
+    {
+        uint8_t token = *ip++;
+        size_t length = token >> 4;
+        size_t offset;
+        const uint8_t *ref;
+
+        if (length == 15 && (ip = lz4_read_length(ip, ip_end, &length)) == NULL)
+        {
+            return -1;
+        }
+        if (length > (size_t)(ip_end - ip) || length > (size_t)(op_end - op))
+        {
+            return -1;
+        }
+        if (length + 8 <= (size_t)(ip_end - ip) && length + 8 <= (size_t)(op_end - op))
+        {
+            lz4_wild_copy(op, ip, length);
+        }
+        else
+        {
+            memcpy(op, ip, length);
+        }
+        op += length;
+        ip += length;
+        if (ip == ip_end)
+        {
+            // Last sequence contains only literals.
+            break;
+        }
+
+        if (ip_end - ip < 2)
+        {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+        {
+            return -1;
+        }
+        length = token & 15;
+        if (length == 15 && (ip = lz4_read_length(ip, ip_end, &length)) == NULL)
+        {
+            return -1;
+        }
+        length += LZ4_MIN_MATCH;
+        if (length > (size_t)(op_end - op))
+        {
+            return -1;
+        }
+        ref = op - offset;
+        if (offset >= 8 && length + 8 <= (size_t)(op_end - op))
+        {
+            lz4_wild_copy(op, ref, length);
+            op += length;
+        }
+        else if (offset >= length)
+        {
+            memcpy(op, ref, length);
+            op += length;
+        }
+        else
+        {
+            // Overlapping match repeats the last offset bytes.
+            while (length-- > 0)
+            {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op - dst;
+}
+
+#endif /* _LZ4_H_ */
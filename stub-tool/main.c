@@ -10,78 +10,1906 @@
 #include "impl-unix.h"
 #include "impl-win32.h"
 #include "md5.h"
+#include "fingerprint.h"
+#include "lz4.h"
+
+typedef union
+{
+    md5_ctx md5;
+    fp_ctx fp;
+} hash_ctx;
+
+static const char *program_name;
+static uint64_t start_time;
+
+typedef struct
+{
+    uint32_t event;
+    uint32_t arg;
+    uint64_t time;
+} trace_record;
+
+// Records are appended until the buffer is full, later ones are only counted as dropped,
+// so the startup phases are always kept.
+static trace_record trace_records[TRACE_MAX_RECORDS];
+static uint32_t trace_count = 0;
+static uint32_t trace_dropped = 0;
 
 static void test(bool cond, const char *message)
 {
-    if (!cond)
+    if (!cond)
+    {
+        fatal(message);
+    }
+}
+
+static void trace_record_event(uint32_t event, uint32_t arg)
+{
+    if (trace_count >= TRACE_MAX_RECORDS)
+    {
+        trace_dropped++;
+        return;
+    }
+    trace_records[trace_count].event = event;
+    trace_records[trace_count].arg = arg;
+    trace_records[trace_count].time = get_time_ns();
+    trace_count++;
+}
+
+// Only a flag is checked when tracing is disabled.
+static inline void trace(uint32_t event, uint32_t arg)
+{
+    if (trace_enabled)
+    {
+        trace_record_event(event, arg);
+    }
+}
+
+static void send_trace()
+{
+    uint32_t i;
+    uint64_t start = trace_count > 0 ? trace_records[0].time : 0;
+    send_int(trace_count);
+    send_int(trace_dropped);
+    for (i = 0; i < trace_count; i++)
+    {
+        send_int(trace_records[i].event);
+        send_int(trace_records[i].arg);
+        send_int64(trace_records[i].time - start);
+    }
+}
+
+// Outgoing data is queued and sent with a single vectored call when the stub
+// starts waiting for the controller. Queued data must stay valid until then.
+static io_vec send_queue[SEND_QUEUE_SIZE];
+static uint32_t send_queue_ints[SEND_QUEUE_SIZE];
+static int send_queue_count = 0;
+static int send_queue_int_count = 0;
+
+// Removes n sent bytes from the beginning of the queue.
+static void send_queue_consume(size_t n)
+{
+    int i = 0;
+    while (i < send_queue_count && n >= send_queue[i].iov_len)
+    {
+        n -= send_queue[i].iov_len;
+        i++;
+    }
+    if (n > 0)
+    {
+        send_queue[i].iov_base = (uint8_t *)send_queue[i].iov_base + n;
+        send_queue[i].iov_len -= n;
+    }
+    memmove(send_queue, &send_queue[i], (send_queue_count - i) * sizeof(io_vec));
+    send_queue_count -= i;
+    if (send_queue_count == 0)
+    {
+        send_queue_int_count = 0;
+    }
+}
+
+static void send_flush()
+{
+    while (send_queue_count > 0)
+    {
+        send_queue_consume(send_vec_part(send_queue, send_queue_count));
+    }
+}
+
+static void send_all(const void *data, size_t size)
+{
+    io_vec *last;
+    if (size == 0)
+    {
+        return;
+    }
+    if (send_queue_count > 0)
+    {
+        last = &send_queue[send_queue_count - 1];
+        if ((uint8_t *)last->iov_base + last->iov_len == data)
+        {
+            last->iov_len += size;
+            return;
+        }
+    }
+    if (send_queue_count >= SEND_QUEUE_SIZE)
+    {
+        send_flush();
+    }
+    send_queue[send_queue_count].iov_base = (void *)data;
+    send_queue[send_queue_count].iov_len = size;
+    send_queue_count++;
+}
+
+static void send_int(uint32_t value)
+{
+    if (send_queue_int_count >= SEND_QUEUE_SIZE || send_queue_count >= SEND_QUEUE_SIZE)
+    {
+        send_flush();
+    }
+    send_queue_ints[send_queue_int_count] = value;
+    send_all(&send_queue_ints[send_queue_int_count], sizeof(value));
+    send_queue_int_count++;
+}
+
+static void send_int64(uint64_t value)
+{
+    send_int((uint32_t)value);
+    send_int((uint32_t)(value >> 32));
+}
+
+static void recv_all(void *data, size_t size)
+{
+    uint8_t *ptr = data;
+    size_t sent;
+    size_t n;
+    if (send_queue_count > 0 && size > 0)
+    {
+        // Backend may send the queue and start receiving the reply with a single system call.
+        n = send_recv_part(send_queue, send_queue_count, ptr, size, &sent);
+        send_queue_consume(sent);
+        size -= n;
+        ptr += n;
+    }
+    send_flush();
+    while (size > 0)
+    {
+        size_t n = recv_part(ptr, size);
+        size -= n;
+        ptr += n;
+    }
+}
+
+static uint32_t recv_int()
+{
+    uint32_t result;
+    recv_all(&result, sizeof(result));
+    return result;
+}
+
+static uint64_t recv_int64()
+{
+    uint64_t low = recv_int();
+    return low | ((uint64_t)recv_int() << 32);
+}
+
+// Compressed data is sent in blocks: 4 bytes raw size, 4 bytes stored size and the stored
+// data. If both sizes are equal, the block is stored uncompressed.
+static uint8_t block_buffer[LZ4_MAX_BLOCK_SIZE];
+
+static void send_block(const uint8_t *data, size_t size)
+{
+    size_t n = 0;
+    if (size > 0 && size >= compression_threshold)
+    {
+        n = lz4_compress(data, size, block_buffer, size - 1);
+    }
+    send_int(size);
+    if (n > 0)
+    {
+        send_int(n);
+        send_all(block_buffer, n);
+    }
+    else
+    {
+        send_int(size);
+        send_all(data, size);
+    }
+    // Block buffer is reused by the next block, so it cannot stay in the queue.
+    send_flush();
+}
+
+static size_t recv_block(size_t max_size)
+{
+    size_t size = recv_int();
+    size_t stored = recv_int();
+    test(size > 0 && size <= MIN(max_size, sizeof(buffer)) && stored <= size, "Invalid compressed block.");
+    if (stored == size)
+    {
+        recv_all(buffer, size);
+        return size;
+    }
+    recv_all(block_buffer, stored);
+    test(lz4_decompress(block_buffer, stored, buffer, size) == (ptrdiff_t)size, "Invalid compressed block.");
+    return size;
+}
+
+// Sends payload data (file content, program output), compressed if it was negotiated.
+static void send_payload(const uint8_t *data, size_t size)
+{
+    if (compression == COMPRESSION_NONE)
+    {
+        send_all(data, size);
+        send_flush();
+        return;
+    }
+    while (size > 0)
+    {
+        size_t n = MIN(size, LZ4_MAX_BLOCK_SIZE);
+        send_block(data, n);
+        data += n;
+        size -= n;
+    }
+}
+
+// Receives next part of payload data into the buffer and returns its size.
+static size_t recv_payload_part(size_t max_size)
+{
+    if (compression == COMPRESSION_NONE)
+    {
+        return recv_part(buffer, MIN(max_size, sizeof(buffer)));
+    }
+    return recv_block(max_size);
+}
+
+static void write_output_all(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        int n = write_output(fd, data, size);
+        data += n;
+        size -= n;
+    }
+}
+
+static int ienv_compare(const void *a, const void *b)
+{
+    return istrcmp(*(const ichar **)a, *(const ichar **)b);
+}
+
+static void hash_init(hash_ctx *ctx)
+{
+    if (env_hash[0] == ENV_HASH_MD5)
+    {
+        md5_init(&ctx->md5);
+    }
+    else
+    {
+        fp_init(&ctx->fp);
+    }
+}
+
+static void hash_update(hash_ctx *ctx, const uint8_t *data, size_t size)
+{
+    if (env_hash[0] == ENV_HASH_MD5)
+    {
+        md5_update(&ctx->md5, data, size);
+    }
+    else
+    {
+        fp_update(&ctx->fp, data, size);
+    }
+}
+
+static void hash_digest(hash_ctx *ctx, uint8_t *digest)
+{
+    if (env_hash[0] == ENV_HASH_MD5)
+    {
+        md5_digest(&ctx->md5, digest);
+    }
+    else
+    {
+        fp_digest(&ctx->fp, digest);
+    }
+}
+
+// Hashes independent messages, 16-byte digest of message i is written to digests + 16 * i.
+// MD5 hashes them in SIMD lanes.
+static void hash_multi(const uint8_t *const *data, const size_t *sizes, int count, uint8_t *digests)
+{
+    hash_ctx ctx;
+    int i;
+    if (env_hash[0] == ENV_HASH_MD5)
+    {
+        md5_multi(data, sizes, count, digests);
+        return;
+    }
+    for (i = 0; i < count; i++)
+    {
+        hash_init(&ctx);
+        hash_update(&ctx, data[i], sizes[i]);
+        hash_digest(&ctx, &digests[16 * i]);
+    }
+}
+
+static void calc_env_hash()
+{
+    int i;
+    hash_ctx ctx;
+    const char *algorithm = getenv("REMOTE_JOBS_ENV_HASH");
+    env_hash[0] = algorithm != NULL && strcmp(algorithm, "md5") == 0 ? ENV_HASH_MD5 : ENV_HASH_FINGERPRINT;
+    qsort(ienv, ienv_count, sizeof(ichar *), ienv_compare);
+    hash_init(&ctx);
+    for (i = 0; i < ienv_count; i++)
+    {
+        hash_update(&ctx, (uint8_t *)ienv[i], sizeof(ichar) * (istrlen(ienv[i]) + 1));
+    }
+    hash_digest(&ctx, &env_hash[1]);
+}
+
+static bool env_selected(const ichar *env, ichar **selectors, int selectors_count)
+{
+    int i;
+    for (i = 0; i < selectors_count; i++)
+    {
+        size_t len = istrlen(selectors[i]);
+        if (len > 0 && selectors[i][len - 1] == '*')
+        {
+            if (ienvncmp(env, selectors[i], len - 1) == 0)
+            {
+                return true;
+            }
+        }
+        else if (ienvncmp(env, selectors[i], len) == 0 && env[len] == '=')
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Hashes variables matching selectors, selected variables are stored in selected if it is not NULL.
+static int calc_selected_env_hash(ichar **selectors, int selectors_count, const ichar **selected, uint8_t *hash)
+{
+    int i;
+    int selected_count = 0;
+    hash_ctx ctx;
+    // Environment is already sorted by calc_env_hash(), so the subset is sorted too.
+    hash_init(&ctx);
+    for (i = 0; i < ienv_count; i++)
+    {
+        if (env_selected(ienv[i], selectors, selectors_count))
+        {
+            if (selected != NULL)
+            {
+                selected[selected_count] = ienv[i];
+            }
+            selected_count++;
+            hash_update(&ctx, (uint8_t *)ienv[i], sizeof(ichar) * (istrlen(ienv[i]) + 1));
+        }
+    }
+    hash[0] = env_hash[0];
+    hash_digest(&ctx, &hash[1]);
+    return selected_count;
+}
+
+static void send_selected_env()
+{
+    int i;
+    int selected_count;
+    uint8_t selected_hash[sizeof(env_hash)];
+    int selectors_count = recv_int();
+    ichar **selectors = malloc(selectors_count * sizeof(ichar *) + 1);
+    const ichar **selected = malloc(ienv_count * sizeof(ichar *) + 1);
+    test(selectors != NULL && selected != NULL, "Memory allocation failed.");
+
+    for (i = 0; i < selectors_count; i++)
+    {
+        selectors[i] = recv_str();
+    }
+
+    selected_count = calc_selected_env_hash(selectors, selectors_count, selected, selected_hash);
+
+    send_int(sizeof(selected_hash));
+    send_all(selected_hash, sizeof(selected_hash));
+    if (recv_int())
+    {
+        send_int(selected_count);
+        for (i = 0; i < selected_count; i++)
+        {
+            send_str(selected[i]);
+        }
+    }
+
+    for (i = 0; i < selectors_count; i++)
+    {
+        free(selectors[i]);
+    }
+    free(selectors);
+    free(selected);
+}
+
+typedef struct
+{
+    uint64_t hash;
+    int index;
+} env_var_hash;
+
+static int env_var_hash_compare(const void *a, const void *b)
+{
+    uint64_t x = ((const env_var_hash *)a)->hash;
+    uint64_t y = ((const env_var_hash *)b)->hash;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void calc_env_var_hashes(uint64_t *hashes)
+{
+    int i, k;
+    const uint8_t **data = malloc(ienv_count * sizeof(uint8_t *) + 1);
+    size_t *sizes = malloc(ienv_count * sizeof(size_t) + 1);
+    uint8_t *digests = malloc(ienv_count * 16 + 1);
+    test(data != NULL && sizes != NULL && digests != NULL, "Memory allocation failed.");
+    for (i = 0; i < ienv_count; i++)
+    {
+        data[i] = (const uint8_t *)ienv[i];
+        sizes[i] = sizeof(ichar) * (istrlen(ienv[i]) + 1);
+    }
+    hash_multi(data, sizes, ienv_count, digests);
+    for (i = 0; i < ienv_count; i++)
+    {
+        hashes[i] = 0;
+        for (k = 0; k < 8; k++)
+        {
+            hashes[i] |= (uint64_t)digests[16 * i + k] << (8 * k);
+        }
+    }
+    free(data);
+    free(sizes);
+    free(digests);
+}
+
+// Marks base variables that are also in the environment and returns number of bytes
+// needed to send the difference.
+static size_t diff_env(const uint64_t *base, int base_count, const env_var_hash *sorted,
+                       bool *base_found, bool *env_found)
+{
+    int i;
+    size_t size = 0;
+    memset(env_found, 0, ienv_count * sizeof(bool));
+    for (i = 0; i < base_count; i++)
+    {
+        env_var_hash key = {base[i], 0};
+        const env_var_hash *found = bsearch(&key, sorted, ienv_count, sizeof(env_var_hash), env_var_hash_compare);
+        base_found[i] = found != NULL;
+        if (found != NULL)
+        {
+            env_found[found->index] = true;
+        }
+        else
+        {
+            size += sizeof(uint32_t);
+        }
+    }
+    for (i = 0; i < ienv_count; i++)
+    {
+        if (!env_found[i])
+        {
+            size += sizeof(uint64_t) + sizeof(uint32_t) + sizeof(ichar) * istrlen(ienv[i]);
+        }
+    }
+    return size;
+}
+
+static void send_env_delta()
+{
+    int i;
+    int base_count = recv_int();
+    uint64_t **bases = malloc(base_count * sizeof(uint64_t *) + 1);
+    int *bases_sizes = malloc(base_count * sizeof(int) + 1);
+    env_var_hash *sorted = malloc(ienv_count * sizeof(env_var_hash) + 1);
+    bool *env_found = malloc(ienv_count * sizeof(bool) + 1);
+    bool *base_found = NULL;
+    int best = -1;
+    int max_base_size = 0;
+    size_t best_size;
+    uint32_t count;
+    test(bases != NULL && bases_sizes != NULL && sorted != NULL && env_found != NULL, "Memory allocation failed.");
+
+    for (i = 0; i < base_count; i++)
+    {
+        bases_sizes[i] = recv_int();
+        bases[i] = malloc(bases_sizes[i] * sizeof(uint64_t) + 1);
+        test(bases[i] != NULL, "Memory allocation failed.");
+        recv_all(bases[i], bases_sizes[i] * sizeof(uint64_t));
+        max_base_size = MAX(max_base_size, bases_sizes[i]);
+    }
+    base_found = malloc(max_base_size * sizeof(bool) + 1);
+    test(base_found != NULL, "Memory allocation failed.");
+
+    // Per-variable hashes are only needed here, so they are calculated on demand.
+    if (ienv_hashes == NULL)
+    {
+        ienv_hashes = malloc(ienv_count * sizeof(uint64_t) + 1);
+        test(ienv_hashes != NULL, "Memory allocation failed.");
+        calc_env_var_hashes(ienv_hashes);
+    }
+    for (i = 0; i < ienv_count; i++)
+    {
+        sorted[i].hash = ienv_hashes[i];
+        sorted[i].index = i;
+    }
+    qsort(sorted, ienv_count, sizeof(env_var_hash), env_var_hash_compare);
+
+    // Choose the base that gives the smallest difference.
+    best_size = diff_env(NULL, 0, sorted, base_found, env_found);
+    for (i = 0; i < base_count; i++)
+    {
+        size_t size = diff_env(bases[i], bases_sizes[i], sorted, base_found, env_found);
+        if (size < best_size)
+        {
+            best = i;
+            best_size = size;
+        }
+    }
+
+    if (best >= 0)
+    {
+        diff_env(bases[best], bases_sizes[best], sorted, base_found, env_found);
+        send_int(best);
+        for (i = 0, count = 0; i < bases_sizes[best]; i++)
+        {
+            count += !base_found[i];
+        }
+        send_int(count);
+        for (i = 0; i < bases_sizes[best]; i++)
+        {
+            if (!base_found[i])
+            {
+                send_int(i);
+            }
+        }
+    }
+    else
+    {
+        diff_env(NULL, 0, sorted, base_found, env_found);
+        send_int(0xFFFFFFFF);
+        send_int(0);
+    }
+
+    for (i = 0, count = 0; i < ienv_count; i++)
+    {
+        count += !env_found[i];
+    }
+    send_int(count);
+    for (i = 0; i < ienv_count; i++)
+    {
+        if (!env_found[i])
+        {
+            send_all(&ienv_hashes[i], sizeof(uint64_t));
+            send_str(ienv[i]);
+        }
+    }
+
+    for (i = 0; i < base_count; i++)
+    {
+        free(bases[i]);
+    }
+    free(bases);
+    free(bases_sizes);
+    free(sorted);
+    free(env_found);
+    free(base_found);
+}
+
+static void forward_stdin()
+{
+    size_t n = read_stdin(buffer, MIN(stdin_credit, sizeof(buffer)));
+    send_int(n);
+    send_all(buffer, n);
+    // Buffer is reused by other commands, so it cannot stay in the queue.
+    send_flush();
+    stdin_credit -= n;
+    stdin_active = n > 0;
+}
+
+static void read_file_command()
+{
+    uint64_t size = 0;
+    ichar *path = recv_str();
+    uint32_t status = open_file(path, &size);
+    send_int(status);
+    if (status == 0)
+    {
+        send_int64(size);
+        send_int(send_file(size));
+    }
+    free(path);
+}
+
+static void write_file_command()
+{
+    ichar *path = recv_str();
+    uint32_t mode = recv_int();
+    uint64_t size = recv_int64();
+    send_int(recv_file(path, mode, size));
+    free(path);
+}
+
+static void read_file_bulk_command()
+{
+    uint64_t size = 0;
+    uint32_t handle = 0;
+    ichar *path = recv_str();
+    uint32_t threshold = recv_int();
+    uint32_t status = open_file(path, &size);
+    bool bulk = status == 0 && size > threshold && bulk_read_file(&handle);
+    send_int(status);
+    if (status == 0)
+    {
+        send_int64(size);
+        send_int(bulk);
+        if (bulk)
+        {
+            send_int(ipid);
+            send_int(handle);
+        }
+        else
+        {
+            send_int(send_file(size));
+        }
+    }
+    free(path);
+}
+
+static void write_file_bulk_command()
+{
+    uint32_t handle = 0;
+    ichar *path = recv_str();
+    uint32_t mode = recv_int();
+    uint64_t size = recv_int64();
+    uint32_t status = bulk_create_file(path, mode, size, &handle);
+    send_int(status);
+    if (status == 0)
+    {
+        send_int(ipid);
+        send_int(handle);
+        send_int(bulk_finish_file(path, recv_int()));
+    }
+    free(path);
+}
+
+typedef struct
+{
+    ichar *path;
+    uint32_t status;
+    uint64_t size;
+    uint64_t mtime;
+    uint8_t digest[sizeof(env_hash)];
+} file_hash;
+
+typedef struct
+{
+    file_hash *items;
+    int count;
+    int group_size;
+} hash_files_ctx;
+
+// Hashes a group of files. MD5 hashes the whole group at once in SIMD lanes.
+static void hash_files_worker(void *arg, int group)
+{
+    hash_files_ctx *ctx = arg;
+    const uint8_t *data[MD5_MAX_LANES] = {NULL};
+    size_t sizes[MD5_MAX_LANES] = {0};
+    int indexes[MD5_MAX_LANES];
+    uint8_t digests[16 * MD5_MAX_LANES];
+    int end = MIN((group + 1) * ctx->group_size, ctx->count);
+    int mapped = 0;
+    int i;
+    for (i = group * ctx->group_size; i < end; i++)
+    {
+        file_hash *item = &ctx->items[i];
+        memset(item->digest, 0, sizeof(item->digest));
+        item->size = 0;
+        item->mtime = 0;
+        item->status = map_file(item->path, &data[mapped], &item->size, &item->mtime);
+        if (item->status == 0)
+        {
+            sizes[mapped] = item->size;
+            indexes[mapped] = i;
+            mapped++;
+        }
+    }
+    hash_multi(data, sizes, mapped, digests);
+    for (i = 0; i < mapped; i++)
+    {
+        file_hash *item = &ctx->items[indexes[i]];
+        item->digest[0] = env_hash[0];
+        memcpy(&item->digest[1], &digests[16 * i], 16);
+        unmap_file(data[i], sizes[i]);
+    }
+}
+
+// Hashes files in parallel, paths must be set in items.
+static void hash_files(file_hash *items, int count)
+{
+    hash_files_ctx ctx;
+    ctx.items = items;
+    ctx.count = count;
+    ctx.group_size = 1;
+    if (env_hash[0] == ENV_HASH_MD5)
+    {
+        // Kernel is selected before the threads are started.
+        ctx.group_size = md5_lanes_count > 0 ? md5_lanes_count : md5_multi_init(MD5_MAX_LANES);
+    }
+    run_parallel(hash_files_worker, &ctx, (count + ctx.group_size - 1) / ctx.group_size, MAX_HASH_THREADS);
+}
+
+static void hash_files_command()
+{
+    int i;
+    int count = recv_int();
+    file_hash *items = malloc(count * sizeof(file_hash) + 1);
+    test(items != NULL, "Memory allocation failed.");
+    for (i = 0; i < count; i++)
+    {
+        items[i].path = recv_str();
+    }
+    hash_files(items, count);
+    send_int(sizeof(env_hash));
+    for (i = 0; i < count; i++)
+    {
+        send_int(items[i].status);
+        send_int64(items[i].size);
+        send_int64(items[i].mtime);
+        send_all(items[i].digest, sizeof(items[i].digest));
+    }
+    // Queued data points to the items.
+    send_flush();
+    for (i = 0; i < count; i++)
+    {
+        free(items[i].path);
+    }
+    free(items);
+}
+
+static ichar **recv_str_array(uint32_t count)
+{
+    uint32_t i;
+    ichar **array = malloc((count + 1) * sizeof(ichar *));
+    test(array != NULL, "Memory allocation failed.");
+    for (i = 0; i < count; i++)
+    {
+        array[i] = recv_str();
+    }
+    array[count] = NULL;
+    return array;
+}
+
+static void free_str_array(ichar **array)
+{
+    ichar **ptr;
+    for (ptr = array; *ptr != NULL; ptr++)
+    {
+        free(*ptr);
+    }
+    free(array);
+}
+
+static bool jobserver_checked = false;
+static bool jobserver_available = false;
+
+// Opens the jobserver given by the last --jobserver-auth option (--jobserver-fds before GNU make 4.2)
+// in MAKEFLAGS. Words after " -- " are variable definitions, not options.
+static bool jobserver_init()
+{
+    static const char *const options[] = {"--jobserver-auth=", "--jobserver-fds="};
+    char auth[256];
+    const char *ptr = getenv("MAKEFLAGS");
+    const char *end;
+    size_t len;
+    size_t i;
+
+    jobserver_checked = true;
+    auth[0] = 0;
+    while (ptr != NULL && *ptr != 0)
+    {
+        while (*ptr == ' ')
+        {
+            ptr++;
+        }
+        end = strchr(ptr, ' ');
+        if (end == NULL)
+        {
+            end = ptr + strlen(ptr);
+        }
+        len = end - ptr;
+        if (len == 2 && ptr[0] == '-' && ptr[1] == '-')
+        {
+            break;
+        }
+        for (i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+        {
+            size_t option_len = strlen(options[i]);
+            if (len > option_len && len - option_len < sizeof(auth) && strncmp(ptr, options[i], option_len) == 0)
+            {
+                memcpy(auth, ptr + option_len, len - option_len);
+                auth[len - option_len] = 0;
+            }
+        }
+        ptr = end;
+    }
+    return auth[0] != 0 && jobserver_open(auth);
+}
+
+// Takes the jobserver token back before anything runs locally. Make started the stub holding
+// one token, so it must hold it again when it exits.
+static void jobserver_acquire_token()
+{
+    uint64_t start;
+    if (jobserver_released)
+    {
+        jobserver_released = false;
+        start = get_time_ns();
+        jobserver_acquire();
+        trace(TRACE_JOBSERVER, MIN((get_time_ns() - start) / 1000, 0xFFFFFFFF));
+    }
+}
+
+// Gives the jobserver token back to make, so it can start another job while this one runs remotely.
+static void jobserver_release_token()
+{
+    if (!jobserver_checked)
+    {
+        jobserver_available = jobserver_init();
+        if (jobserver_available)
+        {
+            atexit(jobserver_acquire_token);
+        }
+    }
+    if (jobserver_available && !jobserver_released)
+    {
+        jobserver_released = jobserver_release();
+    }
+}
+
+static void phase_command()
+{
+    uint32_t phase = recv_int();
+    if (phase == PHASE_REMOTE)
+    {
+        jobserver_release_token();
+    }
+    else
+    {
+        jobserver_acquire_token();
+    }
+}
+
+static void exec_command()
+{
+    process_result result;
+    ichar **args;
+    ichar **env = NULL;
+    ichar *cwd;
+    uint32_t count;
+    uint32_t error;
+    size_t n;
+    int event;
+
+    test(!stdin_active, "Cannot execute while standard input is forwarded.");
+    count = recv_int();
+    test(count > 0, "Missing program to execute.");
+    args = recv_str_array(count);
+    cwd = recv_str();
+    count = recv_int();
+    if (count != 0xFFFFFFFF)
+    {
+        env = recv_str_array(count);
+    }
+
+    jobserver_acquire_token();
+    memset(&result, 0, sizeof(result));
+    error = process_spawn(args, cwd[0] != 0 ? cwd : NULL, env);
+    if (error == 0)
+    {
+        while ((event = process_wait(buffer, sizeof(buffer), &n)) != PROCESS_EVENT_DONE)
+        {
+            if (event == PROCESS_EVENT_CONTROLLER)
+            {
+                uint32_t cmd = recv_int();
+                test(cmd <= 2 || cmd == 8 || cmd == 14 || cmd == 15 || cmd == 19 || cmd == 20,
+                     "Command not allowed during EXEC.");
+                process_command(cmd);
+                continue;
+            }
+            send_int(event);
+            send_int(n);
+            send_payload(buffer, n);
+        }
+        process_finish(&result);
+    }
+    else
+    {
+        result.status = PROCESS_SPAWN_FAILED;
+    }
+
+    send_int(0);
+    send_int(result.status);
+    send_int(error);
+    send_int64(result.user_time);
+    send_int64(result.system_time);
+    send_int64(result.max_rss);
+    send_int64(result.wall_time);
+
+    free_str_array(args);
+    free(cwd);
+    if (env != NULL)
+    {
+        free_str_array(env);
+    }
+}
+
+// Expanded arguments are kept in the wire format (length followed by bytes) in segments
+// that point into per-file buffers, so they can be sent without copying.
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+} rsp_segment;
+
+typedef struct
+{
+    rsp_segment *segments;
+    uint32_t segments_count;
+    uint32_t segments_capacity;
+    uint8_t **buffers;
+    uint32_t buffers_count;
+    uint32_t buffers_capacity;
+    uint32_t args_count;
+    uint32_t files_count;
+} rsp_state;
+
+typedef struct
+{
+    uint32_t index;
+    uint32_t status;
+    uint32_t args_count;
+    uint32_t first_segment;
+    uint32_t segments_count;
+    size_t size;
+    uint8_t digest[sizeof(env_hash)];
+} rsp_file;
+
+static void *grow_array(void *array, uint32_t *capacity, uint32_t count, size_t item_size)
+{
+    if (count >= *capacity)
+    {
+        *capacity = MAX(16, *capacity * 2);
+        array = realloc(array, *capacity * item_size);
+        test(array != NULL, "Memory allocation failed.");
+    }
+    return array;
+}
+
+static void rsp_add_segment(rsp_state *state, const uint8_t *begin, const uint8_t *end)
+{
+    if (begin < end)
+    {
+        state->segments = grow_array(state->segments, &state->segments_capacity, state->segments_count,
+                                     sizeof(rsp_segment));
+        state->segments[state->segments_count].data = begin;
+        state->segments[state->segments_count].size = end - begin;
+        state->segments_count++;
+    }
+}
+
+static bool is_rsp_space(uint8_t c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+/*
+Splits the response file into arguments the same way as GCC (libiberty's expandargv): arguments
+are separated by whitespace, single and double quotes group characters, backslash escapes any
+following character, nested response files are expanded in place, the ones that cannot be read
+are kept as arguments.
+*/
+static uint32_t expand_response_file(rsp_state *state, const ichar *path)
+{
+    const uint8_t *file_data = NULL;
+    const uint8_t *data;
+    const uint8_t *end;
+    uint64_t size = 0;
+    uint64_t mtime;
+    uint8_t *output;
+    uint8_t *segment;
+    uint32_t status;
+
+    if (state->files_count >= MAX_RESPONSE_FILES)
+    {
+        return RESPONSE_FILES_LOOP_ERROR;
+    }
+    state->files_count++;
+    status = map_file(path, &file_data, &size, &mtime);
+    if (status != 0)
+    {
+        return status;
+    }
+    data = file_data;
+    end = size > 0 ? memchr(data, 0, size) : data;
+    if (end == NULL)
+    {
+        end = data + size;
+    }
+
+    // Each argument takes at least two characters (with a separator) and 4 bytes of length.
+    output = malloc(3 * (end - data) + 8);
+    test(output != NULL, "Memory allocation failed.");
+    state->buffers = grow_array(state->buffers, &state->buffers_capacity, state->buffers_count, sizeof(uint8_t *));
+    state->buffers[state->buffers_count++] = output;
+    segment = output;
+
+    while (1)
+    {
+        uint8_t *arg;
+        uint8_t *arg_begin;
+        bool squote = false;
+        bool dquote = false;
+        bool bsquote = false;
+        uint32_t arg_size;
+
+        while (data < end && is_rsp_space(*data))
+        {
+            data++;
+        }
+        if (data == end)
+        {
+            break;
+        }
+        arg = output;
+        arg_begin = output + sizeof(uint32_t);
+        output = arg_begin;
+        while (data < end && (squote || dquote || bsquote || !is_rsp_space(*data)))
+        {
+            uint8_t c = *data++;
+            if (bsquote)
+            {
+                bsquote = false;
+                *output++ = c;
+            }
+            else if (c == '\\')
+            {
+                bsquote = true;
+            }
+            else if (squote)
+            {
+                if (c == '\'')
+                    squote = false;
+                else
+                    *output++ = c;
+            }
+            else if (dquote)
+            {
+                if (c == '"')
+                    dquote = false;
+                else
+                    *output++ = c;
+            }
+            else if (c == '\'')
+            {
+                squote = true;
+            }
+            else if (c == '"')
+            {
+                dquote = true;
+            }
+            else
+            {
+                *output++ = c;
+            }
+        }
+        arg_size = output - arg_begin;
+        memcpy(arg, &arg_size, sizeof(arg_size));
+        state->args_count++;
+
+        if (arg_size > 0 && arg_begin[0] == '@')
+        {
+            ichar *nested_path;
+            // Terminator is overwritten by the next argument.
+            *output = 0;
+            nested_path = str_from_utf8((const char *)&arg_begin[1]);
+            rsp_add_segment(state, segment, arg);
+            segment = arg;
+            state->args_count--;
+            status = expand_response_file(state, nested_path);
+            free(nested_path);
+            if (status == RESPONSE_FILES_LOOP_ERROR)
+            {
+                break;
+            }
+            else if (status == 0)
+            {
+                output = arg;
+            }
+            else
+            {
+                state->args_count++;
+                status = 0;
+            }
+        }
+    }
+
+    rsp_add_segment(state, segment, output);
+    unmap_file(file_data, size);
+    return status;
+}
+
+static void response_files_command()
+{
+    uint32_t include_args = recv_int();
+    uint32_t count = 0;
+    rsp_state state;
+    rsp_file *files;
+    hash_ctx hash;
+    uint32_t i;
+    uint32_t k;
+
+    memset(&state, 0, sizeof(state));
+    files = malloc(iarg_count * sizeof(rsp_file) + 1);
+    test(files != NULL, "Memory allocation failed.");
+    for (i = 1; i < (uint32_t)iarg_count; i++)
+    {
+        rsp_file *file = &files[count];
+        if (iarg[i][0] != '@')
+        {
+            continue;
+        }
+        count++;
+        file->index = i;
+        file->first_segment = state.segments_count;
+        state.args_count = 0;
+        state.files_count = 0;
+        file->status = expand_response_file(&state, &iarg[i][1]);
+        file->size = 0;
+        for (k = file->first_segment; file->status == 0 && k < state.segments_count; k++)
+        {
+            file->size += state.segments[k].size;
+        }
+        if (file->status == 0 && (uint64_t)file->size > UINT32_MAX)
+        {
+            // Size of the expanded arguments is sent as 32 bits.
+            file->status = RESPONSE_FILES_SIZE_ERROR;
+        }
+        if (file->status != 0)
+        {
+            state.segments_count = file->first_segment;
+            state.args_count = 0;
+            file->size = 0;
+        }
+        file->args_count = state.args_count;
+        file->segments_count = state.segments_count - file->first_segment;
+        memset(file->digest, 0, sizeof(file->digest));
+        if (file->status == 0)
+        {
+            file->digest[0] = env_hash[0];
+            hash_init(&hash);
+            for (k = file->first_segment; k < state.segments_count; k++)
+            {
+                hash_update(&hash, state.segments[k].data, state.segments[k].size);
+            }
+            hash_digest(&hash, &file->digest[1]);
+        }
+    }
+
+    send_int(sizeof(env_hash));
+    send_int(count);
+    for (i = 0; i < count; i++)
+    {
+        send_int(files[i].index);
+        send_int(files[i].status);
+        send_all(files[i].digest, sizeof(files[i].digest));
+        if (include_args && files[i].status == 0)
+        {
+            send_int(files[i].args_count);
+            send_int(files[i].size);
+            for (k = 0; k < files[i].segments_count; k++)
+            {
+                send_all(state.segments[files[i].first_segment + k].data,
+                         state.segments[files[i].first_segment + k].size);
+            }
+        }
+    }
+    // Queued data points to the buffers.
+    send_flush();
+
+    for (i = 0; i < state.buffers_count; i++)
+    {
+        free(state.buffers[i]);
+    }
+    free(state.buffers);
+    free(state.segments);
+    free(files);
+}
+
+static void write_output_vec_all(int fd, io_vec *vec, int count)
+{
+    while (count > 0)
     {
-        fatal(message);
+        size_t n = write_output_vec(fd, vec, count);
+        while (count > 0 && n >= vec->iov_len)
+        {
+            n -= vec->iov_len;
+            vec++;
+            count--;
+        }
+        if (n > 0)
+        {
+            vec->iov_base = (uint8_t *)vec->iov_base + n;
+            vec->iov_len -= n;
+        }
     }
 }
 
-static void send_all(const void *data, size_t size)
+static void write_batch_command()
 {
-    const uint8_t *ptr = (const uint8_t *)data;
-    while (size > 0)
+    static io_vec vec[WRITE_BATCH_MAX_SEGMENTS];
+    uint32_t count = recv_int();
+    uint32_t size = recv_int();
+    uint32_t headers_size = 2 * sizeof(uint32_t) * count;
+    uint8_t *data = buffer + headers_size;
+    uint8_t *end;
+    uint32_t i = 0;
+
+    test(count > 0 && count <= WRITE_BATCH_MAX_SEGMENTS && size <= sizeof(buffer) - headers_size,
+         "Invalid write batch.");
+    // Segment headers and data are received together, so the whole batch takes one call.
+    recv_all(buffer, headers_size + size);
+    end = data + size;
+    while (i < count)
     {
-        size_t n = send_part(ptr, size);
-        size -= n;
-        ptr += n;
+        uint32_t fd;
+        int vec_count = 0;
+        memcpy(&fd, &buffer[8 * i], sizeof(fd));
+        test(fd == 1 || fd == 2, "Invalid write batch.");
+        // Consecutive segments of the same stream are written at once, order of streams is kept.
+        while (i < count)
+        {
+            uint32_t segment_fd;
+            uint32_t length;
+            memcpy(&segment_fd, &buffer[8 * i], sizeof(segment_fd));
+            memcpy(&length, &buffer[8 * i + 4], sizeof(length));
+            if (segment_fd != fd)
+            {
+                break;
+            }
+            test(length <= (size_t)(end - data), "Invalid write batch.");
+            if (length > 0)
+            {
+                vec[vec_count].iov_base = data;
+                vec[vec_count].iov_len = length;
+                vec_count++;
+            }
+            data += length;
+            i++;
+        }
+        write_output_vec_all(fd, vec, vec_count);
     }
+    test(data == end, "Invalid write batch.");
 }
 
-static void send_int(uint32_t value)
+static void log_syscall_count()
 {
-    send_all(&value, sizeof(value));
+    FILE *f;
+    const char *path = getenv("REMOTE_JOBS_SYSCALL_LOG");
+    if (path == NULL || path[0] == 0)
+    {
+        return;
+    }
+    f = fopen(path, "a");
+    if (f != NULL)
+    {
+        fprintf(f, "%u %s\n", syscall_count, program_name);
+        fclose(f);
+    }
 }
 
-static void recv_all(void *data, size_t size)
+static void write_metrics_string(FILE *f, const char *str, bool csv)
 {
-    uint8_t *ptr = data;
-    while (size > 0)
+    fputc('"', f);
+    for (; *str != 0; str++)
     {
-        size_t n = recv_part(ptr, size);
-        size -= n;
-        ptr += n;
+        if (*str == '"')
+        {
+            fputs(csv ? "\"\"" : "\\\"", f);
+        }
+        else if (!csv && (*str == '\\' || (uint8_t)*str < 0x20))
+        {
+            fprintf(f, "\\u%04x", (uint8_t)*str);
+        }
+        else
+        {
+            fputc(*str, f);
+        }
     }
+    fputc('"', f);
 }
 
-static uint32_t recv_int()
+// Appends one line with resource usage of this invocation to the REMOTE_JOBS_METRICS file,
+// CSV if its name ends with ".csv", JSON otherwise. Remote metrics are empty (null) if the
+// controller did not send them.
+static void write_metrics(uint32_t status, const uint64_t *metrics)
 {
-    uint32_t result;
-    recv_all(&result, sizeof(result));
+    static const char *names[] = {
+        "status", "pid", "stub_wall_us", "stub_user_us", "stub_system_us", "stub_max_rss_kb", "stub_syscalls",
+        "queue_us", "remote_wall_us", "remote_user_us", "remote_system_us",
+    };
+    uint64_t values[sizeof(names) / sizeof(names[0])];
+    process_result usage;
+    const char *path = getenv("REMOTE_JOBS_METRICS");
+    size_t path_len;
+    size_t i;
+    bool csv;
+    FILE *f;
+
+    if (path == NULL || path[0] == 0)
+    {
+        return;
+    }
+    memset(&usage, 0, sizeof(usage));
+    get_self_usage(&usage);
+    values[0] = status;
+    values[1] = ipid;
+    values[2] = (get_time_ns() - start_time) / 1000;
+    values[3] = usage.user_time;
+    values[4] = usage.system_time;
+    values[5] = usage.max_rss;
+    values[6] = syscall_count;
+    if (metrics != NULL)
+    {
+        values[7] = metrics[METRIC_QUEUE_TIME] / 1000;
+        values[8] = metrics[METRIC_WALL_TIME] / 1000;
+        values[9] = metrics[METRIC_USER_TIME];
+        values[10] = metrics[METRIC_SYSTEM_TIME];
+    }
+
+    path_len = strlen(path);
+    csv = path_len >= 4 && strcmp(&path[path_len - 4], ".csv") == 0;
+    f = fopen(path, "a");
+    if (f == NULL)
+    {
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    if (csv && ftell(f) == 0)
+    {
+        fputs("tool", f);
+        for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        {
+            fprintf(f, ",%s", names[i]);
+        }
+        fputc('\n', f);
+    }
+    if (!csv)
+    {
+        fputs("{\"tool\":", f);
+    }
+    write_metrics_string(f, program_name, csv);
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        fputc(',', f);
+        if (!csv)
+        {
+            fprintf(f, "\"%s\":", names[i]);
+        }
+        if (i < 7 || metrics != NULL)
+        {
+            fprintf(f, "%llu", (unsigned long long)values[i]);
+        }
+        else if (!csv)
+        {
+            fputs("null", f);
+        }
+    }
+    fputs(csv ? "\n" : "}\n", f);
+    fclose(f);
+}
+
+static void exit_command(bool with_metrics)
+{
+    uint64_t metrics[METRICS_COUNT];
+    uint32_t status = recv_int();
+    uint32_t count;
+    uint32_t i;
+    if (with_metrics)
+    {
+        memset(metrics, 0, sizeof(metrics));
+        count = recv_int();
+        for (i = 0; i < count; i++)
+        {
+            uint64_t value = recv_int64();
+            if (i < METRICS_COUNT)
+            {
+                metrics[i] = value;
+            }
+        }
+    }
+    disconnect_from_controller();
+    log_syscall_count();
+    write_metrics(status, with_metrics ? metrics : NULL);
+    exit(status);
+}
+
+static void process_command(uint32_t cmd)
+{
+    size_t len;
+    int i;
+
+    trace(TRACE_COMMAND, cmd);
+    switch (cmd)
+    {
+    case 0:
+        exit_command(false);
+        break;
+    case 1:
+    case 2:
+        len = recv_int();
+        while (len > 0)
+        {
+            size_t chunk_len = splice_output(cmd, len);
+            if (chunk_len > 0)
+            {
+                len -= chunk_len;
+                continue;
+            }
+            chunk_len = recv_part(buffer, MIN(len, sizeof(buffer)));
+            write_output_all(cmd, buffer, chunk_len);
+            len -= chunk_len;
+        }
+        break;
+    case 3:
+        send_int(ienv_count);
+        for (i = 0; i < ienv_count; i++)
+        {
+            send_str(ienv[i]);
+        }
+        break;
+    case 4:
+        len = attach_stdio_handles();
+        send_int(ipid);
+        send_int(len);
+        break;
+    case 5:
+        send_selected_env();
+        break;
+    case 6:
+        send_env_delta();
+        break;
+    case 7:
+        stdin_credit = recv_int();
+        stdin_active = true;
+        break;
+    case 8:
+        stdin_credit += recv_int();
+        break;
+    case 9:
+        read_file_command();
+        break;
+    case 10:
+        write_file_command();
+        break;
+    case 11:
+        hash_files_command();
+        break;
+    case 12:
+        exec_command();
+        break;
+    case 13:
+        i = recv_int();
+        compression_threshold = recv_int();
+        compression = i == COMPRESSION_LZ4 ? COMPRESSION_LZ4 : COMPRESSION_NONE;
+        send_int(compression);
+        break;
+    case 14:
+    case 15:
+        len = recv_int();
+        while (len > 0)
+        {
+            size_t chunk_len = recv_block(len);
+            write_output_all(cmd - 13, buffer, chunk_len);
+            len -= chunk_len;
+        }
+        break;
+    case 16:
+        send_trace();
+        break;
+    case 17:
+        // Controller should send BUSY before anything observable happens.
+        disconnect_from_controller();
+        jobserver_acquire_token();
+        run_local_tool();
+        fatal("Controller is busy and the local tool cannot be started.");
+        break;
+    case 18:
+        response_files_command();
+        break;
+    case 19:
+        write_batch_command();
+        break;
+    case 20:
+        exit_command(true);
+        break;
+    case 21:
+        phase_command();
+        break;
+    case 22:
+        read_file_bulk_command();
+        break;
+    case 23:
+        write_file_bulk_command();
+        break;
+    default:
+        fatal("Controller version mismatch.");
+    }
+    trace(TRACE_COMMAND_END, cmd);
+}
+
+typedef struct
+{
+    const uint8_t *ptr;
+    const uint8_t *end;
+    bool valid;
+} cache_reader;
+
+// Returns the next size bytes of the record, NULL if it is truncated.
+static const uint8_t *cache_read(cache_reader *reader, uint64_t size)
+{
+    const uint8_t *result = reader->ptr;
+    if (!reader->valid || (uint64_t)(reader->end - reader->ptr) < size)
+    {
+        reader->valid = false;
+        return NULL;
+    }
+    reader->ptr += size;
     return result;
 }
 
-static int ienv_compare(const void *a, const void *b)
+static uint32_t cache_read_int(cache_reader *reader)
 {
-    return istrcmp(a, b);
+    uint32_t value = 0;
+    const uint8_t *data = cache_read(reader, sizeof(value));
+    if (data != NULL)
+    {
+        memcpy(&value, data, sizeof(value));
+    }
+    return value;
 }
 
-static void calc_env_hash()
+static ichar *cache_read_str(cache_reader *reader)
+{
+    uint32_t len = cache_read_int(reader);
+    const uint8_t *data = cache_read(reader, len);
+    char *str;
+    ichar *result;
+    if (data == NULL)
+    {
+        return NULL;
+    }
+    str = malloc(len + 1);
+    test(str != NULL, "Memory allocation failed.");
+    memcpy(str, data, len);
+    str[len] = '\0';
+    result = str_from_utf8(str);
+    free(str);
+    return result;
+}
+
+// Returns a NULL-terminated array, it ends early if the record is truncated.
+static ichar **cache_read_str_array(cache_reader *reader, uint32_t count)
+{
+    uint32_t i;
+    ichar **array;
+    // Each string takes at least 4 bytes, so a damaged count does not allocate too much.
+    if ((uint64_t)(reader->end - reader->ptr) / 4 < count)
+    {
+        reader->valid = false;
+        count = 0;
+    }
+    array = malloc((count + 1) * sizeof(ichar *));
+    test(array != NULL, "Memory allocation failed.");
+    for (i = 0; i < count; i++)
+    {
+        if ((array[i] = cache_read_str(reader)) == NULL)
+        {
+            break;
+        }
+    }
+    array[i] = NULL;
+    return array;
+}
+
+static ichar *cache_path(const char *dir, const char *name)
 {
+    ichar *result;
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    test(path != NULL, "Memory allocation failed.");
+    sprintf(path, "%s/%s", dir, name);
+    result = str_from_utf8(path);
+    free(path);
+    return result;
+}
+
+static ichar *cache_blob_path(const char *dir, const uint8_t *id)
+{
+    char name[6 + 32 + 1];
     int i;
+    strcpy(name, "blobs/");
+    for (i = 0; i < 16; i++)
+    {
+        sprintf(&name[6 + 2 * i], "%02x", id[i]);
+    }
+    return cache_path(dir, name);
+}
+
+// Index key is MD5 of the arguments and cwd, each with its terminating null character.
+static void cache_key(uint8_t *key)
+{
     md5_ctx ctx;
-    qsort(ienv, ienv_count, sizeof(ichar *), ienv_compare);
+    int i;
     md5_init(&ctx);
-    for (i = 0; i < ienv_count; i++)
+    for (i = 0; i < iarg_count; i++)
+    {
+        md5_update(&ctx, (const uint8_t *)iarg[i], sizeof(ichar) * (istrlen(iarg[i]) + 1));
+    }
+    md5_update(&ctx, (const uint8_t *)icwd, sizeof(ichar) * (istrlen(icwd) + 1));
+    md5_digest(&ctx, key);
+}
+
+// Finds an entry with the key and returns it with its record id. The controller writes entries
+// without locking, so torn ones are detected with the check field and treated as missing.
+static uint8_t *cache_find(uint8_t *index, uint64_t index_size, const uint8_t *key, uint8_t *record_id)
+{
+    uint32_t magic;
+    uint32_t slots;
+    uint32_t first;
+    uint32_t i;
+    uint8_t entry[40];
+    uint8_t digest[16];
+    md5_ctx ctx;
+    if (index_size < CACHE_HEADER_SIZE)
+    {
+        return NULL;
+    }
+    memcpy(&magic, &index[0], 4);
+    memcpy(&slots, &index[4], 4);
+    if (magic != CACHE_INDEX_MAGIC || slots == 0 || (index_size - CACHE_HEADER_SIZE) / CACHE_ENTRY_SIZE < slots)
+    {
+        return NULL;
+    }
+    memcpy(&first, key, 4);
+    for (i = 0; i < CACHE_PROBE_LENGTH; i++)
+    {
+        uint8_t *ptr = &index[CACHE_HEADER_SIZE + (uint64_t)((first % slots + i) % slots) * CACHE_ENTRY_SIZE];
+        memcpy(entry, ptr, sizeof(entry));
+        if (memcmp(entry, key, 16) != 0)
+        {
+            continue;
+        }
+        md5_init(&ctx);
+        md5_update(&ctx, entry, sizeof(entry));
+        md5_digest(&ctx, digest);
+        if (memcmp(digest, &ptr[40], 8) == 0)
+        {
+            memcpy(record_id, &entry[16], 16);
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+static bool cache_check_env(cache_reader *reader)
+{
+    uint8_t hash[sizeof(env_hash)];
+    uint32_t hash_len = cache_read_int(reader);
+    const uint8_t *expected = cache_read(reader, hash_len);
+    uint32_t count = cache_read_int(reader);
+    ichar **selectors = cache_read_str_array(reader, count);
+    bool valid = reader->valid && hash_len == sizeof(hash);
+    if (valid)
+    {
+        calc_selected_env_hash(selectors, count, NULL, hash);
+        valid = memcmp(hash, expected, sizeof(hash)) == 0;
+    }
+    free_str_array(selectors);
+    return valid;
+}
+
+static bool cache_check_inputs(cache_reader *reader)
+{
+    uint32_t i;
+    uint32_t count = cache_read_int(reader);
+    const uint8_t **expected;
+    file_hash *items;
+    bool valid;
+    // Each input takes at least 8 bytes.
+    if ((uint64_t)(reader->end - reader->ptr) / 8 < count)
+    {
+        return false;
+    }
+    items = malloc(count * sizeof(file_hash) + 1);
+    expected = malloc(count * sizeof(uint8_t *) + 1);
+    test(items != NULL && expected != NULL, "Memory allocation failed.");
+    for (i = 0; i < count; i++)
+    {
+        items[i].path = cache_read_str(reader);
+        if (cache_read_int(reader) != sizeof(items[i].digest))
+        {
+            reader->valid = false;
+        }
+        expected[i] = cache_read(reader, sizeof(items[i].digest));
+        if (!reader->valid)
+        {
+            free(items[i].path);
+            break;
+        }
+    }
+    count = i;
+    valid = reader->valid;
+    if (valid)
+    {
+        hash_files(items, count);
+    }
+    for (i = 0; i < count; i++)
+    {
+        valid = valid && items[i].status == 0 && memcmp(items[i].digest, expected[i], sizeof(items[i].digest)) == 0;
+        free(items[i].path);
+    }
+    free(items);
+    free(expected);
+    return valid;
+}
+
+static bool cache_write_outputs(const char *dir, cache_reader *reader)
+{
+    uint32_t i;
+    uint32_t count = cache_read_int(reader);
+    for (i = 0; i < count; i++)
+    {
+        ichar *path = cache_read_str(reader);
+        uint32_t mode = cache_read_int(reader);
+        const uint8_t *id = cache_read(reader, 16);
+        ichar *blob_path;
+        uint32_t error;
+        if (!reader->valid)
+        {
+            free(path);
+            return false;
+        }
+        blob_path = cache_blob_path(dir, id);
+        error = copy_file(blob_path, path, mode);
+        free(blob_path);
+        free(path);
+        if (error != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks the record against the environment and the input files, then writes its outputs and
+// replays its standard output and error. Returns false if the record does not match or an output
+// cannot be written (e.g. the controller has just evicted it), outputs may be partially written.
+static bool cache_replay(const char *dir, const uint8_t *record_id, uint32_t *status)
+{
+    const uint8_t *data = NULL;
+    const uint8_t *output;
+    uint64_t size = 0;
+    uint64_t mtime;
+    uint8_t digest[16];
+    uint32_t magic;
+    uint32_t len;
+    cache_reader reader;
+    md5_ctx ctx;
+    ichar *path = cache_blob_path(dir, record_id);
+    uint32_t error = map_file(path, &data, &size, &mtime);
+    free(path);
+    if (error != 0)
+    {
+        return false;
+    }
+    // Records are content-addressed, so a damaged or partially written one is never used.
+    md5_init(&ctx);
+    md5_update(&ctx, data, size);
+    md5_digest(&ctx, digest);
+    reader.ptr = data;
+    reader.end = data + size;
+    reader.valid = memcmp(digest, record_id, sizeof(digest)) == 0;
+    magic = cache_read_int(&reader);
+    *status = cache_read_int(&reader);
+    if (magic != CACHE_RECORD_MAGIC || !cache_check_env(&reader) || !cache_check_inputs(&reader) ||
+        !cache_write_outputs(dir, &reader))
+    {
+        unmap_file(data, size);
+        return false;
+    }
+    len = cache_read_int(&reader);
+    if ((output = cache_read(&reader, len)) != NULL)
+    {
+        write_output_all(1, output, len);
+    }
+    len = cache_read_int(&reader);
+    if ((output = cache_read(&reader, len)) != NULL)
+    {
+        write_output_all(2, output, len);
+    }
+    unmap_file(data, size);
+    return true;
+}
+
+// Exits with the recorded status if the job is in the local cache.
+static void cache_lookup()
+{
+    const char *dir = getenv("REMOTE_JOBS_CACHE");
+    uint8_t key[16];
+    uint8_t record_id[16];
+    uint8_t *index = NULL;
+    uint64_t index_size = 0;
+    uint8_t *entry;
+    uint32_t status = 0;
+    bool hit = false;
+    ichar *path;
+    if (dir == NULL || dir[0] == '\0')
+    {
+        return;
+    }
+    cache_key(key);
+    path = cache_path(dir, "index");
+    if (map_file_shared(path, &index, &index_size) == 0)
+    {
+        entry = cache_find(index, index_size, key, record_id);
+        if (entry != NULL && cache_replay(dir, record_id, &status))
+        {
+            // Last use for the LRU eviction done by the controller.
+            uint64_t clock = __atomic_add_fetch((uint64_t *)&index[8], 1, __ATOMIC_RELAXED);
+            __atomic_store_n((uint64_t *)&entry[48], clock, __ATOMIC_RELAXED);
+            hit = true;
+        }
+        unmap_file(index, index_size);
+    }
+    free(path);
+    trace(TRACE_CACHE, hit);
+    if (hit)
     {
-        md5_update(&ctx, (uint8_t *)ienv[i], sizeof(ichar) * (istrlen(ienv[i]) + 1));
+        log_syscall_count();
+        write_metrics(status, NULL);
+        exit(status);
     }
-    md5_digest(&ctx, env_hash);
 }
 
 int main(int argc, char *argv[])
 {
-    size_t len;
     int i;
+    uint32_t cmd;
 
+    program_name = argv[0];
+    start_time = get_time_ns();
+    trace_enabled = getenv("REMOTE_JOBS_TRACE") != NULL;
+    trace(TRACE_START, 0);
     get_process_info(argc, argv);
+    trace(TRACE_PROCESS_INFO, 0);
     calc_env_hash();
+    trace(TRACE_ENV_HASH, 0);
+    cache_lookup();
 
-    connect_to_controller();
+    if (!connect_to_controller())
+    {
+        run_local_tool();
+        fatal("Cannot connect to controller.");
+    }
+    install_cancel_handlers();
+    trace(TRACE_CONNECT, 0);
 
-    send_int(0x7F4A9400);
+    send_int(PROTOCOL_MAGIC | PROTOCOL_VERSION);
     send_int(iarg_count);
     for (i = 0; i < iarg_count; i++)
     {
@@ -90,46 +1918,137 @@ int main(int argc, char *argv[])
     send_str(icwd);
     send_int(sizeof(env_hash));
     send_all(env_hash, sizeof(env_hash));
+    if (trace_enabled)
+    {
+        // Sent separately from the first receive, so the trace shows how long the controller took.
+        // Otherwise the handshake goes out with the first receive.
+        send_flush();
+        trace(TRACE_HANDSHAKE, 0);
+    }
 
     while (1)
     {
-        uint32_t cmd = recv_int();
-        switch (cmd)
-        {
-        case 0:
-            i = recv_int();
-            disconnect_from_controller();
-            return i;
-        case 1:
-        case 2:
-            len = recv_int();
-            while (len > 0)
-            {
-                size_t chunk_len = recv_part(buffer, MIN(len, sizeof(buffer)));
-                uint8_t *ptr = buffer;
-                while (chunk_len > 0)
-                {
-                    int n = write_output(cmd, ptr, chunk_len);
-                    ptr += n;
-                    chunk_len -= n;
-                    len -= n;
-                }
-            }
-            break;
-        case 3:
-            send_int(ienv_count);
-            for (i = 0; i < ienv_count; i++)
-            {
-                send_str(ienv[i]);
-            }
-            break;
-        default:
-            fatal("Controller version mismatch.");
+        if (stdin_active && stdin_credit > 0 && wait_for_stdin())
+        {
+            forward_stdin();
+            continue;
         }
+        trace(TRACE_WAIT, 0);
+        cmd = recv_int();
+        clear_handshake_timeout();
+        process_command(cmd);
     }
 }
 
 /*
+Connection:
+
+The stub reaches the controller in the first of the following ways that works:
+1. REMOTE_JOBS_FD contains a number of an inherited, already connected stream socket (a pipe
+   handle on Windows). The variable is removed, so programs started by EXEC do not see it.
+   Use the same number in every invocation, because the variable is part of the environment hash.
+2. Linux only: abstract socket "\0RemJobs75oKmnN7rWX/<id>S", no file system access is needed.
+   Abstract names have no permissions, so the connection is used only if the controller runs
+   as the same user (SO_PEERCRED).
+3. Path "/tmp/RemJobs75oKmnN7rWX/<id>S" with the client bound to "/tmp/RemJobs75oKmnN7rWX/<id>C<pid>"
+   (on Windows: pipe "\\.\pipe\RemJobs75oKmnN7rWX.<id>").
+The <id> is taken from REMOTE_JOBS_CONNECTION_ID, "0" by default.
+REMOTE_JOBS_CONNECT_TIMEOUT limits time spent waiting for a busy controller (milliseconds, 0 - no limit).
+On Unix, the limit covers connecting and waiting for the first command. When it expires,
+the tool runs locally.
+
+Local execution:
+
+If the controller cannot be reached or it sends the BUSY command, the stub runs the real tool
+locally with the same arguments, environment and standard streams. The real tool is an executable
+with the same name as the stub (argv[0] without directory) found in directories listed in
+REMOTE_JOBS_LOCAL_PATH or, if it is not set, in PATH. The stub itself is skipped. If no tool
+is found, the stub exits with status 99.
+
+Cancellation (since version 15):
+
+When the stub gets SIGINT, SIGTERM or SIGHUP (e.g. Ctrl-C or a build killed by CI), it forwards
+the signal to the program started by EXEC, shuts down the sending direction of the connection and
+waits up to REMOTE_JOBS_CANCEL_TIMEOUT milliseconds (500 by default) for the controller to close
+the connection. Then it is terminated by the same signal. A controller that sees the end of the
+stream before it sent EXIT should treat the job as cancelled, stop any work done for it and close
+the connection. Signals ignored by the parent stay ignored. On Windows, the pipe is closed when
+the process is terminated by a console control event.
+
+Jobserver (since version 16):
+
+Under "make -jN", the stub holds one of N job slots for its whole life, even when it only waits
+for the controller. When the controller sends PHASE with the remote phase, the stub gives its
+token back to the GNU make jobserver found in MAKEFLAGS (--jobserver-auth with a fifo, a pair of
+descriptors or a semaphore on Windows, or --jobserver-fds of older make), so make can start
+another job. The stub takes a token again (waiting for it if needed) before a local EXEC, before
+it runs the local tool after BUSY, on the PHASE command with the local phase and before it exits.
+When cancelled by a signal, it takes a token only if one is free at once (Linux and fifo only).
+Make before 4.4 passes the descriptors only to recipe lines marked with '+'. Without a usable
+jobserver, PHASE does nothing.
+
+Metrics:
+
+If REMOTE_JOBS_METRICS contains a file name, the stub appends one line to it when it exits with
+the EXIT or EXIT_METRICS command: CSV if the name ends with ".csv" (a header is written to an empty
+file), JSON otherwise. The line contains the tool name (argv[0]), exit status, stub's pid, stub's
+own wall time, CPU time, peak resident set size and number of system calls, and metrics sent by the
+controller with EXIT_METRICS (empty or null after EXIT): queue time, remote wall time and remote
+CPU time. Times are in microseconds.
+
+Local cache (since version 18):
+
+If REMOTE_JOBS_CACHE contains a directory, the stub looks for the job in a cache stored there before
+it connects to the controller. On a hit, it writes the recorded output files, replays the recorded
+standard output and error and exits with the recorded status without connecting. The controller
+populates the cache and evicts entries from it, the stub only reads it and marks entries as used.
+All numbers are little-endian. The directory contains:
+
+"index" - hash table mapped by the stubs:
+    Offset  Bytes  Description
+    0           4  magic, 0x7F4A9501 (format version at lower 8 bits)
+    4           4  slots, number of entries
+    8           8  clock, incremented atomically by stubs on each hit
+    16         48  reserved
+    64   64 * N    entries:
+        0      16  key, MD5 of the arguments and the cwd, each with its terminating null character,
+                   in the stub's encoding (UTF-8, UTF-16LE on Windows), as sent in the handshake
+        16     16  record, MD5 of the record blob
+        32      8  size, total size of the record and its output blobs (for the controller)
+        40      8  check, the first 8 bytes of MD5 of bytes 0-39, entries with other value are ignored
+        48      8  used, value of clock at the last hit, written by stubs
+        56      8  reserved
+    An entry with the key may be in one of the CACHE_PROBE_LENGTH (8) slots starting at
+    (first 4 bytes of key as integer) % slots. The controller writes each entry with a single write,
+    torn entries seen by stubs fail the check and are treated as missing.
+"blobs/<hex MD5 of the content>" - content-addressed files: records and output files. The controller
+    creates them with a temporary name and renames, so they are always complete.
+
+Record blob:
+    4   magic        0x7F4A9601 (format version at lower 8 bits)
+    4   status       exit status
+    4   hash_len     number of bytes in the environment hash
+    N   hash         hash of selected variables, as returned by ENV_SELECT
+    4   count        number of selectors, each is 4 bytes length and UTF-8 string as in ENV_SELECT
+    4   count        number of input files, each:
+        4   path_len     number of bytes in the path
+        N   path         UTF-8 file path, relative paths are relative to the cwd
+        4   hash_len     number of bytes in the hash
+        N   hash         file hash, as returned by HASH_FILES
+    4   count        number of output files, each:
+        4   path_len     number of bytes in the path
+        N   path         UTF-8 file path, relative paths are relative to the cwd
+        4   mode         file permissions, umask is applied
+        16  blob         MD5 of the file content, name of its blob
+    4   stdout_len   number of bytes in standard output
+    N   stdout       standard output
+    4   stderr_len   number of bytes in standard error
+    N   stderr       standard error
+The job is a hit if the environment hash and hashes of all input files match, so REMOTE_JOBS_ENV_HASH
+must be the same as when the record was made. Output files are copied from their blobs with reflink
+or copy_file_range() where the file system supports it. If a blob is missing, the job is sent to
+the controller as usual.
+
 Communication protocol:
 
 Direction  Bytes  Name        Description
@@ -143,6 +2062,9 @@ OUT           4   cwd_len      number of bytes in current working directory path
 OUT           N   cwd          current working directory (not null-terminated)
 OUT           4   env_hash_len number of bytes in environment variables hash
 OUT           N   env_hash     environment variables hash (its up to stub program how to calculated it)
+                               Since version 2, the first byte identifies the hash algorithm (1 - MD5,
+                               2 - fingerprint.h) and the digest follows it. Controller should treat it
+                               as an opaque key. Algorithm is selected by REMOTE_JOBS_ENV_HASH=md5|fingerprint.
 Command exchange starts here.
 
 Command "EXIT":
@@ -161,7 +2083,250 @@ Repeat for each variable:
     OUT       4   env_len[]    number of bytes in environment variable string
     OUT       N   env[]        string containing environment variable (not null-terminated)
 
+Command "STDIO" (since version 1):
+IN            4   cmd          Pass stdin, stdout and stderr descriptors to the controller (cmd=4)
+OUT           4   pid          Process id of the stub
+OUT           4   count        Number of descriptors attached to this reply, 0 if not supported. If non-zero,
+                               descriptors 0, 1 and 2 are attached as SCM_RIGHTS ancillary data. The controller
+                               may then write output directly to them instead of using STDOUT/STDERR commands.
+                               Controllers that cannot receive ancillary data may open /proc/<pid>/fd/<n>.
+
+Command "ENV_SELECT" (since version 3):
+IN            4   cmd          Get selected environment variables command (cmd=5)
+IN            4   count        Number of selectors
+Repeat for each selector:
+    IN        4   sel_len[]    number of bytes in selector
+    IN        N   sel[]        variable name or, if it ends with '*', variable name prefix
+                               (case-insensitive on Windows)
+OUT           4   hash_len     number of bytes in the hash of selected variables
+OUT           N   hash         hash of selected variables, same format as env_hash
+IN            4   send_values  non-zero if controller needs the variables (e.g. hash is not in its cache)
+If send_values is non-zero:
+    OUT       4   count        Number of selected environment variables
+    Repeat for each variable:
+        OUT   4   env_len[]    number of bytes in environment variable string
+        OUT   N   env[]        string containing environment variable (not null-terminated)
+
+Command "ENV_DELTA" (since version 4):
+IN            4   cmd          Get environment as a difference against a known environment (cmd=6)
+IN            4   base_count   Number of base environments offered by the controller (may be 0)
+Repeat for each base:
+    IN        4   var_count    Number of variables in the base
+    IN    8 * N   var_hash[]   Per-variable hashes of the base, as previously sent by a stub
+OUT           4   base         Index of the chosen base, 0xFFFFFFFF if none (all variables are added)
+OUT           4   removed      Number of base variables not present in the environment
+OUT       4 * N   removed[]    Indexes of removed variables in the base
+OUT           4   added        Number of variables not present in the base
+Repeat for each added variable:
+    OUT       8   var_hash     Per-variable hash of the variable
+    OUT       4   env_len      number of bytes in environment variable string
+    OUT       N   env          string containing environment variable (not null-terminated)
+Changed variables are sent as removed and added. Per-variable hashes are opaque 64-bit values
+calculated by the stub with the same algorithm as env_hash.
+
+Command "STDIN" (since version 5):
+IN            4   cmd          Start forwarding standard input (cmd=7)
+IN            4   window       Number of bytes that stub may send before it gets more credit
+After this command, the stub sends input frames whenever its standard input has data and there
+is credit left. Until the final frame, controller may only send commands without a response
+(EXIT, STDOUT, STDERR, STDIN_CREDIT, since version 9 also STDOUT_COMPRESSED, STDERR_COMPRESSED,
+since version 13 also WRITE_BATCH, since version 14 also EXIT_METRICS).
+Each frame:
+    OUT       4   length       number of bytes in the frame, 0 means end of input (final frame)
+    OUT       N   data         input data
+
+Command "STDIN_CREDIT" (since version 5):
+IN            4   cmd          Allow sending more input data (cmd=8)
+IN            4   credit       Number of bytes added to the window
+
+Command "READ_FILE" (since version 6):
+IN            4   cmd          Read a file (cmd=9)
+IN            4   path_len     number of bytes in file path
+IN            N   path         file path, relative paths are relative to stub's cwd
+OUT           4   status       0 on success, system error code otherwise (nothing more is sent on error)
+OUT           8   size         file size
+OUT           N   data         file content
+OUT           4   status       0 on success, non-zero if file could not be read completely, in that case
+                               the data was padded with zeros and must be discarded
+
+Command "WRITE_FILE" (since version 6):
+IN            4   cmd          Write a file (cmd=10)
+IN            4   path_len     number of bytes in file path
+IN            N   path         file path, relative paths are relative to stub's cwd
+IN            4   mode         file permissions, umask is applied, ignored on Windows
+IN            8   size         file size
+IN            N   data         file content
+OUT           4   status       0 on success, system error code otherwise
+The file is written to a temporary file in the same directory which is then atomically renamed.
+
+Command "HASH_FILES" (since version 7):
+IN            4   cmd          Hash files in parallel (cmd=11)
+IN            4   count        Number of files
+Repeat for each file:
+    IN        4   path_len[]   number of bytes in file path
+    IN        N   path[]       file path, relative paths are relative to stub's cwd
+OUT           4   hash_len     number of bytes in each hash
+Repeat for each file:
+    OUT       4   status       0 on success, system error code otherwise
+    OUT       8   size         file size
+    OUT       8   mtime        last modification time in nanoseconds since 1970-01-01 UTC
+    OUT       N   hash         file content hash, same format and algorithm as env_hash (zeros on error)
+
+Command "EXEC" (since version 8):
+IN            4   cmd          Execute a program and stream its output (cmd=12)
+IN            4   argc         number of arguments, the first one is the program, PATH is searched
+Repeat for each argument:
+    IN        4   argv_len[]   number of bytes in argument
+    IN        N   argv[]       argument
+IN            4   cwd_len      number of bytes in working directory path
+IN            N   cwd          working directory of the program, empty to use the stub's cwd
+IN            4   env_count    number of environment variables, 0xFFFFFFFF to inherit the stub's environment
+Repeat for each variable:
+    IN        4   env_len[]    number of bytes in environment variable string
+    IN        N   env[]        environment variable in "NAME=value" form
+The program inherits stub's stdin, its stdout and stderr are sent as frames as soon as the data
+is available. Until the final frame, controller may only send commands without a response
+(EXIT, EXIT_METRICS, STDOUT, STDERR, STDIN_CREDIT, WRITE_BATCH and compressed STDOUT, STDERR).
+EXEC is not allowed while standard input is forwarded.
+Each frame:
+    OUT       4   stream       1 - stdout, 2 - stderr, 0 - final frame
+    If stream is non-zero:
+    OUT       4   length       number of bytes in the frame
+    OUT       N   data         output data
+    If stream is zero:
+    OUT       4   status       exit code, 128 + signal number if killed, 127 if the program was not started
+    OUT       4   error        system error code if the program was not started, 0 otherwise
+    OUT       8   utime        user CPU time in microseconds
+    OUT       8   stime        system CPU time in microseconds
+    OUT       8   maxrss       peak resident set size in kilobytes
+    OUT       8   wall         wall time in nanoseconds
+
+Command "COMPRESSION" (since version 9):
+IN            4   cmd          Select payload compression (cmd=13)
+IN            4   algorithm    0 - none, 1 - LZ4 block format
+IN            4   threshold    blocks smaller than this number of bytes are not compressed by the stub
+OUT           4   algorithm    selected algorithm, 0 if the requested one is not supported
+When compression is selected, payload data of READ_FILE, WRITE_FILE and EXEC output frames
+(in both directions) is sent as a sequence of blocks instead of raw bytes. Blocks cover exactly
+the number of bytes given by the payload size field. Each block:
+    4   size         number of uncompressed bytes in the block, 1 to 65536
+    4   stored_size  number of bytes that follow, equal to size if the block is not compressed
+    N   data         LZ4 block or uncompressed data
+
+Command "STDOUT_COMPRESSED"/"STDERR_COMPRESSED" (since version 9):
+IN            4   cmd          Write to stdout (cmd=14) or stderr (cmd=15)
+IN            4   length       Length of the uncompressed string to write (in bytes)
+IN            N   blocks       String to write in the block format described above.
+These commands can be used regardless of the COMPRESSION command. Small messages should be sent
+with STDOUT/STDERR commands, because the block header costs 8 bytes.
+
+Command "TRACE" (since version 10):
+IN            4   cmd          Get timing trace of this invocation (cmd=16)
+OUT           4   count        Number of records, 0 if REMOTE_JOBS_TRACE is not set
+OUT           4   dropped      Number of records that did not fit in the trace buffer (the latest ones)
+Repeat for each record:
+    OUT       4   event        0 - start, 1 - process info collected, 2 - environment hash calculated,
+                               3 - connected, 4 - waiting for a command, 5 - command received,
+                               6 - command processed, 7 - jobserver token taken back,
+                               8 - local cache lookup done (since version 18),
+                               9 - handshake sent (since version 18)
+    OUT       4   arg          command number for events 5 and 6, wait time in microseconds for event 7,
+                               1 on a cache hit for event 8 (never seen by the controller), 0 otherwise
+    OUT       8   time         monotonic time in nanoseconds since the first record
+The last record is the TRACE command itself (event 5).
+
+Command "BUSY" (since version 11):
+IN            4   cmd          Run the tool locally instead (cmd=17)
+The stub disconnects and starts the local tool as described in "Local execution" above. Controller
+should send it as the first command, because the tool repeats everything from the beginning.
+
+Command "RESPONSE_FILES" (since version 12):
+IN            4   cmd          Expand response files given in arguments (cmd=18)
+IN            4   include_args 0 - send only hashes, 1 - send also expanded arguments
+OUT           4   hash_len     number of bytes in each hash
+OUT           4   count        Number of arguments starting with '@' (except the first argument)
+Repeat for each of them:
+    OUT       4   index        argument index
+    OUT       4   status       0 on success, system error code otherwise (the argument is used as is,
+                               like GCC does when a response file cannot be read)
+    OUT       N   hash         hash of the expanded arguments block below (zeros on error), same
+                               algorithm as env_hash, so the controller can cache the parsed list
+    If include_args is non-zero and status is 0:
+    OUT       4   argc         number of arguments in the response file
+    OUT       4   size         number of bytes of the arguments that follow
+    Repeat for each argument:
+        OUT   4   argv_len[]   number of bytes in argument
+        OUT   N   argv[]       argument
+Response files are split the same way as GCC does: whitespace separates arguments, single and
+double quotes group characters, backslash escapes any following character and nested response
+files are expanded in place (relative paths are relative to the stub's cwd). Expansion of more
+than 2000 files from one argument fails with ELOOP (ERROR_CANT_RESOLVE_FILENAME on Windows).
+Expansion with size over 4 GiB fails with EFBIG (ERROR_FILE_TOO_LARGE on Windows).
+
+Command "WRITE_BATCH" (since version 13):
+IN            4   cmd          Write multiple strings to stdout and stderr (cmd=19)
+IN            4   count        Number of segments, 1 to 1024
+IN            4   size         Total length of all segments, 8 * count + size must not exceed 65536
+Repeat for each segment:
+    IN        4   stream       1 - stdout, 2 - stderr
+    IN        4   length       Length of the segment (in bytes)
+IN            N   data         Data of all segments, one after another
+Consecutive segments of the same stream are written with a single system call, so relaying many
+small messages (e.g. compiler warnings line by line) costs a few calls per batch instead of a few
+calls per message. Segments are written in the order they are given.
+
+Command "EXIT_METRICS" (since version 14):
+IN            4   cmd          Exit command with job metrics (cmd=20)
+IN            4   status       Program exit status
+IN            4   count        Number of metrics that follow, the stub ignores metrics it does not know
+IN        8 * N   metrics      0 - time the job waited in the controller before it was started (nanoseconds),
+                               1 - remote wall time (nanoseconds), 2 - remote user CPU time (microseconds),
+                               3 - remote system CPU time (microseconds)
+Same as EXIT, but the metrics are also written to the REMOTE_JOBS_METRICS file (see "Metrics" above).
+
+Command "PHASE" (since version 16):
+IN            4   cmd          Set phase of the job (cmd=21)
+IN            4   phase        0 - job runs locally (e.g. before EXEC), 1 - job runs remotely
+See "Jobserver" above. The stub does not respond, so the command can be sent without waiting.
+
+Command "READ_FILE_BULK" (since version 17):
+IN            4   cmd          Read a file (cmd=22)
+IN            4   path_len     number of bytes in file path
+IN            N   path         file path, relative paths are relative to stub's cwd
+IN            4   threshold    files up to this size are sent inline
+OUT           4   status       0 on success, system error code otherwise (nothing more is sent on error)
+OUT           8   size         file size
+OUT           4   bulk         1 - the file is passed by a descriptor, 0 - its content is sent inline
+If bulk is 1:
+    OUT       4   pid          Process id of the stub
+    OUT       4   handle       Descriptor of the file in the stub process, also attached as SCM_RIGHTS
+                               ancillary data
+If bulk is 0 (the file is small or the platform does not support it), data and the final status
+follow as in READ_FILE.
+Large payloads do not go through the socket, which costs a copy into the socket buffers and
+a system call per chunk on both sides. The controller reads the file through the attached
+descriptor or, if it cannot receive ancillary data, opens /proc/<pid>/fd/<handle>. The stub
+keeps it open until the next READ_FILE_BULK or WRITE_FILE_BULK command. Small files should be
+sent inline, opening the descriptor costs more than they do. The pid is as seen by the stub, in
+another PID namespace it may belong to an unrelated process. A controller that cannot open the
+descriptor or confirm that the process is the stub should use READ_FILE and WRITE_FILE instead.
+
+Command "WRITE_FILE_BULK" (since version 17):
+IN            4   cmd          Write a file (cmd=23)
+IN            4   path_len     number of bytes in file path
+IN            N   path         file path, relative paths are relative to stub's cwd
+IN            4   mode         file permissions, umask is applied
+IN            8   size         file size
+OUT           4   status       0 on success, system error code otherwise (nothing more is sent on error)
+OUT           4   pid          Process id of the stub
+OUT           4   handle       Descriptor of the temporary file in the stub process, also attached as
+                               SCM_RIGHTS ancillary data
+IN            4   written      0 if the controller wrote the file content, non-zero to discard the file
+OUT           4   status       0 on success, system error code otherwise
+Same as WRITE_FILE, but the controller writes the content directly to the temporary file, see
+READ_FILE_BULK. The file is renamed when the controller confirms it was written.
+
 Command "VERSION_ERROR":
-IN            4   cmd          Any other value (cmd > 3) should be treated like a protocol version mismatch command.
+IN            4   cmd          Any other value should be treated like a protocol version mismatch command.
 
 */
@@ -18,48 +18,194 @@
 typedef WCHAR ichar;
 #define istrcmp wcscmp
 #define istrlen wcslen
+// Compares environment variable names, case-insensitive on Windows.
+#define ienvncmp _wcsnicmp
+#define RESPONSE_FILES_LOOP_ERROR ERROR_CANT_RESOLVE_FILENAME
+#define RESPONSE_FILES_SIZE_ERROR ERROR_FILE_TOO_LARGE
+typedef struct
+{
+    void *iov_base;
+    size_t iov_len;
+} io_vec;
 #else
+#include <sys/uio.h>
 typedef char ichar;
 #define istrcmp strcmp
 #define istrlen strlen
+#define ienvncmp strncmp
+#define RESPONSE_FILES_LOOP_ERROR ELOOP
+#define RESPONSE_FILES_SIZE_ERROR EFBIG
+typedef struct iovec io_vec;
 #endif
 
 #define CONNECTION_PREFIX "RemJobs75oKmnN7rWX"
 
+#define PROTOCOL_MAGIC 0x7F4A9400
+#define PROTOCOL_VERSION 18
+
+// Environment hash algorithms, sent in the first byte of the environment hash
+#define ENV_HASH_MD5 1
+#define ENV_HASH_FINGERPRINT 2
+
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+// Maximum number of threads used for hashing files.
+#define MAX_HASH_THREADS 16
+
+// Maximum number of buffers sent at once (Linux IOV_MAX).
+#define SEND_QUEUE_SIZE 1024
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// Payload compression algorithms, selected by the COMPRESSION command
+#define COMPRESSION_NONE 0
+#define COMPRESSION_LZ4 1
+
+// Trace events, recorded when REMOTE_JOBS_TRACE is set
+#define TRACE_START 0        // main() entered
+#define TRACE_PROCESS_INFO 1 // get_process_info() done
+#define TRACE_ENV_HASH 2     // calc_env_hash() done
+#define TRACE_CONNECT 3      // connect_to_controller() done
+#define TRACE_WAIT 4         // waiting for the next command
+#define TRACE_COMMAND 5      // command received, argument is the command number
+#define TRACE_COMMAND_END 6  // command processed, argument is the command number
+#define TRACE_JOBSERVER 7    // jobserver token taken back, argument is the wait time in microseconds
+#define TRACE_CACHE 8        // local cache lookup done, argument is 0 on a miss
+#define TRACE_HANDSHAKE 9    // handshake sent to the controller
+#define TRACE_MAX_RECORDS 4096
+
+// Events returned by process_wait()
+#define PROCESS_EVENT_DONE 0
+#define PROCESS_EVENT_STDOUT 1
+#define PROCESS_EVENT_STDERR 2
+#define PROCESS_EVENT_CONTROLLER 3
+
+// Maximum number of response files expanded by the RESPONSE_FILES command (the same limit as GCC).
+#define MAX_RESPONSE_FILES 2000
+
+// Maximum number of segments in the WRITE_BATCH command (Linux IOV_MAX).
+#define WRITE_BATCH_MAX_SEGMENTS 1024
+
+// Metrics sent by the controller with the EXIT_METRICS command
+#define METRIC_QUEUE_TIME 0  // time the job waited in the controller (nanoseconds)
+#define METRIC_WALL_TIME 1   // remote wall time (nanoseconds)
+#define METRIC_USER_TIME 2   // remote user CPU time (microseconds)
+#define METRIC_SYSTEM_TIME 3 // remote system CPU time (microseconds)
+#define METRICS_COUNT 4
+
+// Job phases set by the PHASE command
+#define PHASE_LOCAL 0  // job runs on this machine, the stub holds its jobserver token
+#define PHASE_REMOTE 1 // job runs remotely, the token is given back to make
+
+// Local cache, see "Local cache" in main.c. Magic values contain the format version at lower 8 bits.
+#define CACHE_INDEX_MAGIC 0x7F4A9501
+#define CACHE_RECORD_MAGIC 0x7F4A9601
+#define CACHE_HEADER_SIZE 64
+#define CACHE_ENTRY_SIZE 64
+#define CACHE_PROBE_LENGTH 8 // number of slots where an entry may be placed
+
+// Exit status reported when a child process cannot be started.
+#define PROCESS_SPAWN_FAILED 127
+
 #ifndef MEMBER_SIZE
 #define MEMBER_SIZE(type, member) sizeof(((type *)0)->member)
 #endif
 
+// Result of a child process started by the EXEC command
+typedef struct
+{
+    uint32_t status;      // exit code, 128 + signal number if the process was killed
+    uint64_t user_time;   // in microseconds
+    uint64_t system_time; // in microseconds
+    uint64_t max_rss;     // peak resident set size in kilobytes
+    uint64_t wall_time;   // in nanoseconds
+} process_result;
+
 // Temporary buffer
 static uint8_t buffer[65536];
 
 // Process information
+static uint32_t ipid;
 static const ichar *icwd;
 static int iarg_count;
 static const ichar **iarg;
 static int ienv_count;
 static const ichar **ienv;
-static uint8_t env_hash[16];
+static uint64_t *ienv_hashes;
+
+// Standard input forwarding state
+static bool stdin_active;
+static uint32_t stdin_credit;
+static uint8_t env_hash[17];
+
+// Negotiated payload compression
+static uint32_t compression = COMPRESSION_NONE;
+static uint32_t compression_threshold;
+
+// Trace state
+static bool trace_enabled;
+
+// Number of system calls made by this invocation
+static uint32_t syscall_count;
+
+// Set while the jobserver token is given back to make
+static bool jobserver_released = false;
 
 // Functions implemented by the main file.
 static void test(bool cond, const char *message);
 static void send_all(const void *data, size_t size);
 static void send_int(uint32_t value);
+static void send_int64(uint64_t value);
+static void send_flush();
 static void recv_all(void *data, size_t size);
 static uint32_t recv_int();
+static uint64_t recv_int64();
+static void process_command(uint32_t cmd);
+static void send_payload(const uint8_t *data, size_t size);
+static size_t recv_payload_part(size_t max_size);
+static void write_output_all(int fd, const uint8_t *data, size_t size);
 
 // Functions implemented by the platform specific code.
 static void fatal(const char *message);
-static void connect_to_controller();
+static uint64_t get_time_ns();
+static bool connect_to_controller();
 static void disconnect_from_controller();
-static size_t send_part(const uint8_t *data, size_t max_size);
+static void install_cancel_handlers();
+static bool jobserver_open(const char *auth);
+static bool jobserver_release();
+static void jobserver_acquire();
+static void run_local_tool();
+static size_t send_vec_part(const io_vec *vec, int count);
+static size_t send_recv_part(const io_vec *vec, int count, uint8_t *data, size_t max_size, size_t *sent);
 static size_t recv_part(uint8_t *data, size_t max_size);
 static void send_str(const ichar *str);
+static ichar *recv_str();
+static ichar *str_from_utf8(const char *str);
 static void get_process_info(int argc, char *argv[]);
 static size_t write_output(int fd, const uint8_t *data, size_t size);
+static size_t write_output_vec(int fd, const io_vec *vec, int count);
+static size_t splice_output(int fd, size_t max_size);
+static uint32_t attach_stdio_handles();
+static bool wait_for_stdin();
+static size_t read_stdin(uint8_t *data, size_t max_size);
+static uint32_t open_file(const ichar *path, uint64_t *size);
+static uint32_t send_file(uint64_t size);
+static uint32_t recv_file(const ichar *path, uint32_t mode, uint64_t size);
+static bool bulk_read_file(uint32_t *handle);
+static uint32_t bulk_create_file(const ichar *path, uint32_t mode, uint64_t size, uint32_t *handle);
+static uint32_t bulk_finish_file(const ichar *path, uint32_t error);
+static uint32_t map_file(const ichar *path, const uint8_t **data, uint64_t *size, uint64_t *mtime);
+static void unmap_file(const uint8_t *data, uint64_t size);
+static uint32_t map_file_shared(const ichar *path, uint8_t **data, uint64_t *size);
+static uint32_t copy_file(const ichar *source, const ichar *path, uint32_t mode);
+static void run_parallel(void (*worker)(void *ctx, int index), void *ctx, int count, int max_threads);
+static uint32_t process_spawn(ichar **args, const ichar *cwd, ichar **env);
+static int process_wait(uint8_t *data, size_t max_size, size_t *size);
+static void process_finish(process_result *result);
+static void get_self_usage(process_result *result);
 
 #endif
@@ -32,6 +32,73 @@
                              ((uint32_t)ptr[(n)*4 + 2] << 16) | \
                              ((uint32_t)ptr[(n)*4 + 3] << 24))
 
+// All 64 steps of a block. X0(n) gets message word n the first time it is used, X(n) later.
+#define MD5_ROUNDS(a, b, c, d, X0, X) \
+    MD5_STEP(MD5_F, a, b, c, d, X0(0), 0xD76AA478, 7); \
+    MD5_STEP(MD5_F, d, a, b, c, X0(1), 0xE8C7B756, 12); \
+    MD5_STEP(MD5_F, c, d, a, b, X0(2), 0x242070DB, 17); \
+    MD5_STEP(MD5_F, b, c, d, a, X0(3), 0xC1BDCEEE, 22); \
+    MD5_STEP(MD5_F, a, b, c, d, X0(4), 0xF57C0FAF, 7); \
+    MD5_STEP(MD5_F, d, a, b, c, X0(5), 0x4787C62A, 12); \
+    MD5_STEP(MD5_F, c, d, a, b, X0(6), 0xA8304613, 17); \
+    MD5_STEP(MD5_F, b, c, d, a, X0(7), 0xFD469501, 22); \
+    MD5_STEP(MD5_F, a, b, c, d, X0(8), 0x698098D8, 7); \
+    MD5_STEP(MD5_F, d, a, b, c, X0(9), 0x8B44F7AF, 12); \
+    MD5_STEP(MD5_F, c, d, a, b, X0(10), 0xFFFF5BB1, 17); \
+    MD5_STEP(MD5_F, b, c, d, a, X0(11), 0x895CD7BE, 22); \
+    MD5_STEP(MD5_F, a, b, c, d, X0(12), 0x6B901122, 7); \
+    MD5_STEP(MD5_F, d, a, b, c, X0(13), 0xFD987193, 12); \
+    MD5_STEP(MD5_F, c, d, a, b, X0(14), 0xA679438E, 17); \
+    MD5_STEP(MD5_F, b, c, d, a, X0(15), 0x49B40821, 22); \
+    MD5_STEP(MD5_G, a, b, c, d, X(1), 0xF61E2562, 5); \
+    MD5_STEP(MD5_G, d, a, b, c, X(6), 0xC040B340, 9); \
+    MD5_STEP(MD5_G, c, d, a, b, X(11), 0x265E5A51, 14); \
+    MD5_STEP(MD5_G, b, c, d, a, X(0), 0xE9B6C7AA, 20); \
+    MD5_STEP(MD5_G, a, b, c, d, X(5), 0xD62F105D, 5); \
+    MD5_STEP(MD5_G, d, a, b, c, X(10), 0x02441453, 9); \
+    MD5_STEP(MD5_G, c, d, a, b, X(15), 0xD8A1E681, 14); \
+    MD5_STEP(MD5_G, b, c, d, a, X(4), 0xE7D3FBC8, 20); \
+    MD5_STEP(MD5_G, a, b, c, d, X(9), 0x21E1CDE6, 5); \
+    MD5_STEP(MD5_G, d, a, b, c, X(14), 0xC33707D6, 9); \
+    MD5_STEP(MD5_G, c, d, a, b, X(3), 0xF4D50D87, 14); \
+    MD5_STEP(MD5_G, b, c, d, a, X(8), 0x455A14ED, 20); \
+    MD5_STEP(MD5_G, a, b, c, d, X(13), 0xA9E3E905, 5); \
+    MD5_STEP(MD5_G, d, a, b, c, X(2), 0xFCEFA3F8, 9); \
+    MD5_STEP(MD5_G, c, d, a, b, X(7), 0x676F02D9, 14); \
+    MD5_STEP(MD5_G, b, c, d, a, X(12), 0x8D2A4C8A, 20); \
+    MD5_STEP(MD5_H, a, b, c, d, X(5), 0xFFFA3942, 4); \
+    MD5_STEP(MD5_H, d, a, b, c, X(8), 0x8771F681, 11); \
+    MD5_STEP(MD5_H, c, d, a, b, X(11), 0x6D9D6122, 16); \
+    MD5_STEP(MD5_H, b, c, d, a, X(14), 0xFDE5380C, 23); \
+    MD5_STEP(MD5_H, a, b, c, d, X(1), 0xA4BEEA44, 4); \
+    MD5_STEP(MD5_H, d, a, b, c, X(4), 0x4BDECFA9, 11); \
+    MD5_STEP(MD5_H, c, d, a, b, X(7), 0xF6BB4B60, 16); \
+    MD5_STEP(MD5_H, b, c, d, a, X(10), 0xBEBFBC70, 23); \
+    MD5_STEP(MD5_H, a, b, c, d, X(13), 0x289B7EC6, 4); \
+    MD5_STEP(MD5_H, d, a, b, c, X(0), 0xEAA127FA, 11); \
+    MD5_STEP(MD5_H, c, d, a, b, X(3), 0xD4EF3085, 16); \
+    MD5_STEP(MD5_H, b, c, d, a, X(6), 0x04881D05, 23); \
+    MD5_STEP(MD5_H, a, b, c, d, X(9), 0xD9D4D039, 4); \
+    MD5_STEP(MD5_H, d, a, b, c, X(12), 0xE6DB99E5, 11); \
+    MD5_STEP(MD5_H, c, d, a, b, X(15), 0x1FA27CF8, 16); \
+    MD5_STEP(MD5_H, b, c, d, a, X(2), 0xC4AC5665, 23); \
+    MD5_STEP(MD5_I, a, b, c, d, X(0), 0xF4292244, 6); \
+    MD5_STEP(MD5_I, d, a, b, c, X(7), 0x432AFF97, 10); \
+    MD5_STEP(MD5_I, c, d, a, b, X(14), 0xAB9423A7, 15); \
+    MD5_STEP(MD5_I, b, c, d, a, X(5), 0xFC93A039, 21); \
+    MD5_STEP(MD5_I, a, b, c, d, X(12), 0x655B59C3, 6); \
+    MD5_STEP(MD5_I, d, a, b, c, X(3), 0x8F0CCC92, 10); \
+    MD5_STEP(MD5_I, c, d, a, b, X(10), 0xFFEFF47D, 15); \
+    MD5_STEP(MD5_I, b, c, d, a, X(1), 0x85845DD1, 21); \
+    MD5_STEP(MD5_I, a, b, c, d, X(8), 0x6FA87E4F, 6); \
+    MD5_STEP(MD5_I, d, a, b, c, X(15), 0xFE2CE6E0, 10); \
+    MD5_STEP(MD5_I, c, d, a, b, X(6), 0xA3014314, 15); \
+    MD5_STEP(MD5_I, b, c, d, a, X(13), 0x4E0811A1, 21); \
+    MD5_STEP(MD5_I, a, b, c, d, X(4), 0xF7537E82, 6); \
+    MD5_STEP(MD5_I, d, a, b, c, X(11), 0xBD3AF235, 10); \
+    MD5_STEP(MD5_I, c, d, a, b, X(2), 0x2AD7D2BB, 15); \
+    MD5_STEP(MD5_I, b, c, d, a, X(9), 0xEB86D391, 21);
+
 typedef struct
 {
     uint32_t a;
@@ -65,73 +132,7 @@ static size_t md5_process_block(md5_ctx *ctx, const uint8_t *ptr, size_t size)
         cc = c;
         dd = d;
 
-        MD5_STEP(MD5_F, a, b, c, d, MD5_TEMP_SET(0), 0xD76AA478, 7);
-        MD5_STEP(MD5_F, d, a, b, c, MD5_TEMP_SET(1), 0xE8C7B756, 12);
-        MD5_STEP(MD5_F, c, d, a, b, MD5_TEMP_SET(2), 0x242070DB, 17);
-        MD5_STEP(MD5_F, b, c, d, a, MD5_TEMP_SET(3), 0xC1BDCEEE, 22);
-        MD5_STEP(MD5_F, a, b, c, d, MD5_TEMP_SET(4), 0xF57C0FAF, 7);
-        MD5_STEP(MD5_F, d, a, b, c, MD5_TEMP_SET(5), 0x4787C62A, 12);
-        MD5_STEP(MD5_F, c, d, a, b, MD5_TEMP_SET(6), 0xA8304613, 17);
-        MD5_STEP(MD5_F, b, c, d, a, MD5_TEMP_SET(7), 0xFD469501, 22);
-        MD5_STEP(MD5_F, a, b, c, d, MD5_TEMP_SET(8), 0x698098D8, 7);
-        MD5_STEP(MD5_F, d, a, b, c, MD5_TEMP_SET(9), 0x8B44F7AF, 12);
-        MD5_STEP(MD5_F, c, d, a, b, MD5_TEMP_SET(10), 0xFFFF5BB1, 17);
-        MD5_STEP(MD5_F, b, c, d, a, MD5_TEMP_SET(11), 0x895CD7BE, 22);
-        MD5_STEP(MD5_F, a, b, c, d, MD5_TEMP_SET(12), 0x6B901122, 7);
-        MD5_STEP(MD5_F, d, a, b, c, MD5_TEMP_SET(13), 0xFD987193, 12);
-        MD5_STEP(MD5_F, c, d, a, b, MD5_TEMP_SET(14), 0xA679438E, 17);
-        MD5_STEP(MD5_F, b, c, d, a, MD5_TEMP_SET(15), 0x49B40821, 22);
-
-        MD5_STEP(MD5_G, a, b, c, d, MD5_TEMP_GET(1), 0xF61E2562, 5);
-        MD5_STEP(MD5_G, d, a, b, c, MD5_TEMP_GET(6), 0xC040B340, 9);
-        MD5_STEP(MD5_G, c, d, a, b, MD5_TEMP_GET(11), 0x265E5A51, 14);
-        MD5_STEP(MD5_G, b, c, d, a, MD5_TEMP_GET(0), 0xE9B6C7AA, 20);
-        MD5_STEP(MD5_G, a, b, c, d, MD5_TEMP_GET(5), 0xD62F105D, 5);
-        MD5_STEP(MD5_G, d, a, b, c, MD5_TEMP_GET(10), 0x02441453, 9);
-        MD5_STEP(MD5_G, c, d, a, b, MD5_TEMP_GET(15), 0xD8A1E681, 14);
-        MD5_STEP(MD5_G, b, c, d, a, MD5_TEMP_GET(4), 0xE7D3FBC8, 20);
-        MD5_STEP(MD5_G, a, b, c, d, MD5_TEMP_GET(9), 0x21E1CDE6, 5);
-        MD5_STEP(MD5_G, d, a, b, c, MD5_TEMP_GET(14), 0xC33707D6, 9);
-        MD5_STEP(MD5_G, c, d, a, b, MD5_TEMP_GET(3), 0xF4D50D87, 14);
-        MD5_STEP(MD5_G, b, c, d, a, MD5_TEMP_GET(8), 0x455A14ED, 20);
-        MD5_STEP(MD5_G, a, b, c, d, MD5_TEMP_GET(13), 0xA9E3E905, 5);
-        MD5_STEP(MD5_G, d, a, b, c, MD5_TEMP_GET(2), 0xFCEFA3F8, 9);
-        MD5_STEP(MD5_G, c, d, a, b, MD5_TEMP_GET(7), 0x676F02D9, 14);
-        MD5_STEP(MD5_G, b, c, d, a, MD5_TEMP_GET(12), 0x8D2A4C8A, 20);
-
-        MD5_STEP(MD5_H, a, b, c, d, MD5_TEMP_GET(5), 0xFFFA3942, 4);
-        MD5_STEP(MD5_H, d, a, b, c, MD5_TEMP_GET(8), 0x8771F681, 11);
-        MD5_STEP(MD5_H, c, d, a, b, MD5_TEMP_GET(11), 0x6D9D6122, 16);
-        MD5_STEP(MD5_H, b, c, d, a, MD5_TEMP_GET(14), 0xFDE5380C, 23);
-        MD5_STEP(MD5_H, a, b, c, d, MD5_TEMP_GET(1), 0xA4BEEA44, 4);
-        MD5_STEP(MD5_H, d, a, b, c, MD5_TEMP_GET(4), 0x4BDECFA9, 11);
-        MD5_STEP(MD5_H, c, d, a, b, MD5_TEMP_GET(7), 0xF6BB4B60, 16);
-        MD5_STEP(MD5_H, b, c, d, a, MD5_TEMP_GET(10), 0xBEBFBC70, 23);
-        MD5_STEP(MD5_H, a, b, c, d, MD5_TEMP_GET(13), 0x289B7EC6, 4);
-        MD5_STEP(MD5_H, d, a, b, c, MD5_TEMP_GET(0), 0xEAA127FA, 11);
-        MD5_STEP(MD5_H, c, d, a, b, MD5_TEMP_GET(3), 0xD4EF3085, 16);
-        MD5_STEP(MD5_H, b, c, d, a, MD5_TEMP_GET(6), 0x04881D05, 23);
-        MD5_STEP(MD5_H, a, b, c, d, MD5_TEMP_GET(9), 0xD9D4D039, 4);
-        MD5_STEP(MD5_H, d, a, b, c, MD5_TEMP_GET(12), 0xE6DB99E5, 11);
-        MD5_STEP(MD5_H, c, d, a, b, MD5_TEMP_GET(15), 0x1FA27CF8, 16);
-        MD5_STEP(MD5_H, b, c, d, a, MD5_TEMP_GET(2), 0xC4AC5665, 23);
-
-        MD5_STEP(MD5_I, a, b, c, d, MD5_TEMP_GET(0), 0xF4292244, 6);
-        MD5_STEP(MD5_I, d, a, b, c, MD5_TEMP_GET(7), 0x432AFF97, 10);
-        MD5_STEP(MD5_I, c, d, a, b, MD5_TEMP_GET(14), 0xAB9423A7, 15);
-        MD5_STEP(MD5_I, b, c, d, a, MD5_TEMP_GET(5), 0xFC93A039, 21);
-        MD5_STEP(MD5_I, a, b, c, d, MD5_TEMP_GET(12), 0x655B59C3, 6);
-        MD5_STEP(MD5_I, d, a, b, c, MD5_TEMP_GET(3), 0x8F0CCC92, 10);
-        MD5_STEP(MD5_I, c, d, a, b, MD5_TEMP_GET(10), 0xFFEFF47D, 15);
-        MD5_STEP(MD5_I, b, c, d, a, MD5_TEMP_GET(1), 0x85845DD1, 21);
-        MD5_STEP(MD5_I, a, b, c, d, MD5_TEMP_GET(8), 0x6FA87E4F, 6);
-        MD5_STEP(MD5_I, d, a, b, c, MD5_TEMP_GET(15), 0xFE2CE6E0, 10);
-        MD5_STEP(MD5_I, c, d, a, b, MD5_TEMP_GET(6), 0xA3014314, 15);
-        MD5_STEP(MD5_I, b, c, d, a, MD5_TEMP_GET(13), 0x4E0811A1, 21);
-        MD5_STEP(MD5_I, a, b, c, d, MD5_TEMP_GET(4), 0xF7537E82, 6);
-        MD5_STEP(MD5_I, d, a, b, c, MD5_TEMP_GET(11), 0xBD3AF235, 10);
-        MD5_STEP(MD5_I, c, d, a, b, MD5_TEMP_GET(2), 0x2AD7D2BB, 15);
-        MD5_STEP(MD5_I, b, c, d, a, MD5_TEMP_GET(9), 0xEB86D391, 21);
+        MD5_ROUNDS(a, b, c, d, MD5_TEMP_SET, MD5_TEMP_GET);
 
         a += aa;
         b += bb;
@@ -191,6 +192,26 @@ static void md5_update(md5_ctx *ctx, const uint8_t *buffer, size_t buffer_size)
     }
 }
 
+static void md5_store_digest(uint8_t *digest, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    digest[0] = (uint8_t)(a);
+    digest[1] = (uint8_t)(a >> 8);
+    digest[2] = (uint8_t)(a >> 16);
+    digest[3] = (uint8_t)(a >> 24);
+    digest[4] = (uint8_t)(b);
+    digest[5] = (uint8_t)(b >> 8);
+    digest[6] = (uint8_t)(b >> 16);
+    digest[7] = (uint8_t)(b >> 24);
+    digest[8] = (uint8_t)(c);
+    digest[9] = (uint8_t)(c >> 8);
+    digest[10] = (uint8_t)(c >> 16);
+    digest[11] = (uint8_t)(c >> 24);
+    digest[12] = (uint8_t)(d);
+    digest[13] = (uint8_t)(d >> 8);
+    digest[14] = (uint8_t)(d >> 16);
+    digest[15] = (uint8_t)(d >> 24);
+}
+
 static void md5_digest(md5_ctx *ctx, uint8_t *digest)
 {
     size_t free;
@@ -222,22 +243,231 @@ static void md5_digest(md5_ctx *ctx, uint8_t *digest)
 
     md5_process_block(ctx, ctx->buffer, 64);
 
-    digest[0] = (uint8_t)(ctx->a);
-    digest[1] = (uint8_t)(ctx->a >> 8);
-    digest[2] = (uint8_t)(ctx->a >> 16);
-    digest[3] = (uint8_t)(ctx->a >> 24);
-    digest[4] = (uint8_t)(ctx->b);
-    digest[5] = (uint8_t)(ctx->b >> 8);
-    digest[6] = (uint8_t)(ctx->b >> 16);
-    digest[7] = (uint8_t)(ctx->b >> 24);
-    digest[8] = (uint8_t)(ctx->c);
-    digest[9] = (uint8_t)(ctx->c >> 8);
-    digest[10] = (uint8_t)(ctx->c >> 16);
-    digest[11] = (uint8_t)(ctx->c >> 24);
-    digest[12] = (uint8_t)(ctx->d);
-    digest[13] = (uint8_t)(ctx->d >> 8);
-    digest[14] = (uint8_t)(ctx->d >> 16);
-    digest[15] = (uint8_t)(ctx->d >> 24);
+    md5_store_digest(digest, ctx->a, ctx->b, ctx->c, ctx->d);
+}
+
+/*
+Multi-buffer MD5.
+
+Blocks of one message depend on each other, so a single MD5 cannot use SIMD. Independent
+messages (environment variables, files) are hashed in lanes instead: each lane of a vector
+register holds the state of a different message, so one vector instruction does the same step
+for 4 (SSE2, NEON), 8 (AVX2) or 16 (AVX-512) messages. Lanes are refilled with the next message
+as soon as their message is finished, so messages of different sizes keep all lanes busy until
+the last ones. The widest kernel supported by the CPU is selected at run time. Digests are
+identical to md5_init/md5_update/md5_digest.
+*/
+
+#define MD5_MAX_LANES 16
+
+// Message words of one block for each lane: lanes_w[word][lane].
+typedef uint32_t md5_lanes_words[16][MD5_MAX_LANES];
+// State of each lane: lanes_state[a, b, c or d][lane].
+typedef uint32_t md5_lanes_state[4][MD5_MAX_LANES];
+typedef void (*md5_lanes_kernel)(md5_lanes_state state, const md5_lanes_words w);
+
+typedef struct
+{
+    const uint8_t *data; // next full block of the message
+    size_t blocks;       // number of full blocks left
+    int tail_blocks;     // number of padded blocks left after them
+    int tail_index;
+    int message;         // index of the message, -1 if the lane is free
+    uint8_t tail[128];   // last bytes of the message with the padding and the length
+} md5_lane;
+
+static int md5_lanes_count = 0;
+static md5_lanes_kernel md5_lanes_process;
+
+#define MD5_LANES_W(n) (*(const md5_vec *)w[(n)])
+
+// Kernel for vector type `type` of `lanes` 32-bit lanes. `attr` enables the instruction set.
+#define MD5_LANES_KERNEL(name, type, attr)                                   \
+    attr static void name(md5_lanes_state state, const md5_lanes_words w)    \
+    {                                                                        \
+        typedef type md5_vec;                                                \
+        md5_vec a = *(md5_vec *)state[0];                                    \
+        md5_vec b = *(md5_vec *)state[1];                                    \
+        md5_vec c = *(md5_vec *)state[2];                                    \
+        md5_vec d = *(md5_vec *)state[3];                                    \
+        MD5_ROUNDS(a, b, c, d, MD5_LANES_W, MD5_LANES_W);                    \
+        *(md5_vec *)state[0] += a;                                           \
+        *(md5_vec *)state[1] += b;                                           \
+        *(md5_vec *)state[2] += c;                                           \
+        *(md5_vec *)state[3] += d;                                           \
+    }
+
+typedef uint32_t md5_vec4 __attribute__((vector_size(16)));
+MD5_LANES_KERNEL(md5_lanes_process4, md5_vec4, )
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MD5_LANES_X86 1
+typedef uint32_t md5_vec8 __attribute__((vector_size(32)));
+typedef uint32_t md5_vec16 __attribute__((vector_size(64)));
+MD5_LANES_KERNEL(md5_lanes_process8, md5_vec8, __attribute__((target("avx2"))))
+MD5_LANES_KERNEL(md5_lanes_process16, md5_vec16, __attribute__((target("avx512f"))))
+#endif
+
+// Selects the widest kernel supported by the CPU with at most max_lanes lanes, 1 means scalar
+// code. Returns the number of lanes. It is called on the first use of md5_multi(), call it
+// before starting threads to avoid the race.
+static int md5_multi_init(int max_lanes)
+{
+    md5_lanes_count = 1;
+#ifdef MD5_LANES_X86
+    __builtin_cpu_init();
+    if (max_lanes >= 16 && __builtin_cpu_supports("avx512f"))
+    {
+        md5_lanes_count = 16;
+        md5_lanes_process = md5_lanes_process16;
+    }
+    else if (max_lanes >= 8 && __builtin_cpu_supports("avx2"))
+    {
+        md5_lanes_count = 8;
+        md5_lanes_process = md5_lanes_process8;
+    }
+    else
+#endif
+    if (max_lanes >= 4)
+    {
+        md5_lanes_count = 4;
+        md5_lanes_process = md5_lanes_process4;
+    }
+    return md5_lanes_count;
+}
+
+static void md5_lane_start(md5_lane *lane, md5_lanes_state state, int i, const uint8_t *data, size_t size)
+{
+    uint64_t bits_count = (uint64_t)size << 3;
+    size_t used = size & 63;
+    uint8_t *end;
+
+    lane->data = data;
+    lane->blocks = size >> 6;
+    lane->tail_blocks = used < 56 ? 1 : 2;
+    lane->tail_index = 0;
+    memcpy(lane->tail, data + size - used, used);
+    lane->tail[used] = 0x80;
+    end = &lane->tail[64 * lane->tail_blocks - 8];
+    memset(&lane->tail[used + 1], 0, end - &lane->tail[used + 1]);
+    end[0] = (uint8_t)(bits_count >> 0);
+    end[1] = (uint8_t)(bits_count >> 8);
+    end[2] = (uint8_t)(bits_count >> 16);
+    end[3] = (uint8_t)(bits_count >> 24);
+    end[4] = (uint8_t)(bits_count >> 32);
+    end[5] = (uint8_t)(bits_count >> 40);
+    end[6] = (uint8_t)(bits_count >> 48);
+    end[7] = (uint8_t)(bits_count >> 56);
+    state[0][i] = 0x67452301;
+    state[1][i] = 0xEFCDAB89;
+    state[2][i] = 0x98BADCFE;
+    state[3][i] = 0x10325476;
+}
+
+// Finishes the message of the lane with scalar code, when no other lanes are busy.
+static void md5_lane_finish(md5_lane *lane, md5_lanes_state state, int i, uint8_t *digest)
+{
+    md5_ctx ctx;
+    ctx.a = state[0][i];
+    ctx.b = state[1][i];
+    ctx.c = state[2][i];
+    ctx.d = state[3][i];
+    md5_process_block(&ctx, lane->data, lane->blocks * 64);
+    md5_process_block(&ctx, &lane->tail[64 * lane->tail_index], 64 * lane->tail_blocks);
+    md5_store_digest(digest, ctx.a, ctx.b, ctx.c, ctx.d);
+}
+
+// Hashes `count` independent messages, 16-byte digest of message i is written to digests + 16 * i.
+static void md5_multi(const uint8_t *const *data, const size_t *sizes, int count, uint8_t *digests)
+{
+    __attribute__((aligned(64))) md5_lanes_state state;
+    __attribute__((aligned(64))) md5_lanes_words w;
+    md5_lane lanes[MD5_MAX_LANES];
+    md5_ctx ctx;
+    int next = 0;
+    int active = 0;
+    int i, k;
+
+    if (md5_lanes_count == 0)
+    {
+        md5_multi_init(MD5_MAX_LANES);
+    }
+    if (md5_lanes_count == 1 || count == 1)
+    {
+        for (i = 0; i < count; i++)
+        {
+            md5_init(&ctx);
+            md5_update(&ctx, data[i], sizes[i]);
+            md5_digest(&ctx, &digests[16 * i]);
+        }
+        return;
+    }
+    for (i = 0; i < md5_lanes_count; i++)
+    {
+        lanes[i].message = -1;
+    }
+    while (true)
+    {
+        for (i = 0; i < md5_lanes_count && next < count; i++)
+        {
+            if (lanes[i].message < 0)
+            {
+                md5_lane_start(&lanes[i], state, i, data[next], sizes[next]);
+                lanes[i].message = next++;
+                active++;
+            }
+        }
+        if (active == 0)
+        {
+            break;
+        }
+        else if (active == 1 && next == count)
+        {
+            // Vector kernel would waste all other lanes, e.g. on the tail of a big file.
+            for (i = 0; lanes[i].message < 0; i++)
+            {
+            }
+            md5_lane_finish(&lanes[i], state, i, &digests[16 * lanes[i].message]);
+            break;
+        }
+        for (i = 0; i < md5_lanes_count; i++)
+        {
+            md5_lane *lane = &lanes[i];
+            const uint8_t *ptr;
+            if (lane->message < 0)
+            {
+                continue;
+            }
+            if (lane->blocks > 0)
+            {
+                ptr = lane->data;
+                lane->data += 64;
+                lane->blocks--;
+            }
+            else
+            {
+                ptr = &lane->tail[64 * lane->tail_index];
+                lane->tail_index++;
+                lane->tail_blocks--;
+            }
+            for (k = 0; k < 16; k++)
+            {
+                w[k][i] = ((uint32_t)ptr[k * 4 + 0] << 0) | ((uint32_t)ptr[k * 4 + 1] << 8) |
+                          ((uint32_t)ptr[k * 4 + 2] << 16) | ((uint32_t)ptr[k * 4 + 3] << 24);
+            }
+        }
+        md5_lanes_process(state, (const uint32_t(*)[MD5_MAX_LANES])w);
+        for (i = 0; i < md5_lanes_count; i++)
+        {
+            md5_lane *lane = &lanes[i];
+            if (lane->message >= 0 && lane->blocks == 0 && lane->tail_blocks == 0)
+            {
+                md5_store_digest(&digests[16 * lane->message], state[0][i], state[1][i], state[2][i], state[3][i]);
+                lane->message = -1;
+                active--;
+            }
+        }
+    }
 }
 
 #endif /* _MD5_H_ */